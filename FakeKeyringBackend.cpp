@@ -0,0 +1,574 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "FakeKeyringBackend.h"
+#include "KeyringStats.h"
+
+#include <string.h>
+
+struct FakeKeyringBackend::Item
+{
+  GnomeKeyringItemType type;
+  char *displayName;
+  GnomeKeyringAttributeList *attributes;
+  char *secret;
+};
+
+struct FakeKeyringBackend::Keyring
+{
+  // item id -> Item*
+  GHashTable *items;
+  guint32 nextId;
+  PRInt64 mtime;
+};
+
+static void
+freeItem(gpointer aData)
+{
+  FakeKeyringBackend::Item *item =
+    static_cast<FakeKeyringBackend::Item*>(aData);
+
+  g_free(item->displayName);
+  gnome_keyring_attribute_list_free(item->attributes);
+  gnome_keyring_free_password(item->secret);
+  delete item;
+}
+
+static void
+freeKeyring(gpointer aData)
+{
+  FakeKeyringBackend::Keyring *keyring =
+    static_cast<FakeKeyringBackend::Keyring*>(aData);
+
+  g_hash_table_destroy(keyring->items);
+  delete keyring;
+}
+
+// Whether aList has an attribute of the same name, type and value as aAttr
+static PRBool
+hasAttribute(GnomeKeyringAttributeList *aList, GnomeKeyringAttribute *aAttr)
+{
+  GnomeKeyringAttribute *attrArray = (GnomeKeyringAttribute *)aList->data;
+
+  for (PRUint32 i = 0; i < aList->len; i++) {
+    if (attrArray[i].type != aAttr->type ||
+        strcmp(attrArray[i].name, aAttr->name))
+      continue;
+    if (aAttr->type == GNOME_KEYRING_ATTRIBUTE_TYPE_STRING ?
+          !strcmp(attrArray[i].value.string, aAttr->value.string) :
+          attrArray[i].value.integer == aAttr->value.integer)
+      return PR_TRUE;
+  }
+  return PR_FALSE;
+}
+
+// Whether aAttributes holds every attribute of aQuery
+static PRBool
+matches(GnomeKeyringAttributeList *aAttributes,
+        GnomeKeyringAttributeList *aQuery)
+{
+  GnomeKeyringAttribute *attrArray = (GnomeKeyringAttribute *)aQuery->data;
+
+  for (PRUint32 i = 0; i < aQuery->len; i++) {
+    if (!hasAttribute(aAttributes, &attrArray[i]))
+      return PR_FALSE;
+  }
+  return PR_TRUE;
+}
+
+FakeKeyringBackend::FakeKeyringBackend(PRUint32 aSeed)
+  : mLatency(0),
+    mJitter(0),
+    mRandom(aSeed ? aSeed : 1),
+    mCalls(0),
+    mClock(1)
+{
+  mLock = PR_NewLock();
+  mKeyrings = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                    g_free, freeKeyring);
+}
+
+FakeKeyringBackend::~FakeKeyringBackend()
+{
+  g_hash_table_destroy(mKeyrings);
+  PR_DestroyLock(mLock);
+}
+
+void
+FakeKeyringBackend::SetLatency(PRUint32 aLatency, PRUint32 aJitter)
+{
+  PR_Lock(mLock);
+  mLatency = aLatency;
+  mJitter = aJitter;
+  PR_Unlock(mLock);
+}
+
+PRUint32
+FakeKeyringBackend::Calls()
+{
+  PR_Lock(mLock);
+  PRUint32 calls = mCalls;
+  PR_Unlock(mLock);
+  return calls;
+}
+
+PRUint32
+FakeKeyringBackend::startCall()
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  PR_Lock(mLock);
+  mCalls++;
+  PRUint32 delay = mLatency;
+  if (mJitter) {
+    // xorshift32, enough for spreading delays
+    mRandom ^= mRandom << 13;
+    mRandom ^= mRandom >> 17;
+    mRandom ^= mRandom << 5;
+    delay += mRandom % (mJitter + 1);
+  }
+  PR_Unlock(mLock);
+  return delay;
+}
+
+void
+FakeKeyringBackend::wait()
+{
+  PRUint32 delay = startCall();
+  if (delay)
+    g_usleep(delay);
+}
+
+void
+FakeKeyringBackend::touch(Keyring *aKeyring)
+{
+  aKeyring->mtime = ++mClock;
+}
+
+FakeKeyringBackend::Item *
+FakeKeyringBackend::lookupItem(const char *aKeyring, guint32 aItemId,
+                               Keyring **aOwner)
+{
+  Keyring *keyring =
+    static_cast<Keyring*>(g_hash_table_lookup(mKeyrings, aKeyring));
+  if (!keyring)
+    return NULL;
+  if (aOwner)
+    *aOwner = keyring;
+  return static_cast<Item*>(g_hash_table_lookup(keyring->items,
+                                                GUINT_TO_POINTER(aItemId)));
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::CreateKeyring(const char *aKeyring)
+{
+  wait();
+
+  PR_Lock(mLock);
+  GnomeKeyringResult result = GNOME_KEYRING_RESULT_ALREADY_EXISTS;
+  if (!g_hash_table_lookup(mKeyrings, aKeyring)) {
+    Keyring *keyring = new Keyring;
+    keyring->items = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, freeItem);
+    keyring->nextId = 1;
+    touch(keyring);
+    g_hash_table_insert(mKeyrings, g_strdup(aKeyring), keyring);
+    result = GNOME_KEYRING_RESULT_OK;
+  }
+  PR_Unlock(mLock);
+  return result;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::DeleteKeyring(const char *aKeyring)
+{
+  wait();
+
+  PR_Lock(mLock);
+  gboolean removed = g_hash_table_remove(mKeyrings, aKeyring);
+  PR_Unlock(mLock);
+  return removed ? GNOME_KEYRING_RESULT_OK :
+                   GNOME_KEYRING_RESULT_NO_SUCH_KEYRING;
+}
+
+static void
+collectName(gpointer key, gpointer value, gpointer data)
+{
+  GList **names = static_cast<GList**>(data);
+  *names = g_list_prepend(*names, g_strdup(static_cast<const char*>(key)));
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::ListKeyrings(GList **aNames)
+{
+  wait();
+
+  *aNames = NULL;
+  PR_Lock(mLock);
+  g_hash_table_foreach(mKeyrings, collectName, aNames);
+  PR_Unlock(mLock);
+  return GNOME_KEYRING_RESULT_OK;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::GetKeyringInfo(const char *aKeyring, PRBool *aLocked,
+                                   PRInt64 *aMtime)
+{
+  wait();
+
+  PR_Lock(mLock);
+  Keyring *keyring =
+    static_cast<Keyring*>(g_hash_table_lookup(mKeyrings, aKeyring));
+  if (keyring) {
+    *aLocked = PR_FALSE;
+    *aMtime = keyring->mtime;
+  }
+  PR_Unlock(mLock);
+  return keyring ? GNOME_KEYRING_RESULT_OK :
+                   GNOME_KEYRING_RESULT_NO_SUCH_KEYRING;
+}
+
+static void
+collectId(gpointer key, gpointer value, gpointer data)
+{
+  GList **ids = static_cast<GList**>(data);
+  *ids = g_list_prepend(*ids, key);
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::ListItemIds(const char *aKeyring, GList **aIds)
+{
+  wait();
+
+  *aIds = NULL;
+  PR_Lock(mLock);
+  Keyring *keyring =
+    static_cast<Keyring*>(g_hash_table_lookup(mKeyrings, aKeyring));
+  if (keyring)
+    g_hash_table_foreach(keyring->items, collectId, aIds);
+  PR_Unlock(mLock);
+  return keyring ? GNOME_KEYRING_RESULT_OK :
+                   GNOME_KEYRING_RESULT_NO_SUCH_KEYRING;
+}
+
+struct FindState
+{
+  const char *keyring;
+  GnomeKeyringItemType type;
+  GnomeKeyringAttributeList *query;
+  GList *found;
+};
+
+static void
+findInKeyring(gpointer key, gpointer value, gpointer data)
+{
+  FindState *state = static_cast<FindState*>(data);
+  FakeKeyringBackend::Item *item = static_cast<FakeKeyringBackend::Item*>(value);
+
+  if (item->type != state->type || !matches(item->attributes, state->query))
+    return;
+
+  GnomeKeyringFound *found = g_new0(GnomeKeyringFound, 1);
+  found->keyring = g_strdup(state->keyring);
+  found->item_id = GPOINTER_TO_UINT(key);
+  found->attributes = gnome_keyring_attribute_list_copy(item->attributes);
+  found->secret = gnome_keyring_memory_strdup(item->secret);
+  state->found = g_list_prepend(state->found, found);
+}
+
+static void
+findInKeyrings(gpointer key, gpointer value, gpointer data)
+{
+  FindState *state = static_cast<FindState*>(data);
+
+  state->keyring = static_cast<const char*>(key);
+  g_hash_table_foreach(static_cast<FakeKeyringBackend::Keyring*>(value)->items,
+                       findInKeyring, state);
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::FindItems(GnomeKeyringItemType aType,
+                              GnomeKeyringAttributeList *aAttributes,
+                              GList **aFound)
+{
+  wait();
+
+  FindState state = { NULL, aType, aAttributes, NULL };
+  PR_Lock(mLock);
+  g_hash_table_foreach(mKeyrings, findInKeyrings, &state);
+  PR_Unlock(mLock);
+
+  // Like the daemon, which reports an empty search as NO_MATCH
+  KeyringStats::CountFound(state.found);
+  *aFound = state.found;
+  return state.found ? GNOME_KEYRING_RESULT_OK : GNOME_KEYRING_RESULT_NO_MATCH;
+}
+
+struct SameItemState
+{
+  GnomeKeyringItemType type;
+  GnomeKeyringAttributeList *attributes;
+  guint32 id;
+};
+
+static void
+findSameItem(gpointer key, gpointer value, gpointer data)
+{
+  SameItemState *state = static_cast<SameItemState*>(data);
+  FakeKeyringBackend::Item *item = static_cast<FakeKeyringBackend::Item*>(value);
+
+  if (!state->id && item->type == state->type &&
+      item->attributes->len == state->attributes->len &&
+      matches(item->attributes, state->attributes))
+    state->id = GPOINTER_TO_UINT(key);
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::createItem(const char *aKeyring,
+                               GnomeKeyringItemType aType,
+                               const char *aDisplayName,
+                               GnomeKeyringAttributeList *aAttributes,
+                               const char *aSecret,
+                               guint32 *aItemId)
+{
+  Keyring *keyring =
+    static_cast<Keyring*>(g_hash_table_lookup(mKeyrings, aKeyring));
+  if (!keyring)
+    return GNOME_KEYRING_RESULT_NO_SUCH_KEYRING;
+
+  // Like update_if_exists of gnome_keyring_item_create
+  SameItemState state = { aType, aAttributes, 0 };
+  g_hash_table_foreach(keyring->items, findSameItem, &state);
+
+  Item *item;
+  if (state.id) {
+    item = static_cast<Item*>(g_hash_table_lookup(keyring->items,
+                                                  GUINT_TO_POINTER(state.id)));
+    g_free(item->displayName);
+    gnome_keyring_free_password(item->secret);
+  } else {
+    state.id = keyring->nextId++;
+    item = new Item;
+    item->type = aType;
+    item->attributes = gnome_keyring_attribute_list_copy(aAttributes);
+    g_hash_table_insert(keyring->items, GUINT_TO_POINTER(state.id), item);
+  }
+  item->displayName = g_strdup(aDisplayName);
+  item->secret = gnome_keyring_memory_strdup(aSecret);
+  touch(keyring);
+
+  *aItemId = state.id;
+  return GNOME_KEYRING_RESULT_OK;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::CreateItem(const char *aKeyring,
+                               GnomeKeyringItemType aType,
+                               const char *aDisplayName,
+                               GnomeKeyringAttributeList *aAttributes,
+                               const char *aSecret,
+                               guint32 *aItemId)
+{
+  wait();
+
+  PR_Lock(mLock);
+  GnomeKeyringResult result = createItem(aKeyring, aType, aDisplayName,
+                                         aAttributes, aSecret, aItemId);
+  PR_Unlock(mLock);
+  return result;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::deleteItem(const char *aKeyring, guint32 aItemId)
+{
+  Keyring *keyring = NULL;
+  if (!lookupItem(aKeyring, aItemId, &keyring))
+    return keyring ? GNOME_KEYRING_RESULT_BAD_ARGUMENTS :
+                     GNOME_KEYRING_RESULT_NO_SUCH_KEYRING;
+
+  g_hash_table_remove(keyring->items, GUINT_TO_POINTER(aItemId));
+  touch(keyring);
+  return GNOME_KEYRING_RESULT_OK;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::DeleteItem(const char *aKeyring, guint32 aItemId)
+{
+  wait();
+
+  PR_Lock(mLock);
+  GnomeKeyringResult result = deleteItem(aKeyring, aItemId);
+  PR_Unlock(mLock);
+  return result;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::GetAttributes(const char *aKeyring, guint32 aItemId,
+                                  GnomeKeyringAttributeList **aAttributes)
+{
+  wait();
+
+  PR_Lock(mLock);
+  Item *item = lookupItem(aKeyring, aItemId, NULL);
+  if (item)
+    *aAttributes = gnome_keyring_attribute_list_copy(item->attributes);
+  PR_Unlock(mLock);
+  if (item)
+    KeyringStats::Count(KeyringStats::kItemsReceived);
+  return item ? GNOME_KEYRING_RESULT_OK : GNOME_KEYRING_RESULT_BAD_ARGUMENTS;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::setAttributes(const char *aKeyring, guint32 aItemId,
+                                  GnomeKeyringAttributeList *aAttributes)
+{
+  Keyring *keyring;
+  Item *item = lookupItem(aKeyring, aItemId, &keyring);
+  if (!item)
+    return GNOME_KEYRING_RESULT_BAD_ARGUMENTS;
+
+  gnome_keyring_attribute_list_free(item->attributes);
+  item->attributes = gnome_keyring_attribute_list_copy(aAttributes);
+  touch(keyring);
+  return GNOME_KEYRING_RESULT_OK;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::SetAttributes(const char *aKeyring, guint32 aItemId,
+                                  GnomeKeyringAttributeList *aAttributes)
+{
+  wait();
+
+  PR_Lock(mLock);
+  GnomeKeyringResult result = setAttributes(aKeyring, aItemId, aAttributes);
+  PR_Unlock(mLock);
+  return result;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::GetSecret(const char *aKeyring, guint32 aItemId,
+                              char **aSecret)
+{
+  wait();
+
+  PR_Lock(mLock);
+  Item *item = lookupItem(aKeyring, aItemId, NULL);
+  if (item)
+    *aSecret = gnome_keyring_memory_strdup(item->secret);
+  PR_Unlock(mLock);
+  if (item)
+    KeyringStats::CountSecret(*aSecret);
+  return item ? GNOME_KEYRING_RESULT_OK : GNOME_KEYRING_RESULT_BAD_ARGUMENTS;
+}
+
+GnomeKeyringResult
+FakeKeyringBackend::SetSecret(const char *aKeyring, guint32 aItemId,
+                              GnomeKeyringItemType aType,
+                              const char *aDisplayName,
+                              const char *aSecret)
+{
+  wait();
+
+  PR_Lock(mLock);
+  Keyring *keyring;
+  Item *item = lookupItem(aKeyring, aItemId, &keyring);
+  if (item) {
+    item->type = aType;
+    g_free(item->displayName);
+    item->displayName = g_strdup(aDisplayName);
+    gnome_keyring_free_password(item->secret);
+    item->secret = gnome_keyring_memory_strdup(aSecret);
+    touch(keyring);
+  }
+  PR_Unlock(mLock);
+  return item ? GNOME_KEYRING_RESULT_OK : GNOME_KEYRING_RESULT_BAD_ARGUMENTS;
+}
+
+/* The change is applied right away, the reply comes once the latency
+ * elapsed, from the thread default main context like those of the
+ * daemon. */
+void
+FakeKeyringBackend::replyLater(GnomeKeyringResult aResult, guint32 aValue,
+                               GnomeKeyringOperationDoneCallback aDone,
+                               GnomeKeyringOperationGetIntCallback aGetInt,
+                               gpointer aData)
+{
+  PRUint32 delay = startCall();
+  Reply(aResult, aValue, aDone, aGetInt, aData, delay);
+}
+
+void
+FakeKeyringBackend::CreateItemAsync(
+                      const char *aKeyring,
+                      GnomeKeyringItemType aType,
+                      const char *aDisplayName,
+                      GnomeKeyringAttributeList *aAttributes,
+                      const char *aSecret,
+                      GnomeKeyringOperationGetIntCallback aCallback,
+                      gpointer aData)
+{
+  guint32 id = 0;
+  PR_Lock(mLock);
+  GnomeKeyringResult result = createItem(aKeyring, aType, aDisplayName,
+                                         aAttributes, aSecret, &id);
+  PR_Unlock(mLock);
+  replyLater(result, id, NULL, aCallback, aData);
+}
+
+void
+FakeKeyringBackend::DeleteItemAsync(
+                      const char *aKeyring, guint32 aItemId,
+                      GnomeKeyringOperationDoneCallback aCallback,
+                      gpointer aData)
+{
+  PR_Lock(mLock);
+  GnomeKeyringResult result = deleteItem(aKeyring, aItemId);
+  PR_Unlock(mLock);
+  replyLater(result, 0, aCallback, NULL, aData);
+}
+
+void
+FakeKeyringBackend::SetAttributesAsync(
+                      const char *aKeyring, guint32 aItemId,
+                      GnomeKeyringAttributeList *aAttributes,
+                      GnomeKeyringOperationDoneCallback aCallback,
+                      gpointer aData)
+{
+  PR_Lock(mLock);
+  GnomeKeyringResult result = setAttributes(aKeyring, aItemId, aAttributes);
+  PR_Unlock(mLock);
+  replyLater(result, 0, aCallback, NULL, aData);
+}
@@ -0,0 +1,144 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef FakeKeyringBackend_h__
+#define FakeKeyringBackend_h__
+
+#include "KeyringBackend.h"
+#include "prlock.h"
+
+/* Keyrings held in memory, standing in for the daemon when measuring the
+ * storage (extensions.gnome-keyring.backend = "fake"). Every call waits
+ * for the configured latency plus a jitter drawn from a seeded generator,
+ * so that runs are repeatable; asynchronous calls wait in the main
+ * context instead, so that pipelined requests overlap like they do with
+ * the daemon. Keyrings are never locked.
+ */
+class FakeKeyringBackend : public KeyringBackend
+{
+public:
+  FakeKeyringBackend(PRUint32 aSeed);
+  ~FakeKeyringBackend();
+
+  // In microseconds; the asynchronous calls round it to milliseconds
+  void SetLatency(PRUint32 aLatency, PRUint32 aJitter);
+  // Calls made so far, each of which would be a round trip to the daemon
+  PRUint32 Calls();
+
+  GnomeKeyringResult CreateKeyring(const char *aKeyring);
+  GnomeKeyringResult DeleteKeyring(const char *aKeyring);
+  GnomeKeyringResult ListKeyrings(GList **aNames);
+  GnomeKeyringResult GetKeyringInfo(const char *aKeyring, PRBool *aLocked,
+                                    PRInt64 *aMtime);
+  GnomeKeyringResult ListItemIds(const char *aKeyring, GList **aIds);
+  GnomeKeyringResult FindItems(GnomeKeyringItemType aType,
+                               GnomeKeyringAttributeList *aAttributes,
+                               GList **aFound);
+  GnomeKeyringResult CreateItem(const char *aKeyring,
+                                GnomeKeyringItemType aType,
+                                const char *aDisplayName,
+                                GnomeKeyringAttributeList *aAttributes,
+                                const char *aSecret,
+                                guint32 *aItemId);
+  GnomeKeyringResult DeleteItem(const char *aKeyring, guint32 aItemId);
+  GnomeKeyringResult GetAttributes(const char *aKeyring, guint32 aItemId,
+                                   GnomeKeyringAttributeList **aAttributes);
+  GnomeKeyringResult SetAttributes(const char *aKeyring, guint32 aItemId,
+                                   GnomeKeyringAttributeList *aAttributes);
+  GnomeKeyringResult GetSecret(const char *aKeyring, guint32 aItemId,
+                               char **aSecret);
+  GnomeKeyringResult SetSecret(const char *aKeyring, guint32 aItemId,
+                               GnomeKeyringItemType aType,
+                               const char *aDisplayName,
+                               const char *aSecret);
+
+  // The replies come once the latency of each call elapsed
+  PRBool IsPipelined() { return PR_TRUE; }
+  void CreateItemAsync(const char *aKeyring,
+                       GnomeKeyringItemType aType,
+                       const char *aDisplayName,
+                       GnomeKeyringAttributeList *aAttributes,
+                       const char *aSecret,
+                       GnomeKeyringOperationGetIntCallback aCallback,
+                       gpointer aData);
+  void DeleteItemAsync(const char *aKeyring, guint32 aItemId,
+                       GnomeKeyringOperationDoneCallback aCallback,
+                       gpointer aData);
+  void SetAttributesAsync(const char *aKeyring, guint32 aItemId,
+                          GnomeKeyringAttributeList *aAttributes,
+                          GnomeKeyringOperationDoneCallback aCallback,
+                          gpointer aData);
+
+  // Defined in the .cpp
+  struct Keyring;
+  struct Item;
+
+private:
+  // Count the call and draw its latency
+  PRUint32 startCall();
+  void wait();
+  void replyLater(GnomeKeyringResult aResult, guint32 aValue,
+                  GnomeKeyringOperationDoneCallback aDone,
+                  GnomeKeyringOperationGetIntCallback aGetInt,
+                  gpointer aData);
+
+  // Called with mLock held
+  Item *lookupItem(const char *aKeyring, guint32 aItemId,
+                   Keyring **aOwner);
+  GnomeKeyringResult createItem(const char *aKeyring,
+                                GnomeKeyringItemType aType,
+                                const char *aDisplayName,
+                                GnomeKeyringAttributeList *aAttributes,
+                                const char *aSecret,
+                                guint32 *aItemId);
+  GnomeKeyringResult deleteItem(const char *aKeyring, guint32 aItemId);
+  GnomeKeyringResult setAttributes(const char *aKeyring, guint32 aItemId,
+                                   GnomeKeyringAttributeList *aAttributes);
+  void touch(Keyring *aKeyring);
+
+  PRLock *mLock;
+  // name -> Keyring*
+  GHashTable *mKeyrings;
+  PRUint32 mLatency;
+  PRUint32 mJitter;
+  guint32 mRandom;
+  PRUint32 mCalls;
+  // Stands in for the mtime of the keyrings, bumped on each change
+  PRInt64 mClock;
+};
+
+#endif /* FakeKeyringBackend_h__ */
@@ -37,6 +37,14 @@
  * ***** END LICENSE BLOCK ***** */
 
 #include "GnomeKeyring.h"
+#include "KeyringLoginInfo.h"
+#include "KeyringThread.h"
+#include "KeyringBackend.h"
+#include "FakeKeyringBackend.h"
+#include "KeyringStats.h"
+#include "LoginEnumerator.h"
+#include "SecretArena.h"
+#include "StringConversion.h"
 #include "nsMemory.h"
 #include "nsILoginInfo.h"
 
@@ -48,9 +56,15 @@
 #include "nsServiceManagerUtils.h"
 #include "nsIPropertyBag.h"
 #include "nsIProperty.h"
+#include "nsISimpleEnumerator.h"
 #include "nsIVariant.h"
 #include "nsIPrefService.h"
 #include "nsIPrefBranch.h"
+#include "nsIFile.h"
+#include "nsDirectoryServiceUtils.h"
+#include "nsAppDirectoryServiceDefs.h"
+
+#include <stdarg.h>
 
 #pragma GCC visibility push(default)
 extern "C" {
@@ -63,31 +77,263 @@ PRLogModuleInfo *gGnomeKeyringLog;
 #endif
 /* create the preference item extensions.gnome-keyring.keyringName
  * to set wich keyring save the password to. The default is mozilla.
- * Note that password will be retrieved from every unlocked keyring,
- * because the gnome-keyring API doens't provide a way to search in
- * just one keyring.
  */
 nsCString keyringName;
 
-// TODO should use profile identifier instead of a constant
-#define UNIQUE_PROFILE_ID "v1"
+/* Logins are only looked up in keyringName, unless
+ * extensions.gnome-keyring.searchAllKeyrings is true. The gnome-keyring
+ * API can't restrict a search to one keyring, so the index is built from
+ * the items of keyringName alone and the searches that still go to the
+ * daemon drop what they find elsewhere.
+ */
+PRBool searchAllKeyrings = PR_FALSE;
+
+/* When extensions.gnome-keyring.recreateKeyringOnClear is true and the
+ * keyring only holds logins, RemoveAllLogins deletes the keyring and
+ * creates it again instead of deleting the items one by one. The new
+ * keyring has to get its password again, hence it is off by default.
+ */
+PRBool recreateKeyringOnClear = PR_FALSE;
+
+/* extensions.gnome-keyring.asyncWindow is the number of requests bulk
+ * operations keep in flight, with a backend that can have several, see
+ * KeyringBackend::IsPipelined. libgnome-keyring can't.
+ */
+PRInt32 asyncWindow = 32;
+
+/* extensions.gnome-keyring.backend is "libgnome-keyring" (the default) or
+ * "secret-service". With the latter, the secrets of the logins returned
+ * by GetAllLogins and FindLogins are read in one GetSecrets call, and
+ * items missing from the index are found with SearchItems. Everything
+ * else still goes through libgnome-keyring. */
+PRBool useSecretService = PR_FALSE;
+
+/* New and modified items are tagged with an id generated the first time
+ * a profile runs and kept in the profile, see getProfileId, so that the
+ * profiles of a desktop session don't see each other's items. Every
+ * profile used LEGACY_PROFILE_ID before. The first profile to run with
+ * the index re-tags those items with its own id, see
+ * FingerprintMigrationTask, and the other profiles no longer see them.
+ * Until then they are searched for too, see findTaggedItems.
+ */
+#define LEGACY_PROFILE_ID "v1"
+
+/* Whether this profile has no legacy items left to claim. Kept in
+ * extensions.gnome-keyring.legacyItemsClaimed once the re-tagging is
+ * done. */
+PRBool legacyClaimed = PR_FALSE;
 
 const char *kLoginInfoMagicAttrName = "mozLoginInfoMagic";
-const char *kLoginInfoMagicAttrValue = "loginInfoMagic" UNIQUE_PROFILE_ID;
+nsCString loginInfoMagic;
+const char kLegacyLoginInfoMagic[] = "loginInfoMagic" LEGACY_PROFILE_ID;
 
 // For hostnames:
 const char *kDisabledHostMagicAttrName = "mozDisabledHostMagic";
-const char *kDisabledHostMagicAttrValue = "disabledHostMagic" UNIQUE_PROFILE_ID;
+nsCString disabledHostMagic;
+const char kLegacyDisabledHostMagic[] = "disabledHostMagic" LEGACY_PROFILE_ID;
 
 const char *kDisabledHostAttrName = "disabledHost";
 
-const char *kHostnameAttr = "hostname";
-const char *kFormSubmitURLAttr = "formSubmitURL";
-const char *kHttpRealmAttr = "httpRealm";
-const char *kUsernameFieldAttr = "usernameField";
-const char *kPasswordFieldAttr = "passwordField";
-const char *kUsernameAttr = "username";
-const char *kPasswordAttr = "password";
+const char kHostnameAttr[] = "hostname";
+const char kFormSubmitURLAttr[] = "formSubmitURL";
+const char kHttpRealmAttr[] = "httpRealm";
+const char kUsernameFieldAttr[] = "usernameField";
+const char kPasswordFieldAttr[] = "passwordField";
+const char kUsernameAttr[] = "username";
+const char kPasswordAttr[] = "password";
+
+const char kFingerprintAttr[] = "mozLoginFingerprint";
+
+/* The attributes a login is stored with, in the order they are written.
+ * Encoding, decoding and the property bag of SearchLogins all go through
+ * this table; lookupLoginAttribute has to be kept in sync with it. */
+enum LoginField {
+  kFieldHostname,
+  kFieldFormSubmitURL,
+  kFieldHttpRealm,
+  kFieldUsername,
+  kFieldUsernameField,
+  kFieldPasswordField,
+  kFieldCount
+};
+
+struct LoginAttribute
+{
+  const char *name;
+  PRUint32 length;
+  // formSubmitURL and httpRealm are left out when void
+  PRBool optional;
+  nsresult (NS_STDCALL nsILoginInfo::*get)(nsAString &);
+  nsresult (NS_STDCALL nsILoginInfo::*set)(const nsAString &);
+};
+
+#define LOGIN_ATTRIBUTE(name, optional, accessor)                   \
+  { name, sizeof(name) - 1, optional,                               \
+    &nsILoginInfo::Get##accessor, &nsILoginInfo::Set##accessor }
+
+static const LoginAttribute kLoginAttributes[kFieldCount] = {
+  LOGIN_ATTRIBUTE(kHostnameAttr, PR_FALSE, Hostname),
+  LOGIN_ATTRIBUTE(kFormSubmitURLAttr, PR_TRUE, FormSubmitURL),
+  LOGIN_ATTRIBUTE(kHttpRealmAttr, PR_TRUE, HttpRealm),
+  LOGIN_ATTRIBUTE(kUsernameAttr, PR_FALSE, Username),
+  LOGIN_ATTRIBUTE(kUsernameFieldAttr, PR_FALSE, UsernameField),
+  LOGIN_ATTRIBUTE(kPasswordFieldAttr, PR_FALSE, PasswordField)
+};
+
+#undef LOGIN_ATTRIBUTE
+
+/* Field of the attribute aName, or kFieldCount for the magic and unknown
+ * attributes. The length and first character tell the names apart, so
+ * that at most one comparison is made. */
+static PRUint32
+lookupLoginAttribute(const char *aName, PRUint32 aLength)
+{
+  PRUint32 field = kFieldCount;
+
+  switch (aLength) {
+    case sizeof(kHostnameAttr) - 1:  // and username
+      if (aName[0] == 'h')
+        field = kFieldHostname;
+      else if (aName[0] == 'u')
+        field = kFieldUsername;
+      break;
+    case sizeof(kHttpRealmAttr) - 1:
+      field = kFieldHttpRealm;
+      break;
+    case sizeof(kFormSubmitURLAttr) - 1:  // and the two field names
+      if (aName[0] == 'f')
+        field = kFieldFormSubmitURL;
+      else if (aName[0] == 'u')
+        field = kFieldUsernameField;
+      else if (aName[0] == 'p')
+        field = kFieldPasswordField;
+      break;
+  }
+
+  if (field != kFieldCount &&
+      memcmp(aName, kLoginAttributes[field].name, aLength))
+    return kFieldCount;
+  return field;
+}
+
+/* Values of the login attributes of an item, NULL for the missing ones,
+ * in a single pass over the list. When an attribute appears more than
+ * once, the last value wins. */
+static void
+decodeLoginAttributes(GnomeKeyringAttributeList *aAttributes,
+                      const char *aValues[kFieldCount])
+{
+  GnomeKeyringAttribute *attrArray =
+    (GnomeKeyringAttribute *)aAttributes->data;
+
+  for (PRUint32 field = 0; field < kFieldCount; field++)
+    aValues[field] = NULL;
+
+  for (PRUint32 i = 0; i < aAttributes->len; i++) {
+    if (attrArray[i].type != GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
+      continue;
+    PRUint32 field = lookupLoginAttribute(attrArray[i].name,
+                                          strlen(attrArray[i].name));
+    if (field != kFieldCount)
+      aValues[field] = attrArray[i].value.string;
+  }
+}
+
+/* 64-bit FNV-1a of the login attributes in table order, as hex. A missing
+ * attribute hashes as 0xff, which no UTF-8 string holds, so that it
+ * differs from an empty one. */
+static void
+computeFingerprint(const char *const aValues[kFieldCount],
+                   char aResult[GK_FINGERPRINT_LENGTH + 1])
+{
+  const PRUint64 kPrime = 1099511628211ULL;
+  PRUint64 hash = 14695981039346656037ULL;
+
+  for (PRUint32 field = 0; field < kFieldCount; field++) {
+    const char *value = aValues[field];
+    if (!value) {
+      hash = (hash ^ 0xff) * kPrime;
+      continue;
+    }
+    // The terminating NUL separates the values
+    do {
+      hash = (hash ^ (unsigned char) *value) * kPrime;
+    } while (*value++);
+  }
+  g_snprintf(aResult, GK_FINGERPRINT_LENGTH + 1, "%016llx",
+           (unsigned long long) hash);
+}
+
+static void
+appendFingerprint(GnomeKeyringAttributeList *aAttributes)
+{
+  const char *values[kFieldCount];
+  char fingerprint[GK_FINGERPRINT_LENGTH + 1];
+
+  decodeLoginAttributes(aAttributes, values);
+  computeFingerprint(values, fingerprint);
+  gnome_keyring_attribute_list_append_string(aAttributes, kFingerprintAttr,
+                                             fingerprint);
+}
+
+// Copy of aAttributes without the attribute aName
+static GnomeKeyringAttributeList *
+copyAttributesWithout(GnomeKeyringAttributeList *aAttributes,
+                      const char *aName)
+{
+  GnomeKeyringAttributeList *copy = gnome_keyring_attribute_list_new();
+  GnomeKeyringAttribute *attrArray =
+    (GnomeKeyringAttribute *)aAttributes->data;
+
+  for (PRUint32 i = 0; i < aAttributes->len; i++) {
+    if (!strcmp(attrArray[i].name, aName))
+      continue;
+    if (attrArray[i].type == GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
+      gnome_keyring_attribute_list_append_string(copy, attrArray[i].name,
+                                                 attrArray[i].value.string);
+    else
+      gnome_keyring_attribute_list_append_uint32(copy, attrArray[i].name,
+                                                 attrArray[i].value.integer);
+  }
+  return copy;
+}
+
+// Replace the fingerprint of aAttributes with the one of its values
+static GnomeKeyringAttributeList *
+refreshFingerprint(GnomeKeyringAttributeList *aAttributes)
+{
+  GnomeKeyringAttributeList *copy =
+    copyAttributesWithout(aAttributes, kFingerprintAttr);
+  gnome_keyring_attribute_list_free(aAttributes);
+  appendFingerprint(copy);
+  return copy;
+}
+
+/* Whether two sets of login attributes describe the same login, which is
+ * checked after a fingerprint match in case two fingerprints collide.
+ * Only formSubmitURL and httpRealm tell missing from empty. */
+static PRBool
+sameIdentity(const char *aValues[kFieldCount],
+             const char *aOther[kFieldCount])
+{
+  for (PRUint32 field = 0; field < kFieldCount; field++) {
+    const char *a = aValues[field];
+    const char *b = aOther[field];
+    if (kLoginAttributes[field].optional) {
+      if (!a || !b) {
+        if (a != b)
+          return PR_FALSE;
+        continue;
+      }
+    } else {
+      a = a ? a : "";
+      b = b ? b : "";
+    }
+    if (strcmp(a, b))
+      return PR_FALSE;
+  }
+  return PR_TRUE;
+}
 
 // Macro to check gnome-keyring results
 #define GK_ENSURE_SUCCESS(x)                                  \
@@ -134,120 +380,286 @@ class AutoFoundList {
 
 // Utilities
 
-GnomeKeyringAttributeList *
-GnomeKeyring::buildAttributeList(nsILoginInfo *aLogin)
+/* Search the items of aType matching aQuery that belong to this profile:
+ * the magic attribute of the type is set to the value of this profile,
+ * then to the legacy one until they are claimed, and the results are
+ * merged. */
+static GnomeKeyringResult
+findTaggedItems(GnomeKeyringItemType aType,
+                GnomeKeyringAttributeList *aQuery,
+                GList **aFound)
+{
+  const char *name, *magics[2];
+  if (aType == GNOME_KEYRING_ITEM_NOTE) {
+    name = kDisabledHostMagicAttrName;
+    magics[0] = disabledHostMagic.get();
+    magics[1] = kLegacyDisabledHostMagic;
+  } else {
+    name = kLoginInfoMagicAttrName;
+    magics[0] = loginInfoMagic.get();
+    magics[1] = kLegacyLoginInfoMagic;
+  }
+  PRUint32 count = legacyClaimed ? 1 : 2;
+
+  GList *found = NULL;
+  GnomeKeyringResult result = GNOME_KEYRING_RESULT_NO_MATCH;
+  for (PRUint32 i = 0; i < count; i++) {
+    GnomeKeyringAttributeList *query = copyAttributesWithout(aQuery, name);
+    gnome_keyring_attribute_list_append_string(query, name, magics[i]);
+
+    GList *part = NULL;
+    GnomeKeyringResult partResult =
+      KeyringBackend::Get()->FindItems(aType, query, &part);
+    gnome_keyring_attribute_list_free(query);
+
+    if (partResult == GNOME_KEYRING_RESULT_OK) {
+      found = g_list_concat(found, part);
+      result = GNOME_KEYRING_RESULT_OK;
+    } else if (partResult != GNOME_KEYRING_RESULT_NO_MATCH) {
+      if (found)
+        gnome_keyring_found_list_free(found);
+      found = NULL;
+      result = partResult;
+      break;
+    }
+  }
+
+  *aFound = found;
+  return result;
+}
+
+/* findTaggedItems for string attributes given as name and value pairs
+ * followed by NULL. */
+static GnomeKeyringResult
+findItemsv(GnomeKeyringItemType aType, GList **aFound, ...)
 {
-  nsAutoString s;
   GnomeKeyringAttributeList *attributes = gnome_keyring_attribute_list_new();
+  va_list args;
 
-  aLogin->GetHostname(s);
-  gnome_keyring_attribute_list_append_string(attributes, kHostnameAttr,
-                                             NS_ConvertUTF16toUTF8(s).get());
+  va_start(args, aFound);
+  const char *name;
+  while ((name = va_arg(args, const char*)) != NULL)
+    gnome_keyring_attribute_list_append_string(attributes, name,
+                                               va_arg(args, const char*));
+  va_end(args);
+
+  GnomeKeyringResult result = findTaggedItems(aType, attributes, aFound);
+  gnome_keyring_attribute_list_free(attributes);
+  return result;
+}
 
-  // formSubmitURL and httpRealm are not guaranteed to be set.
+PRBool
+inSearchScope(const char *aKeyring)
+{
+  return searchAllKeyrings || !strcmp(aKeyring, keyringName.get());
+}
 
-  aLogin->GetFormSubmitURL(s);
-  if (!s.IsVoid()) {
-    gnome_keyring_attribute_list_append_string(attributes, kFormSubmitURLAttr,
-                                               NS_ConvertUTF16toUTF8(s).get());
+// Free the items of a found list that are out of the search scope
+void
+dropOtherKeyrings(GList **aFoundList)
+{
+  if (searchAllKeyrings)
+    return;
+
+  GList* l = *aFoundList;
+  while (l != NULL) {
+    GList* next = l->next;
+    GnomeKeyringFound* item = static_cast<GnomeKeyringFound*>(l->data);
+    if (!inSearchScope(item->keyring)) {
+      gnome_keyring_found_free(item);
+      *aFoundList = g_list_delete_link(*aFoundList, l);
+    }
+    l = next;
   }
+}
 
-  aLogin->GetHttpRealm(s);
-  if (!s.IsVoid()) {
-    gnome_keyring_attribute_list_append_string(attributes, kHttpRealmAttr,
-                                               NS_ConvertUTF16toUTF8(s).get());
+// Returns the value of the string attribute aName, or NULL if it isn't set.
+// When an attribute appears more than once, the last value wins.
+const char *
+findAttribute(GnomeKeyringAttributeList *attributes, const char *aName)
+{
+  const char *value = NULL;
+  GnomeKeyringAttribute *attrArray = (GnomeKeyringAttribute *)attributes->data;
+
+  for (PRUint32 i = 0; i < attributes->len; i++) {
+    if (attrArray[i].type != GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
+      continue;
+    if (!strcmp(attrArray[i].name, aName))
+      value = attrArray[i].value.string;
   }
+  return value;
+}
 
-  aLogin->GetUsername(s);
-  gnome_keyring_attribute_list_append_string(attributes, kUsernameAttr,
-                                             NS_ConvertUTF16toUTF8(s).get());
-  aLogin->GetUsernameField(s);
-  gnome_keyring_attribute_list_append_string(attributes, kUsernameFieldAttr,
-                                             NS_ConvertUTF16toUTF8(s).get());
-  aLogin->GetPasswordField(s);
-  gnome_keyring_attribute_list_append_string(attributes, kPasswordFieldAttr,
-                                             NS_ConvertUTF16toUTF8(s).get());
+PRBool
+isLoginItem(GnomeKeyringAttributeList *attributes)
+{
+  const char *magic = findAttribute(attributes, kLoginInfoMagicAttrName);
+  return magic && (!strcmp(magic, loginInfoMagic.get()) ||
+                   (!legacyClaimed && !strcmp(magic, kLegacyLoginInfoMagic)));
+}
 
-  gnome_keyring_attribute_list_append_string(attributes,
-                                             kLoginInfoMagicAttrName,
-                                             kLoginInfoMagicAttrValue);
+static PRBool
+isDisabledHostItem(GnomeKeyringAttributeList *attributes)
+{
+  const char *magic = findAttribute(attributes, kDisabledHostMagicAttrName);
+  return magic && (!strcmp(magic, disabledHostMagic.get()) ||
+                   (!legacyClaimed &&
+                    !strcmp(magic, kLegacyDisabledHostMagic))) &&
+         findAttribute(attributes, kDisabledHostAttrName);
+}
 
-  return attributes;
+LoginMetadata::LoginMetadata(const char *aKeyring, guint aItemId,
+                             GnomeKeyringAttributeList *aAttributes)
+  : itemId(aItemId)
+{
+  const char *values[kFieldCount];
+  decodeLoginAttributes(aAttributes, values);
+  setValues(aKeyring, values);
+
+  const char *stored = findAttribute(aAttributes, kFingerprintAttr);
+  tagged = stored && !strcmp(stored, fingerprint);
+}
+
+LoginMetadata::LoginMetadata(const char *aKeyring, guint aItemId,
+                             const char *const *aValues, PRBool aTagged)
+  : itemId(aItemId),
+    tagged(aTagged)
+{
+  setValues(aKeyring, aValues);
 }
 
 void
-GnomeKeyring::appendAttributesFromBag(nsIPropertyBag *matchData,
-                                    GnomeKeyringAttributeList * &attributes)
+LoginMetadata::setValues(const char *aKeyring, const char *const *aValues)
 {
-  nsAutoString s, property, propName;
-  nsCOMPtr<nsIVariant> propValue;
-  nsresult result;
+#define VALUE_OR_EMPTY(field) g_strdup(aValues[field] ? aValues[field] : "")
+  keyring = g_strdup(aKeyring);
+  hostname = VALUE_OR_EMPTY(kFieldHostname);
+  formSubmitURL = g_strdup(aValues[kFieldFormSubmitURL]);
+  httpRealm = g_strdup(aValues[kFieldHttpRealm]);
+  username = VALUE_OR_EMPTY(kFieldUsername);
+  usernameField = VALUE_OR_EMPTY(kFieldUsernameField);
+  passwordField = VALUE_OR_EMPTY(kFieldPasswordField);
+#undef VALUE_OR_EMPTY
+
+  computeFingerprint(aValues, fingerprint);
+}
 
-  gnome_keyring_attribute_list_append_string(attributes,
-                                             kLoginInfoMagicAttrName,
-                                             kLoginInfoMagicAttrValue);
-  property.AssignLiteral(kHostnameAttr);
-  result = matchData->GetProperty(property, getter_AddRefs(propValue));
-  if ( result != NS_ERROR_FAILURE ) {
-    propValue->GetAsAString(s);
-    gnome_keyring_attribute_list_append_string(attributes,
-                                               kHostnameAttr,
-                                               NS_ConvertUTF16toUTF8(s).get());
-  }
+LoginMetadata::LoginMetadata(const LoginMetadata &aOther)
+  : keyring(g_strdup(aOther.keyring)),
+    itemId(aOther.itemId),
+    hostname(g_strdup(aOther.hostname)),
+    formSubmitURL(g_strdup(aOther.formSubmitURL)),
+    httpRealm(g_strdup(aOther.httpRealm)),
+    username(g_strdup(aOther.username)),
+    usernameField(g_strdup(aOther.usernameField)),
+    passwordField(g_strdup(aOther.passwordField)),
+    tagged(aOther.tagged)
+{
+  memcpy(fingerprint, aOther.fingerprint, sizeof(fingerprint));
+}
 
-//  formSubmitURL and httpRealm are not guaranteed to be set.
+LoginMetadata::~LoginMetadata()
+{
+  g_free(keyring);
+  g_free(hostname);
+  g_free(formSubmitURL);
+  g_free(httpRealm);
+  g_free(username);
+  g_free(usernameField);
+  g_free(passwordField);
+}
 
-  property.AssignLiteral(kFormSubmitURLAttr);
-  result = matchData->GetProperty(property, getter_AddRefs(propValue));
-  if ( result != NS_ERROR_FAILURE ) {
-    propValue->GetAsAString(s);
-    if (!s.IsVoid()){
-      gnome_keyring_attribute_list_append_string(attributes,
-                                                 kFormSubmitURLAttr,
-                                                 NS_ConvertUTF16toUTF8(s).get());
-    }
-  }
+GnomeKeyringAttributeList *
+GnomeKeyring::buildAttributeList(nsILoginInfo *aLogin)
+{
+  nsAutoString s;
+  UTF8Scratch utf8;
+  GnomeKeyringAttributeList *attributes = gnome_keyring_attribute_list_new();
 
-  property.AssignLiteral(kHttpRealmAttr);
-  result = matchData->GetProperty(property, getter_AddRefs(propValue));
-  if ( result != NS_ERROR_FAILURE ) {
-    propValue->GetAsAString(s);
-    if (!s.IsVoid()){
-      gnome_keyring_attribute_list_append_string(attributes,
-                                                 kHttpRealmAttr,
-                                                 NS_ConvertUTF16toUTF8(s).get());
-    }
+  for (PRUint32 field = 0; field < kFieldCount; field++) {
+    const LoginAttribute &attr = kLoginAttributes[field];
+    (aLogin->*attr.get)(s);
+    if (attr.optional && s.IsVoid())
+      continue;
+    gnome_keyring_attribute_list_append_string(attributes, attr.name,
+                                               utf8.Convert(s));
   }
+  // The magic of this profile is added on the keyring thread, see tagLogin
+  appendFingerprint(attributes);
+  return attributes;
+}
 
-  property.AssignLiteral(kUsernameFieldAttr);
-  result = matchData->GetProperty(property, getter_AddRefs(propValue));
-  if ( result != NS_ERROR_FAILURE ) {
-    propValue->GetAsAString(s);
-    gnome_keyring_attribute_list_append_string(attributes,
-                                               kUsernameFieldAttr,
-                                               NS_ConvertUTF16toUTF8(s).get());
-  }
+/* The properties of matchData are walked once; the ones that aren't login
+ * attributes are ignored. */
+void
+GnomeKeyring::appendAttributesFromBag(nsIPropertyBag *matchData,
+                                    GnomeKeyringAttributeList * &attributes)
+{
+  nsAutoString s, propName;
+  UTF8Scratch utf8;
+  nsCOMPtr<nsISimpleEnumerator> properties;
+  PRBool hasMore;
+
+  if (NS_FAILED(matchData->GetEnumerator(getter_AddRefs(properties))))
+    return;
+
+  while (NS_SUCCEEDED(properties->HasMoreElements(&hasMore)) && hasMore) {
+    nsCOMPtr<nsISupports> next;
+    properties->GetNext(getter_AddRefs(next));
+    nsCOMPtr<nsIProperty> property = do_QueryInterface(next);
+    if (!property)
+      continue;
+
+    property->GetName(propName);
+    const char *name = utf8.Convert(propName);
+    PRUint32 field = lookupLoginAttribute(name, strlen(name));
+    if (field == kFieldCount)
+      continue;
 
-  property.AssignLiteral(kPasswordFieldAttr);
-  result = matchData->GetProperty(property, getter_AddRefs(propValue));
-  if ( result != NS_ERROR_FAILURE ) {
+    nsCOMPtr<nsIVariant> propValue;
+    property->GetValue(getter_AddRefs(propValue));
+    if (!propValue)
+      continue;
     propValue->GetAsAString(s);
+    if (kLoginAttributes[field].optional && s.IsVoid())
+      continue;
     gnome_keyring_attribute_list_append_string(attributes,
-                                               kPasswordFieldAttr,
-                                               NS_ConvertUTF16toUTF8(s).get());
+                                               kLoginAttributes[field].name,
+                                               utf8.Convert(s));
   }
+}
 
-  property.AssignLiteral(kUsernameAttr);
-  result = matchData->GetProperty(property, getter_AddRefs(propValue));
-  if ( result != NS_ERROR_FAILURE ) {
-    propValue->GetAsAString(s);
-    gnome_keyring_attribute_list_append_string(attributes,
-                                               kUsernameAttr,
-                                               NS_ConvertUTF16toUTF8(s).get());
-    }
+struct DeleteRequest
+{
+  AsyncBatch *batch;
+  GnomeKeyringFound *found;
+  GnomeKeyringResult result;
+};
+
+void
+onItemDeleted(GnomeKeyringResult result, gpointer data)
+{
+  DeleteRequest *request = static_cast<DeleteRequest*>(data);
 
+  request->result = result;
+  request->batch->Complete();
 }
 
+void
+startDelete(AsyncBatch *aBatch, PRUint32 aIndex, void *aData)
+{
+  DeleteRequest *request = static_cast<DeleteRequest*>(aData) + aIndex;
+
+  request->batch = aBatch;
+  KeyringBackend::Get()->DeleteItemAsync(request->found->keyring,
+                                         request->found->item_id,
+                                         onItemDeleted, request);
+}
+
+/* The deletes are pipelined, with up to asyncWindow of them in flight,
+ * when the backend can; with libgnome-keyring they are made one after the
+ * other. A failure doesn't stop the others; the index is kept for the
+ * items that went away and the call fails if any delete did. */
 nsresult
 GnomeKeyring::deleteFoundItems(GList* foundList,
                                  PRBool aExpectOnlyOne = PR_FALSE)
@@ -257,28 +669,75 @@ GnomeKeyring::deleteFoundItems(GList* foundList,
     return NS_OK;
   }
 
+  PRUint32 count = g_list_length(foundList);
+  if (count > 1 && aExpectOnlyOne)
+    NS_WARNING("Expected only one item to delete, but found more");
+
+  DeleteRequest *requests = new DeleteRequest[count];
+
   PRUint32 i = 0;
   for (GList* l = foundList; l != NULL; l = l->next, i++)
   {
-    GnomeKeyringFound* found = static_cast<GnomeKeyringFound*>(l->data);
-    GK_LOG(("Found item with id %i\n", found->item_id));
+    requests[i].found = static_cast<GnomeKeyringFound*>(l->data);
+    GK_LOG(("Found item with id %i\n", requests[i].found->item_id));
+  }
 
-    GnomeKeyringResult result = gnome_keyring_item_delete_sync(keyringName.get(),
-                                                               found->item_id);
-    if (result != GNOME_KEYRING_RESULT_OK) {
-      return NS_ERROR_FAILURE;
+  if (KeyringBackend::Get()->IsPipelined()) {
+    AsyncBatch batch(count, asyncWindow, startDelete, requests);
+    batch.Run();
+  } else {
+    for (i = 0; i < count; i++)
+      requests[i].result = KeyringBackend::Get()->DeleteItem(
+                             requests[i].found->keyring,
+                             requests[i].found->item_id);
+  }
+
+  PRUint32 failed = 0;
+  for (i = 0; i < count; i++)
+  {
+    GnomeKeyringFound* found = requests[i].found;
+
+    if (requests[i].result != GNOME_KEYRING_RESULT_OK) {
+      GK_LOG(("Deleting item %i failed: %i\n", found->item_id,
+              requests[i].result));
+      failed++;
+      continue;
     }
+    noteOwnWrite(found->keyring, found->item_id,
+                 KeyringWatcher::ITEM_DELETED);
+    mIndex.Remove(findAttribute(found->attributes, kHostnameAttr),
+                  found->keyring, found->item_id);
+  }
+  delete[] requests;
 
-    if (i == 1 && aExpectOnlyOne)
-      NS_WARNING("Expected only one item to delete, but found more");
+  if (failed) {
+    GK_LOG(("%i of %i deletes failed\n", failed, count));
+    return NS_ERROR_FAILURE;
   }
   return NS_OK;
 }
 
-nsILoginInfo*
-loginToLogin(nsILoginInfo* found)
+/* Whether the items of keyringName are exactly the logins of aFoundList,
+ * so that dropping the keyring deletes them and nothing else. */
+PRBool
+keyringHoldsOnly(GList *aFoundList)
 {
-  return found;
+  PRUint32 count = 0;
+  for (GList* l = aFoundList; l != NULL; l = l->next, count++) {
+    GnomeKeyringFound* found = static_cast<GnomeKeyringFound*>(l->data);
+    if (strcmp(found->keyring, keyringName.get()))
+      return PR_FALSE;
+  }
+
+  GList *ids;
+  GnomeKeyringResult result =
+    KeyringBackend::Get()->ListItemIds(keyringName.get(), &ids);
+  if (result != GNOME_KEYRING_RESULT_OK)
+    return PR_FALSE;
+
+  PRUint32 total = g_list_length(ids);
+  g_list_free(ids);
+  return total == count;
 }
 
 nsILoginInfo*
@@ -288,67 +747,26 @@ foundToLoginInfo(GnomeKeyringFound* found)
   if (!loginInfo)
     return nsnull;
 
-  loginInfo->SetPassword(NS_ConvertUTF8toUTF16(found->secret));
-
-  GnomeKeyringAttribute *attrArray =
-    (GnomeKeyringAttribute *)found->attributes->data;
+  // Converted once into this buffer for each attribute, the setters copy
+  nsAutoString value;
+  AssignUTF8toUTF16(found->secret, value);
+  loginInfo->SetPassword(value);
+  SecretArena::Wipe(value);
 
-  for (PRUint32 i = 0; i < found->attributes->len; i++) {
+  const char *values[kFieldCount];
+  decodeLoginAttributes(found->attributes, values);
 
-    if (attrArray[i].type != GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
+  for (PRUint32 field = 0; field < kFieldCount; field++) {
+    if (!values[field])
       continue;
-
-    const char *attrName = attrArray[i].name;
-    const char *attrValue = attrArray[i].value.string;
-    GK_LOG(("Attr value %s\n", attrValue));
-
-    if (!strcmp(attrName, kHostnameAttr))
-     loginInfo->SetHostname(NS_ConvertUTF8toUTF16(attrValue));
-    else if (!strcmp(attrName, kFormSubmitURLAttr))
-     loginInfo->SetFormSubmitURL(NS_ConvertUTF8toUTF16(attrValue));
-    else if (!strcmp(attrName, kHttpRealmAttr))
-     loginInfo->SetHttpRealm(NS_ConvertUTF8toUTF16(attrValue));
-    else if (!strcmp(attrName, kUsernameAttr))
-     loginInfo->SetUsername(NS_ConvertUTF8toUTF16(attrValue));
-    else if (!strcmp(attrName, kUsernameFieldAttr))
-     loginInfo->SetUsernameField(NS_ConvertUTF8toUTF16(attrValue));
-    else if (!strcmp(attrName, kPasswordFieldAttr))
-     loginInfo->SetPasswordField(NS_ConvertUTF8toUTF16(attrValue));
-    else
-      NS_WARNING(("Unknown %s attribute name", attrName));
+    GK_LOG(("Attr value %s\n", values[field]));
+    AssignUTF8toUTF16(values[field], value);
+    (loginInfo->*kLoginAttributes[field].set)(value);
   }
   NS_ADDREF(loginInfo);
   return loginInfo;
 }
 
-PRUnichar *
-foundToHost(GnomeKeyringFound* found)
-{
-  PRUnichar *host=NULL;
-
-  GnomeKeyringAttribute *attrArray =
-    (GnomeKeyringAttribute *)found->attributes->data;
-
-  for (PRUint32 i = 0; i < found->attributes->len; i++) {
-
-    if (attrArray[i].type != GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
-      continue;
-
-    const char *attrName = attrArray[i].name;
-    const char *attrValue = attrArray[i].value.string;
-    GK_LOG(("Attr value %s\n", attrValue));
-
-    if (!strcmp(attrName, kDisabledHostAttrName))
-      host = NS_StringCloneData(NS_ConvertUTF8toUTF16(attrValue));
-  }
-
-  // TODO what to do in that case?
-  if (!host)
-    host = NS_StringCloneData(NS_ConvertASCIItoUTF16("undefined"));
-
-  return host;
-}
-
 template<class T, class T2>
 nsresult foundListToArray(T (*aFoundToObject)(T2 found),
                           GList *aFoundList, PRUint32 *aCount, T **aArray)
@@ -381,121 +799,2157 @@ nsresult foundListToArray(T (*aFoundToObject)(T2 found),
   return NS_OK;
 }
 
-void
-convertAndCollectLogins(GnomeKeyringFound* found, GList **aFoundList)
+/* Whether an item whose attribute is aValue (NULL if the item doesn't have
+ * it) matches aPattern. Items without the attribute always match. When
+ * they have it, a void (NULL) pattern doesn't match, "" matches
+ * everything and anything else must be equal. */
+bool
+attributeMatches(const char *aPattern, const char *aValue)
 {
-  nsILoginInfo* info = foundToLoginInfo(found);
-  *aFoundList = g_list_append(*aFoundList, info);
+  if (aValue == NULL)
+    return TRUE;
+  if (aPattern == NULL)
+    return FALSE;
+  if (!strcmp("", aPattern))
+    return TRUE;
+  return !strcmp(aPattern, aValue);
 }
 
-void
-countFoundLogins(GnomeKeyringFound* found, int* count)
+// Same filtering as findLogins, applied to an index entry
+bool
+metadataMatches(LoginMetadata *aEntry,
+                const char *aActionURL,
+                const char *aHttpRealm)
 {
-  (*count) = (*count)+1;
+  return attributeMatches(aActionURL, aEntry->formSubmitURL) &&
+         attributeMatches(aHttpRealm, aEntry->httpRealm);
 }
 
 void
-checkAttribute(const char* valuePattern, const char* value, bool* isMatch)
+freeHostEntries(gpointer data)
 {
-  if (valuePattern == NULL) {
-    *isMatch = FALSE;
-  } else {
-    // If the valuePattern is "" then it should match
-    // with everything
-    if (!strcmp("", valuePattern)) {
-      return;
-    }
+  GPtrArray *entries = static_cast<GPtrArray*>(data);
 
-    if (strcmp(valuePattern, value)) {
-      *isMatch = FALSE;
-    }
-  }
+  for (guint i = 0; i < entries->len; i++)
+    delete static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+  g_ptr_array_free(entries, TRUE);
 }
 
-template<class T>
-GnomeKeyringResult
-findLogins(const nsAString & aHostname,
-           const nsAString & aActionURL,
-           const nsAString & aHttpRealm,
-           void (*foundLogin)(GnomeKeyringFound* found, T data),
-           T data)
+LoginIndex::LoginIndex()
+  : mCount(0),
+    mSnapshot(NULL),
+    mLoaded(PR_FALSE)
 {
-  GnomeKeyringAttributeList *attributes = gnome_keyring_attribute_list_new();
+  mByHost = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                  g_free, freeHostEntries);
+  mByFingerprint = g_hash_table_new(g_str_hash, g_str_equal);
+  mByItem = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
 
-  gnome_keyring_attribute_list_append_string(attributes,
-                          kLoginInfoMagicAttrName, kLoginInfoMagicAttrValue);
-  /* Convert to UTF-8 (but keep a reference to the NS_ConvertUTF16ToUTF8
-   * instance around, so the string .get() returns won't be free'd */
-  gnome_keyring_attribute_list_append_string(attributes, kHostnameAttr,
-                                             NS_ConvertUTF16toUTF8(aHostname).get());
-
-  GList* unfiltered;
-  GnomeKeyringResult result = gnome_keyring_find_items_sync(
-                                        GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                                        attributes,
-                                        &unfiltered );
+LoginIndex::~LoginIndex()
+{
+  g_hash_table_destroy(mByItem);
+  g_hash_table_destroy(mByFingerprint);
+  g_hash_table_destroy(mByHost);
+}
 
-  gnome_keyring_attribute_list_free(attributes);
+void
+LoginIndex::Invalidate()
+{
+  g_hash_table_remove_all(mByItem);
+  g_hash_table_remove_all(mByFingerprint);
+  g_hash_table_remove_all(mByHost);
+  mCount = 0;
+  mLoaded = PR_FALSE;
+}
 
-  /* Convert to UTF-8 (but keep a reference to the NS_ConvertUTF16ToUTF8
-   * instance around, so the string .get() returns won't be free'd */
-  const NS_ConvertUTF16toUTF8 utf8ActionURL(aActionURL);
-  const char* tempActionUrl = utf8ActionURL.IsVoid() ? NULL : utf8ActionURL.get();
-  const NS_ConvertUTF16toUTF8 utf8HttpRealm(aHttpRealm);
-  const char* tempHttpRealm = utf8HttpRealm.IsVoid() ? NULL : utf8HttpRealm.get();
+// Key of mByItem, to be freed with g_free
+static char *
+itemKey(const char *aKeyring, guint aItemId)
+{
+  return g_strdup_printf("%u/%s", aItemId, aKeyring);
+}
 
-  for (GList* l = unfiltered; l != NULL; l = l->next) {
-    bool isMatch = TRUE;
-    GnomeKeyringFound* found = static_cast<GnomeKeyringFound*>(l->data);
+void
+LoginIndex::Add(LoginMetadata *aEntry)
+{
+  GPtrArray *entries =
+    static_cast<GPtrArray*>(g_hash_table_lookup(mByHost, aEntry->hostname));
 
-    GnomeKeyringAttribute *attrArray = (GnomeKeyringAttribute *)found->attributes->data;
+  if (!entries) {
+    entries = g_ptr_array_new();
+    g_hash_table_insert(mByHost, g_strdup(aEntry->hostname), entries);
+  }
+  g_ptr_array_add(entries, aEntry);
+  g_hash_table_replace(mByItem, itemKey(aEntry->keyring, aEntry->itemId),
+                       aEntry);
+  mCount++;
 
-    for (PRUint32 i = 0; i < found->attributes->len; i++) {
-      if (attrArray[i].type != GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
-        continue;
+  // Identical logins share a fingerprint, the first one is kept
+  if (!g_hash_table_lookup(mByFingerprint, aEntry->fingerprint))
+    g_hash_table_insert(mByFingerprint, aEntry->fingerprint, aEntry);
 
-      const char *attrName = attrArray[i].name;
-      const char *attrValue = attrArray[i].value.string;
+  if (mLoaded && mSnapshot)
+    mSnapshot->LoginAdded(aEntry);
+}
 
-      if (!strcmp(attrName, kFormSubmitURLAttr)) {
-        checkAttribute(tempActionUrl, attrValue, &isMatch);
-      } else if (!strcmp(attrName, kHttpRealmAttr)) {
-        checkAttribute(tempHttpRealm, attrValue, &isMatch);
-      }
+void
+LoginIndex::Remove(const char *aHostname, const char *aKeyring, guint aItemId)
+{
+  if (!aHostname)
+    return;
+
+  GPtrArray *entries =
+    static_cast<GPtrArray*>(g_hash_table_lookup(mByHost, aHostname));
+  if (!entries)
+    return;
+
+  LoginMetadata *entry = NULL;
+  for (guint i = 0; i < entries->len; i++) {
+    LoginMetadata *candidate =
+      static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+    if (candidate->itemId == aItemId && !strcmp(candidate->keyring, aKeyring)) {
+      entry = candidate;
+      g_ptr_array_remove_index_fast(entries, i);
+      break;
     }
+  }
 
-    if (isMatch) {
-      foundLogin(found, data);
+  if (!entry)
+    return;
+  char *key = itemKey(aKeyring, aItemId);
+  g_hash_table_remove(mByItem, key);
+  g_free(key);
+  mCount--;
+  if (mLoaded && mSnapshot)
+    mSnapshot->LoginRemoved(entry);
+
+  if (g_hash_table_lookup(mByFingerprint, entry->fingerprint) == entry) {
+    g_hash_table_remove(mByFingerprint, entry->fingerprint);
+    // A duplicate of the login, if any, is on the same host
+    for (guint i = 0; i < entries->len; i++) {
+      LoginMetadata *other =
+        static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+      if (!strcmp(other->fingerprint, entry->fingerprint)) {
+        g_hash_table_insert(mByFingerprint, other->fingerprint, other);
+        break;
+      }
     }
   }
 
-  gnome_keyring_found_list_free(unfiltered);
+  // aHostname may belong to the entry, so only free it at the end
+  if (entries->len == 0)
+    g_hash_table_remove(mByHost, aHostname);
+  delete entry;
+}
 
-  return result;
+PRBool
+LoginIndex::RemoveItem(const char *aKeyring, guint aItemId)
+{
+  char *key = itemKey(aKeyring, aItemId);
+  LoginMetadata *entry =
+    static_cast<LoginMetadata*>(g_hash_table_lookup(mByItem, key));
+  g_free(key);
+
+  if (!entry)
+    return PR_FALSE;
+  Remove(entry->hostname, entry->keyring, entry->itemId);
+  return PR_TRUE;
 }
 
-/* Implementation file */
+LoginMetadata *
+LoginIndex::FindExact(const char *aFingerprint)
+{
+  return static_cast<LoginMetadata*>(
+           g_hash_table_lookup(mByFingerprint, aFingerprint));
+}
 
-/// The following code works around the problem that newILoginManagerStorage has a new UUID in
-/// Firefox 4.0, but this component should be compatible with both 3.6 and 4.0.
+struct CollectState
+{
+  GPtrArray *result;
+  PRBool all;
+};
 
-#define LOGIN_MANAGER_STORAGE_3_6_CID {0xe66c97cd, 0x3bcf, 0x4eee, { 0x99, 0x37, 0x38, 0xf6, 0x50, 0x37, 0x2d, 0x77 }}
-NS_DEFINE_NAMED_CID(LOGIN_MANAGER_STORAGE_3_6_CID);
+void
+collectUntagged(gpointer key, gpointer value, gpointer data)
+{
+  GPtrArray *entries = static_cast<GPtrArray*>(value);
+  CollectState *state = static_cast<CollectState*>(data);
+
+  for (guint i = 0; i < entries->len; i++) {
+    LoginMetadata *entry =
+      static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+    if (state->all || !entry->tagged)
+      g_ptr_array_add(state->result, new LoginMetadata(*entry));
+  }
+}
+
+void
+LoginIndex::CollectUntagged(GPtrArray *aResult, PRBool aAll)
+{
+  CollectState state = { aResult, aAll };
+  g_hash_table_foreach(mByHost, collectUntagged, &state);
+}
 
-NS_IMPL_ADDREF(GnomeKeyring)
-NS_IMPL_RELEASE(GnomeKeyring)
+struct ForEachState
+{
+  LoginIndex::EntryFunc func;
+  void *data;
+};
 
-NS_INTERFACE_MAP_BEGIN(GnomeKeyring)
-NS_INTERFACE_MAP_ENTRY(nsILoginManagerStorage)
-  if ( aIID.Equals(kLOGIN_MANAGER_STORAGE_3_6_CID ) )
-    foundInterface = static_cast<nsILoginManagerStorage*>(this);
-  else
-NS_INTERFACE_MAP_ENTRY_AMBIGUOUS(nsISupports, nsILoginManagerStorage)
-NS_INTERFACE_MAP_END
+void
+forEachEntry(gpointer key, gpointer value, gpointer data)
+{
+  GPtrArray *entries = static_cast<GPtrArray*>(value);
+  ForEachState *state = static_cast<ForEachState*>(data);
 
-// End code to deal with 4.0  / 3.6 compatibility
+  for (guint i = 0; i < entries->len; i++)
+    state->func(static_cast<LoginMetadata*>(g_ptr_array_index(entries, i)),
+                state->data);
+}
 
-NS_IMETHODIMP GnomeKeyring::Init()
+void
+LoginIndex::ForEach(EntryFunc aFunc, void *aData)
+{
+  ForEachState state = { aFunc, aData };
+  g_hash_table_foreach(mByHost, forEachEntry, &state);
+}
+
+GPtrArray *
+LoginIndex::lookupHost(const char *aHostname)
+{
+  return static_cast<GPtrArray*>(g_hash_table_lookup(mByHost, aHostname));
+}
+
+PRUint32
+LoginIndex::CountMatches(const char *aHostname,
+                         const char *aActionURL,
+                         const char *aHttpRealm)
+{
+  GPtrArray *entries = lookupHost(aHostname);
+  if (!entries)
+    return 0;
+
+  PRUint32 count = 0;
+  for (guint i = 0; i < entries->len; i++) {
+    LoginMetadata *entry =
+      static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+    if (metadataMatches(entry, aActionURL, aHttpRealm))
+      count++;
+  }
+  return count;
+}
+
+/* The logins are built straight into an array sized once, so the cost is
+ * linear in the number of matches. */
+nsILoginInfo **
+allocLoginArray(PRUint32 aCount)
+{
+  GK_LOG(("Num items: %i\n", aCount));
+  return static_cast<nsILoginInfo**>(
+           nsMemory::Alloc(aCount * sizeof(nsILoginInfo*)));
+}
+
+// Logins only copy the attributes, the passwords are fetched when first read
+nsILoginInfo *
+metadataToLoginInfo(LoginMetadata *aEntry)
+{
+  nsILoginInfo *login = new KeyringLoginInfo(aEntry);
+  NS_ADDREF(login);
+  return login;
+}
+
+nsresult
+LoginIndex::BuildMatches(const char *aHostname,
+                         const char *aActionURL,
+                         const char *aHttpRealm,
+                         PRUint32 *aCount,
+                         nsILoginInfo ***aLogins)
+{
+  PRUint32 count = CountMatches(aHostname, aActionURL, aHttpRealm);
+  nsILoginInfo **array = allocLoginArray(count);
+  NS_ENSURE_TRUE(array, NS_ERROR_OUT_OF_MEMORY);
+
+  if (count) {
+    GPtrArray *entries =
+      static_cast<GPtrArray*>(g_hash_table_lookup(mByHost, aHostname));
+    PRUint32 n = 0;
+    for (guint i = 0; i < entries->len; i++) {
+      LoginMetadata *entry =
+        static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+      if (metadataMatches(entry, aActionURL, aHttpRealm))
+        array[n++] = metadataToLoginInfo(entry);
+    }
+  }
+
+  *aCount = count;
+  *aLogins = array;
+  return NS_OK;
+}
+
+void
+countHostEntries(gpointer key, gpointer value, gpointer data)
+{
+  *static_cast<PRUint32*>(data) += static_cast<GPtrArray*>(value)->len;
+}
+
+void
+buildHostLogins(gpointer key, gpointer value, gpointer data)
+{
+  GPtrArray *entries = static_cast<GPtrArray*>(value);
+  nsILoginInfo ***cursor = static_cast<nsILoginInfo***>(data);
+
+  for (guint i = 0; i < entries->len; i++) {
+    LoginMetadata *entry =
+      static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+    *(*cursor)++ = metadataToLoginInfo(entry);
+  }
+}
+
+nsresult
+LoginIndex::BuildAll(PRUint32 *aCount, nsILoginInfo ***aLogins)
+{
+  PRUint32 count = 0;
+  g_hash_table_foreach(mByHost, countHostEntries, &count);
+
+  nsILoginInfo **array = allocLoginArray(count);
+  NS_ENSURE_TRUE(array, NS_ERROR_OUT_OF_MEMORY);
+
+  nsILoginInfo **cursor = array;
+  g_hash_table_foreach(mByHost, buildHostLogins, &cursor);
+
+  *aCount = count;
+  *aLogins = array;
+  return NS_OK;
+}
+
+struct SearchState
+{
+  const char **values;
+  GPtrArray *matches;
+};
+
+void
+searchHostEntries(gpointer key, gpointer value, gpointer data)
+{
+  GPtrArray *entries = static_cast<GPtrArray*>(value);
+  SearchState *state = static_cast<SearchState*>(data);
+
+  for (guint i = 0; i < entries->len; i++) {
+    LoginMetadata *entry =
+      static_cast<LoginMetadata*>(g_ptr_array_index(entries, i));
+    const char *entryValues[kFieldCount] = {
+      entry->hostname, entry->formSubmitURL, entry->httpRealm,
+      entry->username, entry->usernameField, entry->passwordField
+    };
+
+    PRUint32 field;
+    for (field = 0; field < kFieldCount; field++) {
+      const char *wanted = state->values[field];
+      if (wanted && !(entryValues[field] &&
+                      !strcmp(wanted, entryValues[field])))
+        break;
+    }
+    if (field == kFieldCount)
+      g_ptr_array_add(state->matches, entry);
+  }
+}
+
+/* Like the daemon search for aQuery: every login attribute it holds must
+ * be equal, the others match anything. */
+nsresult
+LoginIndex::BuildSearch(GnomeKeyringAttributeList *aQuery,
+                        PRUint32 *aCount,
+                        nsILoginInfo ***aLogins)
+{
+  const char *values[kFieldCount];
+  decodeLoginAttributes(aQuery, values);
+
+  SearchState state = { values, g_ptr_array_new() };
+  if (values[kFieldHostname]) {
+    GPtrArray *entries = lookupHost(values[kFieldHostname]);
+    if (entries)
+      searchHostEntries(NULL, entries, &state);
+  } else {
+    g_hash_table_foreach(mByHost, searchHostEntries, &state);
+  }
+
+  nsILoginInfo **array = allocLoginArray(state.matches->len);
+  if (!array) {
+    g_ptr_array_free(state.matches, TRUE);
+    return NS_ERROR_OUT_OF_MEMORY;
+  }
+  for (guint i = 0; i < state.matches->len; i++)
+    array[i] = metadataToLoginInfo(
+                 static_cast<LoginMetadata*>(
+                   g_ptr_array_index(state.matches, i)));
+
+  *aCount = state.matches->len;
+  *aLogins = array;
+  g_ptr_array_free(state.matches, TRUE);
+  return NS_OK;
+}
+
+DisabledHostSet::DisabledHostSet()
+  : mSnapshot(NULL),
+    mLoaded(PR_FALSE)
+{
+  mHosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+DisabledHostSet::~DisabledHostSet()
+{
+  g_hash_table_destroy(mHosts);
+}
+
+void
+DisabledHostSet::Invalidate()
+{
+  g_hash_table_remove_all(mHosts);
+  mLoaded = PR_FALSE;
+}
+
+PRBool
+DisabledHostSet::Contains(const char *aHost)
+{
+  return g_hash_table_lookup(mHosts, aHost) != NULL;
+}
+
+void
+DisabledHostSet::Add(const char *aHost)
+{
+  char *host = g_strdup(aHost);
+  g_hash_table_replace(mHosts, host, host);
+
+  if (mLoaded && mSnapshot)
+    mSnapshot->HostChanged(aHost, PR_TRUE);
+}
+
+void
+DisabledHostSet::Remove(const char *aHost)
+{
+  if (g_hash_table_remove(mHosts, aHost) && mLoaded && mSnapshot)
+    mSnapshot->HostChanged(aHost, PR_FALSE);
+}
+
+PRUint32
+DisabledHostSet::Count()
+{
+  return g_hash_table_size(mHosts);
+}
+
+void
+collectHost(gpointer key, gpointer value, gpointer data)
+{
+  g_ptr_array_add(static_cast<GPtrArray*>(data),
+                  g_strdup(static_cast<const char*>(key)));
+}
+
+void
+DisabledHostSet::CollectAll(GPtrArray *aResult)
+{
+  g_hash_table_foreach(mHosts, collectHost, aResult);
+}
+
+/* Search the logins of a host. Only the items matching aActionURL and
+ * aHttpRealm are kept in aFoundList. The daemon only matches the host:
+ * the items without formSubmitURL or httpRealm match any pattern, which a
+ * search on those attributes would leave out. */
+GnomeKeyringResult
+findLogins(const char *aHostname,
+           const char *aActionURL,
+           const char *aHttpRealm,
+           GList **aFoundList)
+{
+  GList* found = NULL;
+  GnomeKeyringResult result = findItemsv(GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                         &found,
+                                         kHostnameAttr, aHostname,
+                                         NULL);
+
+  GList* l = found;
+  while (l != NULL) {
+    GList* next = l->next;
+    GnomeKeyringFound* item = static_cast<GnomeKeyringFound*>(l->data);
+
+    if (!inSearchScope(item->keyring) ||
+        !attributeMatches(aActionURL,
+                          findAttribute(item->attributes,
+                                        kFormSubmitURLAttr)) ||
+        !attributeMatches(aHttpRealm,
+                          findAttribute(item->attributes, kHttpRealmAttr))) {
+      gnome_keyring_found_free(item);
+      found = g_list_delete_link(found, l);
+    }
+    l = next;
+  }
+
+  *aFoundList = found;
+  return result;
+}
+
+nsresult
+GnomeKeyring::loadKeyringMetadata(const char *aKeyring)
+{
+  KeyringBackend *backend = KeyringBackend::Get();
+  PRBool locked;
+  PRInt64 mtime;
+  GnomeKeyringResult result = backend->GetKeyringInfo(aKeyring, &locked,
+                                                      &mtime);
+  // keyringName doesn't exist before the first login is saved
+  if (result == GNOME_KEYRING_RESULT_NO_SUCH_KEYRING)
+    return NS_OK;
+  GK_ENSURE_SUCCESS(result);
+
+  /* Attributes of a locked keyring aren't readable without prompting.
+   * Leaving it out would hide its logins until the next session, so the
+   * index isn't built and the daemon searches, which prompt, are used
+   * until it gets unlocked. */
+  if (locked) {
+    GK_LOG(("Not indexing locked keyring %s\n", aKeyring));
+    return NS_ERROR_NOT_AVAILABLE;
+  }
+
+  GList *ids;
+  result = backend->ListItemIds(aKeyring, &ids);
+  GK_ENSURE_SUCCESS(result);
+
+  nsresult rv = NS_OK;
+  for (GList* l = ids; l != NULL; l = l->next) {
+    guint id = GPOINTER_TO_UINT(l->data);
+    GnomeKeyringAttributeList *attributes;
+
+    result = backend->GetAttributes(aKeyring, id, &attributes);
+    if (result != GNOME_KEYRING_RESULT_OK) {
+      rv = NS_ERROR_FAILURE;
+      break;
+    }
+
+    if (isLoginItem(attributes))
+      mIndex.Add(new LoginMetadata(aKeyring, id, attributes));
+    gnome_keyring_attribute_list_free(attributes);
+  }
+  g_list_free(ids);
+  return rv;
+}
+
+// Name of the file holding the snapshot, in the profile directory
+static const char kSnapshotFileName[] = "gnome-keyring-snapshot";
+
+static PRUint64
+hashBytes(PRUint64 aHash, const void *aData, PRUint32 aLength)
+{
+  const unsigned char *data = static_cast<const unsigned char*>(aData);
+
+  for (PRUint32 i = 0; i < aLength; i++)
+    aHash = (aHash ^ data[i]) * 1099511628211ULL;
+  return aHash;
+}
+
+static PRUint64
+hashKeyringState(PRUint64 aHash, const char *aKeyring, PRUint32 *aItems)
+{
+  aHash = hashBytes(aHash, aKeyring, strlen(aKeyring) + 1);
+
+  KeyringBackend *backend = KeyringBackend::Get();
+  PRBool isLocked;
+  PRInt64 mtime;
+  GnomeKeyringResult result = backend->GetKeyringInfo(aKeyring, &isLocked,
+                                                      &mtime);
+  if (result != GNOME_KEYRING_RESULT_OK)
+    return hashBytes(aHash, &result, sizeof(result));
+
+  PRUint8 locked = isLocked != PR_FALSE;
+  aHash = hashBytes(aHash, &mtime, sizeof(mtime));
+  aHash = hashBytes(aHash, &locked, sizeof(locked));
+
+  GList *ids;
+  if (!locked &&
+      backend->ListItemIds(aKeyring, &ids) == GNOME_KEYRING_RESULT_OK) {
+    PRUint32 count = g_list_length(ids);
+    aHash = hashBytes(aHash, &count, sizeof(count));
+    *aItems += count;
+    g_list_free(ids);
+  }
+  return aHash;
+}
+
+/* Summary of the keyrings the index is built from, which changes when
+ * their items may have. The daemon updates the mtime of a keyring when
+ * its items change; the item count catches the changes made within the
+ * same second, and the lock state whether the items were readable.
+ * aItems is the number of items of the unlocked keyrings. */
+static nsresult
+computeKeyringStamp(PRUint64 *aStamp, PRUint32 *aItems)
+{
+  PRUint64 hash = 14695981039346656037ULL;
+
+  *aItems = 0;
+  if (searchAllKeyrings) {
+    GList *names;
+    GnomeKeyringResult result = KeyringBackend::Get()->ListKeyrings(&names);
+    GK_ENSURE_SUCCESS(result);
+
+    for (GList* l = names; l != NULL; l = l->next)
+      hash = hashKeyringState(hash, static_cast<const char*>(l->data),
+                              aItems);
+    gnome_keyring_string_list_free(names);
+  } else {
+    hash = hashKeyringState(hash, keyringName.get(), aItems);
+  }
+  *aStamp = hash;
+  return NS_OK;
+}
+
+// What decides which items are ours; a snapshot is only used with the same
+static PRUint64
+snapshotScope()
+{
+  PRUint64 hash = 14695981039346656037ULL;
+  PRUint8 all = searchAllKeyrings != PR_FALSE;
+
+  hash = hashBytes(hash, keyringName.get(), keyringName.Length() + 1);
+  hash = hashBytes(hash, loginInfoMagic.get(), loginInfoMagic.Length() + 1);
+  hash = hashBytes(hash, disabledHostMagic.get(),
+                   disabledHostMagic.Length() + 1);
+  return hashBytes(hash, &all, sizeof(all));
+}
+
+/* Fill the index and the disabled hosts from the snapshot of the last
+ * session. Its stamp is checked against the keyrings first, which takes
+ * a few calls where loading the index takes one per item, so that no
+ * lookup is answered from a snapshot the keyrings moved away from. */
+nsresult
+GnomeKeyring::loadSnapshot()
+{
+  nsresult rv = mSnapshot.Load();
+  if (NS_SUCCEEDED(rv) && !mSnapshot.IsCurrent()) {
+    GK_LOG(("Snapshot is out of date, reloading the index\n"));
+    rv = NS_ERROR_FAILURE;
+  }
+  if (NS_FAILED(rv)) {
+    mIndex.Invalidate();
+    mDisabledHosts.Invalidate();
+    return rv;
+  }
+
+  mIndex.SetLoaded();
+  mDisabledHosts.SetLoaded();
+  return NS_OK;
+}
+
+/* The index is built from item ids and attributes only, so that no secret
+ * is sent over the bus and no item has to be decrypted to fill it. */
+nsresult
+GnomeKeyring::ensureIndex()
+{
+  ensureProfileId();
+  if (mIndex.IsLoaded()) {
+    KeyringStats::Count(KeyringStats::kIndexHits);
+    return NS_OK;
+  }
+  KeyringStats::Count(KeyringStats::kIndexMisses);
+
+  if (!mSnapshotTried) {
+    mSnapshotTried = PR_TRUE;
+    if (NS_SUCCEEDED(loadSnapshot())) {
+      GK_LOG(("Login index loaded from the snapshot\n"));
+      startFingerprintMigration();
+      return NS_OK;
+    }
+  }
+
+  nsresult rv = NS_OK;
+  if (searchAllKeyrings) {
+    GList *names;
+    GnomeKeyringResult result = KeyringBackend::Get()->ListKeyrings(&names);
+    GK_ENSURE_SUCCESS(result);
+
+    // Look for a locked keyring first, not to load the others for nothing
+    for (GList* l = names; l != NULL && NS_SUCCEEDED(rv); l = l->next) {
+      PRBool locked;
+      PRInt64 mtime;
+      if (KeyringBackend::Get()->GetKeyringInfo(
+            static_cast<const char*>(l->data), &locked, &mtime) ==
+            GNOME_KEYRING_RESULT_OK && locked) {
+        GK_LOG(("Not indexing while %s is locked\n",
+                static_cast<const char*>(l->data)));
+        rv = NS_ERROR_NOT_AVAILABLE;
+      }
+    }
+
+    for (GList* l = names; l != NULL && NS_SUCCEEDED(rv); l = l->next)
+      rv = loadKeyringMetadata(static_cast<const char*>(l->data));
+    gnome_keyring_string_list_free(names);
+  } else {
+    rv = loadKeyringMetadata(keyringName.get());
+  }
+
+  if (NS_FAILED(rv)) {
+    mIndex.Invalidate();
+    return rv;
+  }
+  mIndex.SetLoaded();
+  GK_LOG(("Login index loaded\n"));
+  startFingerprintMigration();
+
+  // The snapshot holds both, so it is only written once they are loaded
+  if (NS_SUCCEEDED(ensureDisabledHosts()))
+    mSnapshot.Rewrite();
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::ensureDisabledHosts()
+{
+  ensureProfileId();
+  if (mDisabledHosts.IsLoaded()) {
+    KeyringStats::Count(KeyringStats::kDisabledHostHits);
+    return NS_OK;
+  }
+  KeyringStats::Count(KeyringStats::kDisabledHostMisses);
+
+  // Loading the index may load the hosts from the snapshot
+  ensureIndex();
+  if (mDisabledHosts.IsLoaded())
+    return NS_OK;
+
+  AutoFoundList foundList;
+
+  GnomeKeyringResult result = findItemsv(
+          GNOME_KEYRING_ITEM_NOTE,
+          &foundList,
+          NULL);
+
+  GK_ENSURE_SUCCESS_BUGGY(result);
+
+  for (GList* l = foundList; l != NULL; l = l->next) {
+    GnomeKeyringFound* found = static_cast<GnomeKeyringFound*>(l->data);
+    const char *host = findAttribute(found->attributes,
+                                     kDisabledHostAttrName);
+    if (host && inSearchScope(found->keyring))
+      mDisabledHosts.Add(host);
+  }
+  mDisabledHosts.SetLoaded();
+  return NS_OK;
+}
+
+/* Plain copy of what the keyring thread needs from a login. It is taken on
+ * the calling thread, as the login may be implemented in JS. */
+struct LoginData
+{
+  LoginData() : attributes(NULL), hasPassword(PR_FALSE) { }
+  ~LoginData() {
+    if (attributes)
+      gnome_keyring_attribute_list_free(attributes);
+  }
+
+  nsresult Set(GnomeKeyringAttributeList *aAttributes, nsILoginInfo *aLogin) {
+    nsAutoString s;
+    SetAttributes(aAttributes);
+    aLogin->GetPassword(s);
+    nsresult rv = SetPassword(s);
+    SecretArena::Wipe(s);
+    return rv;
+  }
+
+  nsresult SetPassword(const nsAString &aPassword) {
+    nsresult rv = password.AssignUTF16(aPassword);
+    NS_ENSURE_SUCCESS(rv, rv);
+    hasPassword = PR_TRUE;
+    return NS_OK;
+  }
+
+  /* Without a password, for the logins only looked up by their attributes
+   * and the property bag of ModifyLogin */
+  void SetAttributes(GnomeKeyringAttributeList *aAttributes) {
+    attributes = aAttributes;
+    const char *value = findAttribute(attributes, kHostnameAttr);
+    hostname.Assign(value ? value : "");
+    value = findAttribute(attributes, kFingerprintAttr);
+    fingerprint.Assign(value ? value : "");
+  }
+
+  GnomeKeyringAttributeList *attributes;
+  nsCString hostname;
+  nsCString fingerprint;
+  SecretBuffer password;
+  PRBool hasPassword;
+};
+
+/* Arguments of FindLogins and CountLogins. A void actionURL or httpRealm
+ * is passed on as NULL. */
+struct LoginQuery
+{
+  LoginQuery(const nsAString &aHostname,
+             const nsAString &aActionURL,
+             const nsAString &aHttpRealm)
+    : hostname(aHostname),
+      actionURL(aActionURL),
+      httpRealm(aHttpRealm)
+  {
+  }
+
+  const char *Hostname() { return hostname.get(); }
+  const char *ActionURL() {
+    return actionURL.IsVoid() ? NULL : actionURL.get();
+  }
+  const char *HttpRealm() {
+    return httpRealm.IsVoid() ? NULL : httpRealm.get();
+  }
+
+  NS_ConvertUTF16toUTF8 hostname;
+  NS_ConvertUTF16toUTF8 actionURL;
+  NS_ConvertUTF16toUTF8 httpRealm;
+};
+
+/* Tasks calling a do* method of the storage on the keyring thread. The
+ * arguments are copied as is, so they must stay valid until the task
+ * ran. */
+typedef nsresult (GnomeKeyring::*Method0)();
+
+class MethodTask0 : public KeyringTask
+{
+public:
+  MethodTask0(GnomeKeyring *aSelf, Method0 aMethod)
+    : mSelf(aSelf), mMethod(aMethod) { }
+
+  nsresult Execute() { return (mSelf->*mMethod)(); }
+
+private:
+  GnomeKeyring *mSelf;
+  Method0 mMethod;
+};
+
+template<class A1>
+class MethodTask1 : public KeyringTask
+{
+public:
+  typedef nsresult (GnomeKeyring::*Method)(A1);
+
+  MethodTask1(GnomeKeyring *aSelf, Method aMethod, A1 a1)
+    : mSelf(aSelf), mMethod(aMethod), mA1(a1) { }
+
+  nsresult Execute() { return (mSelf->*mMethod)(mA1); }
+
+private:
+  GnomeKeyring *mSelf;
+  Method mMethod;
+  A1 mA1;
+};
+
+template<class A1, class A2>
+class MethodTask2 : public KeyringTask
+{
+public:
+  typedef nsresult (GnomeKeyring::*Method)(A1, A2);
+
+  MethodTask2(GnomeKeyring *aSelf, Method aMethod, A1 a1, A2 a2)
+    : mSelf(aSelf), mMethod(aMethod), mA1(a1), mA2(a2) { }
+
+  nsresult Execute() { return (mSelf->*mMethod)(mA1, mA2); }
+
+private:
+  GnomeKeyring *mSelf;
+  Method mMethod;
+  A1 mA1;
+  A2 mA2;
+};
+
+template<class A1, class A2, class A3>
+class MethodTask3 : public KeyringTask
+{
+public:
+  typedef nsresult (GnomeKeyring::*Method)(A1, A2, A3);
+
+  MethodTask3(GnomeKeyring *aSelf, Method aMethod, A1 a1, A2 a2, A3 a3)
+    : mSelf(aSelf), mMethod(aMethod), mA1(a1), mA2(a2), mA3(a3) { }
+
+  nsresult Execute() { return (mSelf->*mMethod)(mA1, mA2, mA3); }
+
+private:
+  GnomeKeyring *mSelf;
+  Method mMethod;
+  A1 mA1;
+  A2 mA2;
+  A3 mA3;
+};
+
+// Keeps the arguments of callOnKeyringThread from taking part in the
+// deduction, so that e.g. NULL can be passed for a pointer.
+template<class T>
+struct TaskArg
+{
+  typedef T Type;
+};
+
+nsresult
+callOnKeyringThread(GnomeKeyring *aSelf, Method0 aMethod)
+{
+  return KeyringThread::RunSync(new MethodTask0(aSelf, aMethod));
+}
+
+template<class A1>
+nsresult
+callOnKeyringThread(GnomeKeyring *aSelf,
+                    nsresult (GnomeKeyring::*aMethod)(A1),
+                    typename TaskArg<A1>::Type a1)
+{
+  return KeyringThread::RunSync(new MethodTask1<A1>(aSelf, aMethod, a1));
+}
+
+template<class A1, class A2>
+nsresult
+callOnKeyringThread(GnomeKeyring *aSelf,
+                    nsresult (GnomeKeyring::*aMethod)(A1, A2),
+                    typename TaskArg<A1>::Type a1,
+                    typename TaskArg<A2>::Type a2)
+{
+  return KeyringThread::RunSync(
+           new MethodTask2<A1, A2>(aSelf, aMethod, a1, a2));
+}
+
+template<class A1, class A2, class A3>
+nsresult
+callOnKeyringThread(GnomeKeyring *aSelf,
+                    nsresult (GnomeKeyring::*aMethod)(A1, A2, A3),
+                    typename TaskArg<A1>::Type a1,
+                    typename TaskArg<A2>::Type a2,
+                    typename TaskArg<A3>::Type a3)
+{
+  return KeyringThread::RunSync(
+           new MethodTask3<A1, A2, A3>(aSelf, aMethod, a1, a2, a3));
+}
+
+/* Result of GetAllLogins and FindLogins. With the index the logins are
+ * built on the keyring thread, straight into the returned array. Without
+ * it the found items are converted by the caller, as nsLoginInfo is
+ * implemented in JS. */
+struct FindResult
+{
+  FindResult() : count(0), logins(nsnull), foundList(NULL) { }
+  ~FindResult() {
+    if (logins)
+      NS_FREE_XPCOM_ISUPPORTS_POINTER_ARRAY(count, logins);
+    if (foundList)
+      gnome_keyring_found_list_free(foundList);
+  }
+
+  nsresult Take(PRUint32 *aCount, nsILoginInfo ***aLogins) {
+    if (foundList)
+      return foundListToArray(foundToLoginInfo, foundList, aCount, aLogins);
+    *aCount = count;
+    *aLogins = logins;
+    logins = nsnull;
+    return NS_OK;
+  }
+
+  PRUint32 count;
+  nsILoginInfo **logins;
+  GList *foundList;
+};
+
+struct CreateRequest
+{
+  AsyncBatch *batch;
+  LoginData *login;
+  LoginMetadata *entry;
+  PRUint32 *result;
+};
+
+static void
+setCreateResult(CreateRequest *request, GnomeKeyringResult result, guint32 id)
+{
+  if (result == GNOME_KEYRING_RESULT_OK) {
+    request->entry->itemId = id;
+    *request->result = NS_OK;
+  } else {
+    GK_LOG(("Creating item failed: %i\n", result));
+    *request->result = NS_ERROR_FAILURE;
+  }
+}
+
+void
+onLoginCreated(GnomeKeyringResult result, guint32 id, gpointer data)
+{
+  CreateRequest *request = static_cast<CreateRequest*>(data);
+
+  setCreateResult(request, result, id);
+  request->batch->Complete();
+}
+
+void
+startCreate(AsyncBatch *aBatch, PRUint32 aIndex, void *aData)
+{
+  CreateRequest *request = static_cast<CreateRequest*>(aData) + aIndex;
+
+  request->batch = aBatch;
+  KeyringBackend::Get()->CreateItemAsync(keyringName.get(),
+                                         GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                         request->login->hostname.get(),
+                                         request->login->attributes,
+                                         request->login->password.get(),
+                                         onLoginCreated,
+                                         request);
+}
+
+/* Implementation file */
+
+/// The following code works around the problem that newILoginManagerStorage has a new UUID in
+/// Firefox 4.0, but this component should be compatible with both 3.6 and 4.0.
+
+#define LOGIN_MANAGER_STORAGE_3_6_CID {0xe66c97cd, 0x3bcf, 0x4eee, { 0x99, 0x37, 0x38, 0xf6, 0x50, 0x37, 0x2d, 0x77 }}
+NS_DEFINE_NAMED_CID(LOGIN_MANAGER_STORAGE_3_6_CID);
+
+// The asynchronous tasks hold references from the keyring thread
+NS_IMPL_THREADSAFE_ADDREF(GnomeKeyring)
+NS_IMPL_THREADSAFE_RELEASE(GnomeKeyring)
+
+NS_INTERFACE_MAP_BEGIN(GnomeKeyring)
+NS_INTERFACE_MAP_ENTRY(nsILoginManagerStorage)
+NS_INTERFACE_MAP_ENTRY(nsIGnomeKeyring)
+  if ( aIID.Equals(kLOGIN_MANAGER_STORAGE_3_6_CID ) )
+    foundInterface = static_cast<nsILoginManagerStorage*>(this);
+  else
+NS_INTERFACE_MAP_ENTRY_AMBIGUOUS(nsISupports, nsILoginManagerStorage)
+NS_INTERFACE_MAP_END
+
+// End code to deal with 4.0  / 3.6 compatibility
+
+/* The asynchronous tasks hold a reference until their Finish(), which
+ * runs on the main thread, so none of them is left when this runs. */
+GnomeKeyring::~GnomeKeyring()
+{
+  NS_ASSERTION(NS_IsMainThread(), "Storage released off the main thread");
+  mWatcher.Stop();
+  if (mThreadStarted)
+    KeyringThread::Shutdown();
+
+#ifdef PR_LOGGING
+  if (GK_LOG_ENABLED()) {
+    nsCString stats;
+    KeyringStats::ToJSON(stats);
+    GK_LOG(("Stats: %s\n", stats.get()));
+  }
+#endif
+}
+
+// Keyring thread side
+
+/* Create the password keyring, it doesn't hurt if it already exists.
+ * This is done before the first write rather than in Init, as it is a
+ * round trip to the daemon and may prompt for a password. */
+nsresult
+GnomeKeyring::ensureKeyring()
+{
+  ensureProfileId();
+  if (mKeyringCreated)
+    return NS_OK;
+
+  GnomeKeyringResult result =
+    KeyringBackend::Get()->CreateKeyring(keyringName.get());
+  if ((result != GNOME_KEYRING_RESULT_OK) &&
+     (result != GNOME_KEYRING_RESULT_ALREADY_EXISTS)) {
+    NS_ERROR("Can't open or create password keyring!");
+    return NS_ERROR_FAILURE;
+  }
+  mKeyringCreated = PR_TRUE;
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doAddLogin(LoginData *aLogin)
+{
+  nsresult rv = ensureKeyring();
+  NS_ENSURE_SUCCESS(rv, rv);
+  tagLogin(aLogin);
+
+  guint itemId;
+
+  GnomeKeyringResult result = KeyringBackend::Get()->CreateItem(
+                                        keyringName.get(),
+                                        GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                        aLogin->hostname.get(),
+                                        aLogin->attributes,
+                                        aLogin->password.get(),
+                                        &itemId);
+  GK_ENSURE_SUCCESS(result);
+  noteCreated(keyringName.get(), itemId);
+
+  if (mIndex.IsLoaded())
+    mIndex.Add(new LoginMetadata(keyringName.get(), itemId,
+                                 aLogin->attributes));
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doAddLogins(PRUint32 aCount, LoginData *aLogins,
+                          PRUint32 *aResults)
+{
+  nsresult rv = ensureKeyring();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  CreateRequest *requests = new CreateRequest[aCount];
+
+  for (PRUint32 i = 0; i < aCount; i++) {
+    tagLogin(&aLogins[i]);
+    requests[i].login = &aLogins[i];
+    requests[i].entry = new LoginMetadata(keyringName.get(), 0,
+                                          aLogins[i].attributes);
+    requests[i].result = &aResults[i];
+  }
+
+  if (KeyringBackend::Get()->IsPipelined()) {
+    AsyncBatch batch(aCount, asyncWindow, startCreate, requests);
+    batch.Run();
+  } else {
+    for (PRUint32 i = 0; i < aCount; i++) {
+      guint32 id = 0;
+      GnomeKeyringResult result = KeyringBackend::Get()->CreateItem(
+                                    keyringName.get(),
+                                    GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                    aLogins[i].hostname.get(),
+                                    aLogins[i].attributes,
+                                    aLogins[i].password.get(),
+                                    &id);
+      setCreateResult(&requests[i], result, id);
+    }
+  }
+
+  for (PRUint32 i = 0; i < aCount; i++) {
+    if (aResults[i] == NS_OK)
+      noteCreated(keyringName.get(), requests[i].entry->itemId);
+    if (aResults[i] == NS_OK && mIndex.IsLoaded())
+      mIndex.Add(requests[i].entry);
+    else
+      delete requests[i].entry;
+  }
+  delete[] requests;
+  return NS_OK;
+}
+
+/* Find the item holding exactly aLogin. The index answers from its
+ * fingerprint map. The items it doesn't know, like those of keyrings that
+ * were locked when it was loaded, are looked up by their attributes only:
+ * through the Secret Service by fingerprint, then by all the attributes for
+ * the ones stored before the fingerprint existed, or else by reading the
+ * attributes of every item in scope. find_items isn't used as it sends the
+ * secrets of all the matches over. NS_ERROR_NOT_AVAILABLE means there is no
+ * such item. */
+nsresult
+GnomeKeyring::findExactLogin(LoginData *aLogin, nsCString &aKeyring,
+                             guint *aItemId)
+{
+  const char *values[kFieldCount];
+  decodeLoginAttributes(aLogin->attributes, values);
+
+  if (NS_SUCCEEDED(ensureIndex())) {
+    LoginMetadata *entry = mIndex.FindExact(aLogin->fingerprint.get());
+    if (entry) {
+      const char *entryValues[kFieldCount] = {
+        entry->hostname, entry->formSubmitURL, entry->httpRealm,
+        entry->username, entry->usernameField, entry->passwordField
+      };
+      if (sameIdentity(values, entryValues)) {
+        KeyringStats::Count(KeyringStats::kExactHits);
+        aKeyring.Assign(entry->keyring);
+        *aItemId = entry->itemId;
+        return NS_OK;
+      }
+    }
+  }
+  KeyringStats::Count(KeyringStats::kExactMisses);
+
+  if (useSecretService && NS_SUCCEEDED(ensureSecretService())) {
+    GnomeKeyringAttributeList *query = gnome_keyring_attribute_list_new();
+    gnome_keyring_attribute_list_append_string(query, kFingerprintAttr,
+                                               aLogin->fingerprint.get());
+    nsresult rv = searchLogin(values, query, aKeyring, aItemId);
+    gnome_keyring_attribute_list_free(query);
+
+    if (rv == NS_ERROR_NOT_AVAILABLE) {
+      // The magic is checked on the results, to match the legacy items too
+      GnomeKeyringAttributeList *legacy =
+        copyAttributesWithout(aLogin->attributes, kFingerprintAttr);
+      query = copyAttributesWithout(legacy, kLoginInfoMagicAttrName);
+      gnome_keyring_attribute_list_free(legacy);
+      rv = searchLogin(values, query, aKeyring, aItemId);
+      gnome_keyring_attribute_list_free(query);
+    }
+    // NS_ERROR_NOT_AVAILABLE means the searches went through
+    if (NS_SUCCEEDED(rv) || rv == NS_ERROR_NOT_AVAILABLE)
+      return rv;
+  }
+  return scanForLogin(values, aKeyring, aItemId);
+}
+
+nsresult
+GnomeKeyring::ensureSecretService()
+{
+  if (mSecretServiceFailed)
+    return NS_ERROR_NOT_AVAILABLE;
+
+  nsresult rv = mSecretService.Open();
+  if (NS_FAILED(rv)) {
+    NS_WARNING("No Secret Service, using libgnome-keyring only");
+    mSecretServiceFailed = PR_TRUE;
+  }
+  return rv;
+}
+
+// Secret Service lookup of findExactLogin, for the items matching aQuery
+nsresult
+GnomeKeyring::searchLogin(const char **aValues,
+                          GnomeKeyringAttributeList *aQuery,
+                          nsCString &aKeyring, guint *aItemId)
+{
+  GPtrArray *paths = g_ptr_array_new();
+  nsresult rv = mSecretService.SearchItems(aQuery, paths);
+
+  if (NS_SUCCEEDED(rv))
+    rv = NS_ERROR_NOT_AVAILABLE;
+  for (guint i = 0; i < paths->len && rv == NS_ERROR_NOT_AVAILABLE; i++) {
+    const char *path = static_cast<const char*>(g_ptr_array_index(paths, i));
+    nsCString keyring;
+    guint itemId;
+    GnomeKeyringAttributeList *attributes;
+    if (!KeyringWatcher::ParseItemPath(path, keyring, &itemId) ||
+        !inSearchScope(keyring.get()) ||
+        NS_FAILED(mSecretService.GetAttributes(path, &attributes)))
+      continue;
+
+    const char *foundValues[kFieldCount];
+    decodeLoginAttributes(attributes, foundValues);
+    if (isLoginItem(attributes) && sameIdentity(aValues, foundValues)) {
+      aKeyring.Assign(keyring);
+      *aItemId = itemId;
+      rv = NS_OK;
+    }
+    gnome_keyring_attribute_list_free(attributes);
+  }
+
+  for (guint i = 0; i < paths->len; i++)
+    g_free(g_ptr_array_index(paths, i));
+  g_ptr_array_free(paths, TRUE);
+  return rv;
+}
+
+/* findExactLogin without the Secret Service: the attributes of every item
+ * in scope are read, which prompts once for a locked keyring like the
+ * daemon searches do. */
+nsresult
+GnomeKeyring::scanForLogin(const char **aValues,
+                           nsCString &aKeyring, guint *aItemId)
+{
+  KeyringBackend *backend = KeyringBackend::Get();
+  GList *names;
+  if (searchAllKeyrings) {
+    GnomeKeyringResult result = backend->ListKeyrings(&names);
+    GK_ENSURE_SUCCESS(result);
+  } else {
+    names = g_list_append(NULL, g_strdup(keyringName.get()));
+  }
+
+  nsresult rv = NS_ERROR_NOT_AVAILABLE;
+  for (GList* l = names; l != NULL && rv == NS_ERROR_NOT_AVAILABLE;
+       l = l->next) {
+    const char *keyring = static_cast<const char*>(l->data);
+    GList *ids;
+    GnomeKeyringResult result = backend->ListItemIds(keyring, &ids);
+    // keyringName doesn't exist before the first login is saved
+    if (result == GNOME_KEYRING_RESULT_NO_SUCH_KEYRING)
+      continue;
+    if (result != GNOME_KEYRING_RESULT_OK) {
+      rv = NS_ERROR_FAILURE;
+      break;
+    }
+
+    for (GList* i = ids; i != NULL && rv == NS_ERROR_NOT_AVAILABLE;
+         i = i->next) {
+      guint id = GPOINTER_TO_UINT(i->data);
+      GnomeKeyringAttributeList *attributes;
+      if (backend->GetAttributes(keyring, id, &attributes) !=
+          GNOME_KEYRING_RESULT_OK)
+        continue;
+
+      const char *foundValues[kFieldCount];
+      decodeLoginAttributes(attributes, foundValues);
+      if (isLoginItem(attributes) && sameIdentity(aValues, foundValues)) {
+        aKeyring.Assign(keyring);
+        *aItemId = id;
+        rv = NS_OK;
+      }
+      gnome_keyring_attribute_list_free(attributes);
+    }
+    g_list_free(ids);
+  }
+  gnome_keyring_string_list_free(names);
+  return rv;
+}
+
+/* Read the passwords of the logins built from the index in one GetSecrets
+ * call, rather than one request per login when they are asked for. The
+ * logins whose secret didn't come back, like those of locked keyrings,
+ * still load it on demand. */
+void
+GnomeKeyring::prefetchPasswords(FindResult *aResult)
+{
+  if (!useSecretService || !aResult->logins || aResult->count == 0 ||
+      NS_FAILED(ensureSecretService()))
+    return;
+
+  PRUint32 count = aResult->count;
+  nsCString *paths = new nsCString[count];
+  const char **pathArray = new const char*[count];
+  SecretBuffer *secrets = new SecretBuffer[count];
+  PRBool *found = new PRBool[count];
+
+  for (PRUint32 i = 0; i < count; i++) {
+    KeyringLoginInfo *login =
+      static_cast<KeyringLoginInfo*>(aResult->logins[i]);
+    SecretService::BuildItemPath(login->Keyring().get(), login->ItemId(),
+                                 paths[i]);
+    pathArray[i] = paths[i].get();
+  }
+
+  if (NS_SUCCEEDED(mSecretService.GetSecrets(pathArray, count, secrets,
+                                             found))) {
+    for (PRUint32 i = 0; i < count; i++) {
+      if (found[i])
+        static_cast<KeyringLoginInfo*>(aResult->logins[i])->
+          SetLoadedPassword(secrets[i]);
+    }
+  }
+
+  delete[] found;
+  delete[] secrets;
+  delete[] pathArray;
+  delete[] paths;
+}
+
+nsresult
+GnomeKeyring::doRemoveLogin(LoginData *aLogin)
+{
+  nsCString keyring;
+  guint itemId;
+
+  nsresult rv = findExactLogin(aLogin, keyring, &itemId);
+  if (rv == NS_ERROR_NOT_AVAILABLE) {
+    GK_LOG(("Found no item to delete"));
+    return NS_OK;
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  GnomeKeyringResult result = KeyringBackend::Get()->DeleteItem(keyring.get(),
+                                                             itemId);
+  GK_ENSURE_SUCCESS(result);
+  noteOwnWrite(keyring.get(), itemId, KeyringWatcher::ITEM_DELETED);
+
+  mIndex.Remove(aLogin->hostname.get(), keyring.get(), itemId);
+  return NS_OK;
+}
+
+/* The item keeps its id, so the login never goes missing for readers.
+ * The secret and display name are rewritten first, then the attributes;
+ * when aNewLogin has no password only the attributes change. */
+nsresult
+GnomeKeyring::doModifyLogin(LoginData *aOldLogin, LoginData *aNewLogin)
+{
+  nsCString keyring;
+  guint itemId;
+
+  nsresult rv = findExactLogin(aOldLogin, keyring, &itemId);
+  if (NS_FAILED(rv))
+    return NS_ERROR_FAILURE;
+  tagLogin(aNewLogin);
+
+  GnomeKeyringResult result;
+  if (aNewLogin->hasPassword) {
+    result = KeyringBackend::Get()->SetSecret(
+                                      keyring.get(), itemId,
+                                      GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                      aNewLogin->hostname.get(),
+                                      aNewLogin->password.get());
+    GK_ENSURE_SUCCESS(result);
+    noteOwnWrite(keyring.get(), itemId, KeyringWatcher::ITEM_CHANGED);
+  }
+
+  result = KeyringBackend::Get()->SetAttributes(keyring.get(), itemId,
+                                                aNewLogin->attributes);
+  GK_ENSURE_SUCCESS(result);
+  noteOwnWrite(keyring.get(), itemId, KeyringWatcher::ITEM_CHANGED);
+
+  if (mIndex.IsLoaded()) {
+    mIndex.Remove(aOldLogin->hostname.get(), keyring.get(), itemId);
+    mIndex.Add(new LoginMetadata(keyring.get(), itemId,
+                                 aNewLogin->attributes));
+  }
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doRemoveAllLogins()
+{
+  AutoFoundList foundList;
+  ensureProfileId();
+
+  GnomeKeyringResult result = findItemsv(
+                GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                &foundList,
+                NULL);
+
+  GK_ENSURE_SUCCESS_BUGGY(result);
+  dropOtherKeyrings(&foundList);
+
+  if (recreateKeyringOnClear && foundList != NULL &&
+      keyringHoldsOnly(foundList)) {
+    GK_LOG(("Recreating keyring %s\n", keyringName.get()));
+    mIndex.Invalidate();
+
+    result = KeyringBackend::Get()->DeleteKeyring(keyringName.get());
+    GK_ENSURE_SUCCESS(result);
+
+    // It comes back with the next write
+    mKeyringCreated = PR_FALSE;
+    return NS_OK;
+  }
+
+  return deleteFoundItems(foundList);
+}
+
+nsresult
+GnomeKeyring::doGetAllLogins(FindResult *aResult)
+{
+  if (NS_SUCCEEDED(ensureIndex())) {
+    nsresult rv = mIndex.BuildAll(&aResult->count, &aResult->logins);
+    if (NS_SUCCEEDED(rv))
+      prefetchPasswords(aResult);
+    return rv;
+  }
+
+  GnomeKeyringResult result = findItemsv(
+                                GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                &aResult->foundList,
+                                NULL);
+
+  GK_ENSURE_SUCCESS_BUGGY(result);
+  dropOtherKeyrings(&aResult->foundList);
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doFindLogins(LoginQuery *aQuery, FindResult *aResult)
+{
+  if (NS_SUCCEEDED(ensureIndex())) {
+    nsresult rv = mIndex.BuildMatches(aQuery->Hostname(),
+                                      aQuery->ActionURL(),
+                                      aQuery->HttpRealm(),
+                                      &aResult->count,
+                                      &aResult->logins);
+    if (NS_SUCCEEDED(rv))
+      prefetchPasswords(aResult);
+    return rv;
+  }
+
+  GnomeKeyringResult result = findLogins(aQuery->Hostname(),
+                                         aQuery->ActionURL(),
+                                         aQuery->HttpRealm(),
+                                         &aResult->foundList);
+
+  GK_ENSURE_SUCCESS_BUGGY(result);
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doSearchLogins(GnomeKeyringAttributeList *aAttributes,
+                             FindResult *aResult)
+{
+  if (NS_SUCCEEDED(ensureIndex()))
+    return mIndex.BuildSearch(aAttributes, &aResult->count,
+                              &aResult->logins);
+
+  GnomeKeyringResult result = findTaggedItems(
+                                        GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                                        aAttributes,
+                                        &aResult->foundList );
+  GK_ENSURE_SUCCESS_BUGGY(result);
+  dropOtherKeyrings(&aResult->foundList);
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doGetAllDisabledHosts(GPtrArray *aHosts)
+{
+  nsresult rv = ensureDisabledHosts();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mDisabledHosts.CollectAll(aHosts);
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doGetLoginSavingEnabled(const char *aHost, PRBool *aEnabled)
+{
+  nsresult rv = ensureDisabledHosts();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  *aEnabled = !mDisabledHosts.Contains(aHost);
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doSetLoginSavingEnabled(const char *aHost, PRBool aEnabled)
+{
+  nsresult rv = ensureDisabledHosts();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Nothing to do if the host is already in the wanted state
+  if (mDisabledHosts.Contains(aHost) == !aEnabled)
+    return NS_OK;
+
+  GnomeKeyringResult result;
+
+  if (aEnabled) {
+    AutoFoundList foundList;
+
+    result = findItemsv(
+              GNOME_KEYRING_ITEM_NOTE,
+              &foundList,
+              kDisabledHostAttrName, aHost,
+              NULL);
+
+    GK_ENSURE_SUCCESS_BUGGY(result);
+    rv = deleteFoundItems(foundList, PR_TRUE);
+    if (NS_SUCCEEDED(rv))
+      mDisabledHosts.Remove(aHost);
+    return rv;
+  }
+
+  rv = ensureKeyring();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  GnomeKeyringAttributeList *attributes;
+
+  attributes = gnome_keyring_attribute_list_new();
+  gnome_keyring_attribute_list_append_string(attributes,
+            kDisabledHostMagicAttrName, disabledHostMagic.get());
+  gnome_keyring_attribute_list_append_string(attributes,
+            kDisabledHostAttrName, aHost);
+
+  // TODO name should be more explicit
+  const char* name = "Mozilla disabled host entry";
+  guint itemId;
+
+  result = KeyringBackend::Get()->CreateItem(keyringName.get(),
+            GNOME_KEYRING_ITEM_NOTE,
+            name,
+            attributes,
+            "", // no secret
+            &itemId);
+  gnome_keyring_attribute_list_free (attributes);
+
+  GK_ENSURE_SUCCESS(result);
+  // The host wasn't disabled, so no note of it was updated
+  noteOwnWrite(keyringName.get(), itemId, KeyringWatcher::ITEM_CREATED);
+  mDisabledHosts.Add(aHost);
+  return NS_OK;
+}
+
+nsresult
+GnomeKeyring::doCountLogins(LoginQuery *aQuery, PRUint32 *aCount)
+{
+  /* Counting only needs the attributes, which the index has. It only
+   * falls back to findLogins, which pulls the secrets, while a keyring in
+   * scope is locked: the search then prompts for unlocking it. */
+  nsresult rv = ensureIndex();
+  if (rv == NS_ERROR_NOT_AVAILABLE) {
+    AutoFoundList foundList;
+    GnomeKeyringResult result = findLogins(aQuery->Hostname(),
+                                           aQuery->ActionURL(),
+                                           aQuery->HttpRealm(),
+                                           &foundList);
+    GK_ENSURE_SUCCESS_BUGGY(result);
+    *aCount = g_list_length(foundList);
+    return NS_OK;
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  *aCount = mIndex.CountMatches(aQuery->Hostname(),
+                                aQuery->ActionURL(),
+                                aQuery->HttpRealm());
+  return NS_OK;
+}
+
+// Items tagged with their fingerprint by each FingerprintMigrationTask
+static const PRUint32 kMigrationBatch = 32;
+
+// aAttributes with the magic aName set to aMagic
+static GnomeKeyringAttributeList *
+retagAttributes(GnomeKeyringAttributeList *aAttributes, const char *aName,
+                const char *aMagic)
+{
+  GnomeKeyringAttributeList *copy = copyAttributesWithout(aAttributes, aName);
+  gnome_keyring_attribute_list_free(aAttributes);
+  gnome_keyring_attribute_list_append_string(copy, aName, aMagic);
+  return copy;
+}
+
+/* Give the legacy disabled host notes the magic of this profile. They
+ * aren't in the index, so they are searched for; notes have no secret. */
+nsresult
+GnomeKeyring::doClaimDisabledHosts()
+{
+  AutoFoundList foundList;
+  GnomeKeyringAttributeList *query = gnome_keyring_attribute_list_new();
+  gnome_keyring_attribute_list_append_string(query,
+            kDisabledHostMagicAttrName, kLegacyDisabledHostMagic);
+  GnomeKeyringResult result =
+    KeyringBackend::Get()->FindItems(GNOME_KEYRING_ITEM_NOTE, query,
+                                     &foundList);
+  gnome_keyring_attribute_list_free(query);
+  GK_ENSURE_SUCCESS_BUGGY(result);
+  dropOtherKeyrings(&foundList);
+
+  nsresult rv = NS_OK;
+  for (GList* l = foundList; l != NULL; l = l->next) {
+    GnomeKeyringFound* found = static_cast<GnomeKeyringFound*>(l->data);
+    GnomeKeyringAttributeList *attributes =
+      copyAttributesWithout(found->attributes, kDisabledHostMagicAttrName);
+    gnome_keyring_attribute_list_append_string(attributes,
+              kDisabledHostMagicAttrName, disabledHostMagic.get());
+    result = KeyringBackend::Get()->SetAttributes(found->keyring,
+                                                  found->item_id,
+                                                  attributes);
+    gnome_keyring_attribute_list_free(attributes);
+    if (result == GNOME_KEYRING_RESULT_OK) {
+      noteOwnWrite(found->keyring, found->item_id,
+                   KeyringWatcher::ITEM_CHANGED);
+    } else {
+      GK_LOG(("Claiming item %i failed: %i\n", found->item_id, result));
+      rv = NS_ERROR_FAILURE;
+    }
+  }
+  return rv;
+}
+
+/* Tag the next kMigrationBatch items of aPending, copies of index entries,
+ * with their fingerprint, and give the legacy ones the magic of this
+ * profile. Items that went away or were tagged meanwhile are skipped. It
+ * fails when an item couldn't be written. */
+nsresult
+GnomeKeyring::doMigrateFingerprints(GPtrArray *aPending, PRUint32 *aNext)
+{
+  PRUint32 end = MIN(*aNext + kMigrationBatch, aPending->len);
+  nsresult rv = NS_OK;
+
+  for (; *aNext < end; (*aNext)++) {
+    LoginMetadata *entry =
+      static_cast<LoginMetadata*>(g_ptr_array_index(aPending, *aNext));
+    GnomeKeyringAttributeList *attributes;
+
+    GnomeKeyringResult result =
+      KeyringBackend::Get()->GetAttributes(entry->keyring, entry->itemId,
+                                           &attributes);
+    if (result != GNOME_KEYRING_RESULT_OK)
+      continue;
+
+    const char *stored = findAttribute(attributes, kFingerprintAttr);
+    const char *magic = findAttribute(attributes, kLoginInfoMagicAttrName);
+    PRBool legacy = magic && strcmp(magic, loginInfoMagic.get());
+    if (isLoginItem(attributes) &&
+        (legacy || !(stored && !strcmp(stored, entry->fingerprint)))) {
+      if (legacy)
+        attributes = retagAttributes(attributes, kLoginInfoMagicAttrName,
+                                     loginInfoMagic.get());
+      attributes = refreshFingerprint(attributes);
+      result = KeyringBackend::Get()->SetAttributes(entry->keyring,
+                                                      entry->itemId,
+                                                      attributes);
+      if (result == GNOME_KEYRING_RESULT_OK) {
+        noteOwnWrite(entry->keyring, entry->itemId,
+                     KeyringWatcher::ITEM_CHANGED);
+      } else {
+        GK_LOG(("Tagging item %i failed: %i\n", entry->itemId, result));
+        rv = NS_ERROR_FAILURE;
+      }
+    }
+    gnome_keyring_attribute_list_free(attributes);
+  }
+  return rv;
+}
+
+/* Adds the fingerprint attribute to the logins stored before it existed,
+ * so that the daemon can find them by fingerprint too. When aClaim is set
+ * the legacy items are given the id of this profile as well, which is
+ * recorded once every batch went through. Each task handles one batch on
+ * the keyring thread and queues the next one behind the requests that
+ * came in meanwhile. The storage lives on until the last batch is done. */
+class FingerprintMigrationTask : public KeyringTask
+{
+public:
+  FingerprintMigrationTask(GnomeKeyring *aStorage, GPtrArray *aPending,
+                           PRUint32 aNext, PRBool aClaim, PRBool aFailed)
+    : mStorage(aStorage), mPending(aPending), mNext(aNext), mClaim(aClaim),
+      mFailed(aFailed), mClaimed(PR_FALSE) { }
+
+  ~FingerprintMigrationTask()
+  {
+    if (!mPending)
+      return;
+    for (guint i = 0; i < mPending->len; i++)
+      delete static_cast<LoginMetadata*>(g_ptr_array_index(mPending, i));
+    g_ptr_array_free(mPending, TRUE);
+  }
+
+  nsresult Execute()
+  {
+    nsresult rv = mStorage->doMigrateFingerprints(mPending, &mNext);
+    if (NS_FAILED(rv))
+      mFailed = PR_TRUE;
+    if (mNext < mPending->len) {
+      // The next task takes the list over
+      KeyringThread::RunAsync(new FingerprintMigrationTask(mStorage,
+                                                           mPending, mNext,
+                                                           mClaim, mFailed));
+      mPending = NULL;
+    } else {
+      GK_LOG(("Fingerprint migration done, %u items\n", mPending->len));
+      // Items left behind are claimed by the next session
+      if (mClaim && !mFailed) {
+        legacyClaimed = PR_TRUE;
+        mClaimed = PR_TRUE;
+      }
+    }
+    return rv;
+  }
+
+  void Finish()
+  {
+    if (mClaimed) {
+      nsCOMPtr<nsIPrefBranch> pref =
+        do_GetService("@mozilla.org/preferences-service;1");
+      if (pref)
+        pref->SetBoolPref("extensions.gnome-keyring.legacyItemsClaimed",
+                          PR_TRUE);
+    }
+    mStorage = nsnull;
+  }
+
+private:
+  nsRefPtr<GnomeKeyring> mStorage;
+  GPtrArray *mPending;
+  PRUint32 mNext;
+  PRBool mClaim;
+  PRBool mFailed;
+  PRBool mClaimed;
+};
+
+// Called once the index is loaded, on the keyring thread
+void
+GnomeKeyring::startFingerprintMigration()
+{
+  if (mMigrationStarted)
+    return;
+  mMigrationStarted = PR_TRUE;
+
+  // Every item has to be read for its magic while legacy ones may be left
+  PRBool claim = !legacyClaimed;
+  PRBool failed = claim && NS_FAILED(doClaimDisabledHosts());
+
+  GPtrArray *pending = g_ptr_array_new();
+  mIndex.CollectUntagged(pending, claim);
+  if (pending->len == 0 && !claim) {
+    g_ptr_array_free(pending, TRUE);
+    return;
+  }
+
+  GK_LOG(("Tagging %u items with their fingerprint\n", pending->len));
+  KeyringThread::RunAsync(new FingerprintMigrationTask(this, pending, 0,
+                                                       claim, failed));
+}
+
+/* Brings the index and the disabled hosts up to date with a change made
+ * by another program, see KeyringWatcher. */
+class ItemChangeTask : public KeyringTask
+{
+public:
+  ItemChangeTask(GnomeKeyring *aStorage, KeyringWatcher::Change aChange,
+                 const char *aKeyring, guint aItemId)
+    : mStorage(aStorage),
+      mChange(aChange),
+      mKeyring(aKeyring),
+      mItemId(aItemId),
+      mTime(g_get_monotonic_time())
+  {
+  }
+
+  nsresult Execute()
+  {
+    mStorage->doApplyItemChange(mChange, mKeyring.get(), mItemId, mTime);
+    return NS_OK;
+  }
+
+  void Finish()
+  {
+    mStorage = nsnull;
+  }
+
+private:
+  nsRefPtr<GnomeKeyring> mStorage;
+  KeyringWatcher::Change mChange;
+  nsCString mKeyring;
+  guint mItemId;
+  // When the signal was received
+  gint64 mTime;
+};
+
+/* aChange is the change a write made to the item: its signal is to be
+ * skipped, and the snapshot accounts for the item count. */
+void
+GnomeKeyring::noteOwnWrite(const char *aKeyring, guint aItemId,
+                           KeyringWatcher::Change aChange)
+{
+  mOwnWrites.Add(aKeyring, aItemId, aChange);
+  if (!inSearchScope(aKeyring))
+    return;
+  if (aChange == KeyringWatcher::ITEM_CREATED)
+    mSnapshot.ItemsChanged(1);
+  else if (aChange == KeyringWatcher::ITEM_DELETED)
+    mSnapshot.ItemsChanged(-1);
+}
+
+/* CreateItem updates the item holding the same attributes if there is
+ * one, which leaves the item count alone. The index tells them apart by
+ * the returned id; until it is loaded the snapshot isn't used anyway. */
+void
+GnomeKeyring::noteCreated(const char *aKeyring, guint aItemId)
+{
+  PRBool updated = mIndex.IsLoaded() && mIndex.RemoveItem(aKeyring, aItemId);
+  noteOwnWrite(aKeyring, aItemId, updated ? KeyringWatcher::ITEM_CHANGED :
+                                            KeyringWatcher::ITEM_CREATED);
+}
+
+// Called on the main thread, see KeyringWatcher
+void
+GnomeKeyring::onKeyringChange(KeyringWatcher::Change aChange,
+                              const char *aKeyring, guint aItemId,
+                              void *aData)
+{
+  GnomeKeyring *self = static_cast<GnomeKeyring*>(aData);
+  KeyringThread::RunAsync(new ItemChangeTask(self, aChange, aKeyring,
+                                             aItemId));
+}
+
+/* Changes are also reported for our own writes, which already brought
+ * the index and the journal up to date: see mOwnWrites. Until the index
+ * is loaded there is nothing to update, as loading it reads the current
+ * state. */
+void
+GnomeKeyring::doApplyItemChange(KeyringWatcher::Change aChange,
+                                const char *aKeyring, guint aItemId,
+                                gint64 aTime)
+{
+  if (mOwnWrites.Take(aKeyring, aItemId, aChange, aTime)) {
+    GK_LOG(("Skipping the signal of our own write to item %u\n", aItemId));
+    return;
+  }
+  if (!inSearchScope(aKeyring))
+    return;
+
+  if (aChange == KeyringWatcher::ITEM_CREATED)
+    mSnapshot.ItemsChanged(1);
+  else if (aChange == KeyringWatcher::ITEM_DELETED)
+    mSnapshot.ItemsChanged(-1);
+
+  PRBool indexed = mIndex.IsLoaded() && mIndex.RemoveItem(aKeyring, aItemId);
+
+  if (aChange == KeyringWatcher::ITEM_DELETED) {
+    /* Disabled hosts aren't known by item, and the attributes of a
+     * deleted item can't be read anymore, so the hosts are read again.
+     * It only takes the search for the disabled host notes. */
+    if (!indexed && mDisabledHosts.IsLoaded()) {
+      mDisabledHosts.Invalidate();
+      if (NS_SUCCEEDED(ensureDisabledHosts()) && mIndex.IsLoaded())
+        mSnapshot.Rewrite();
+    }
+    return;
+  }
+
+  GnomeKeyringAttributeList *attributes;
+  GnomeKeyringResult result =
+    KeyringBackend::Get()->GetAttributes(aKeyring, aItemId, &attributes);
+  if (result != GNOME_KEYRING_RESULT_OK) {
+    GK_LOG(("Can't read changed item %u: %i\n", aItemId, result));
+    return;
+  }
+
+  if (isLoginItem(attributes)) {
+    if (mIndex.IsLoaded())
+      mIndex.Add(new LoginMetadata(aKeyring, aItemId, attributes));
+  } else if (mDisabledHosts.IsLoaded() && isDisabledHostItem(attributes)) {
+    mDisabledHosts.Add(findAttribute(attributes, kDisabledHostAttrName));
+  }
+  gnome_keyring_attribute_list_free(attributes);
+}
+
+// Asynchronous operations, their Finish() runs on the main thread
+
+class FindLoginsTask : public KeyringTask
+{
+public:
+  FindLoginsTask(GnomeKeyring *aStorage,
+                 const nsAString &aHostname,
+                 const nsAString &aActionURL,
+                 const nsAString &aHttpRealm,
+                 nsIGnomeKeyringLoginsCallback *aCallback)
+    : mStorage(aStorage),
+      mQuery(aHostname, aActionURL, aHttpRealm),
+      mCallback(aCallback),
+      mStart(g_get_monotonic_time())
+  {
+  }
+
+  nsresult Execute()
+  {
+    return mStorage->doFindLogins(&mQuery, &mFindResult);
+  }
+
+  void Finish()
+  {
+    PRUint32 count = 0;
+    nsILoginInfo **logins = nsnull;
+
+    nsresult rv = mResult;
+    if (NS_SUCCEEDED(rv))
+      rv = mFindResult.Take(&count, &logins);
+    // Timed up to the results being ready, like FindLogins
+    KeyringStats::Record(KeyringStats::kFindLogins, mStart);
+    mCallback->OnLogins(rv, count, logins);
+    if (logins)
+      NS_FREE_XPCOM_ISUPPORTS_POINTER_ARRAY(count, logins);
+
+    mCallback = nsnull;
+    mStorage = nsnull;
+  }
+
+private:
+  nsRefPtr<GnomeKeyring> mStorage;
+  LoginQuery mQuery;
+  FindResult mFindResult;
+  nsCOMPtr<nsIGnomeKeyringLoginsCallback> mCallback;
+  gint64 mStart;
+};
+
+class CountLoginsTask : public KeyringTask
+{
+public:
+  CountLoginsTask(GnomeKeyring *aStorage,
+                  const nsAString &aHostname,
+                  const nsAString &aActionURL,
+                  const nsAString &aHttpRealm,
+                  nsIGnomeKeyringResultCallback *aCallback)
+    : mStorage(aStorage),
+      mQuery(aHostname, aActionURL, aHttpRealm),
+      mCount(0),
+      mCallback(aCallback),
+      mStart(g_get_monotonic_time())
+  {
+  }
+
+  nsresult Execute()
+  {
+    return mStorage->doCountLogins(&mQuery, &mCount);
+  }
+
+  void Finish()
+  {
+    KeyringStats::Record(KeyringStats::kCountLogins, mStart);
+    mCallback->OnResult(mResult, mCount);
+    mCallback = nsnull;
+    mStorage = nsnull;
+  }
+
+private:
+  nsRefPtr<GnomeKeyring> mStorage;
+  LoginQuery mQuery;
+  PRUint32 mCount;
+  nsCOMPtr<nsIGnomeKeyringResultCallback> mCallback;
+  gint64 mStart;
+};
+
+class WriteLoginTask : public KeyringTask
+{
+public:
+  typedef nsresult (GnomeKeyring::*Method)(LoginData*);
+
+  WriteLoginTask(GnomeKeyring *aStorage, Method aMethod,
+                 KeyringStats::Method aStat,
+                 nsILoginInfo *aLogin, PRBool aWithPassword,
+                 nsIGnomeKeyringResultCallback *aCallback)
+    : mStorage(aStorage),
+      mMethod(aMethod),
+      mStat(aStat),
+      mSetResult(NS_OK),
+      mCallback(aCallback),
+      mStart(g_get_monotonic_time())
+  {
+    // The password is only copied for the methods that store it
+    if (aWithPassword)
+      mSetResult = mLogin.Set(aStorage->buildAttributeList(aLogin), aLogin);
+    else
+      mLogin.SetAttributes(aStorage->buildAttributeList(aLogin));
+  }
+
+  nsresult Execute()
+  {
+    // Nothing is written without the password, like AddLogin
+    NS_ENSURE_SUCCESS(mSetResult, mSetResult);
+    return (mStorage->*mMethod)(&mLogin);
+  }
+
+  void Finish()
+  {
+    KeyringStats::Record(mStat, mStart);
+    if (mCallback)
+      mCallback->OnResult(mResult, 0);
+    mCallback = nsnull;
+    mStorage = nsnull;
+  }
+
+private:
+  nsRefPtr<GnomeKeyring> mStorage;
+  Method mMethod;
+  KeyringStats::Method mStat;
+  LoginData mLogin;
+  nsresult mSetResult;
+  nsCOMPtr<nsIGnomeKeyringResultCallback> mCallback;
+  gint64 mStart;
+};
+
+// Caller side
+
+/* Fill the fake backend with aCount logins of this profile, one per host,
+ * as if they had been saved through the storage. */
+static void
+populateFakeBackend(FakeKeyringBackend *aBackend, PRUint32 aCount)
+{
+  for (PRUint32 i = 0; i < aCount; i++) {
+    char hostname[64], username[32], password[32];
+    g_snprintf(hostname, sizeof(hostname), "https://site%u.example.com", i);
+    g_snprintf(username, sizeof(username), "user%u", i);
+    g_snprintf(password, sizeof(password), "password%u", i);
+
+    const char *values[kFieldCount];
+    values[kFieldHostname] = hostname;
+    values[kFieldFormSubmitURL] = hostname;
+    values[kFieldHttpRealm] = NULL;
+    values[kFieldUsername] = username;
+    values[kFieldUsernameField] = "username";
+    values[kFieldPasswordField] = "password";
+
+    GnomeKeyringAttributeList *attributes =
+      gnome_keyring_attribute_list_new();
+    for (PRUint32 field = 0; field < kFieldCount; field++) {
+      if (values[field])
+        gnome_keyring_attribute_list_append_string(
+          attributes, kLoginAttributes[field].name, values[field]);
+    }
+    appendFingerprint(attributes);
+    gnome_keyring_attribute_list_append_string(attributes,
+                                               kLoginInfoMagicAttrName,
+                                               loginInfoMagic.get());
+
+    guint32 itemId;
+    aBackend->CreateItem(keyringName.get(), GNOME_KEYRING_ITEM_GENERIC_SECRET,
+                         hostname, attributes, password, &itemId);
+    gnome_keyring_attribute_list_free(attributes);
+  }
+}
+
+// Name of the file holding the profile id, in the profile directory
+static const char kProfileIdFileName[] = "gnome-keyring-profile-id";
+
+/* The id new items of this profile are tagged with. It is kept in the
+ * file aPath of the profile rather than in the prefs, so that resetting
+ * them doesn't orphan the stored logins. Profiles that had it in the
+ * profileId pref, given as aPrefId, move it there; otherwise a new one is
+ * generated. The file is only written on the first run. This runs on the
+ * keyring thread, so the uuid comes from GRand rather than an XPCOM
+ * service. */
+static nsresult
+getProfileId(const nsCString &aPath, const nsCString &aPrefId,
+             nsCString &aId)
+{
+  NS_ENSURE_TRUE(!aPath.IsEmpty(), NS_ERROR_NOT_AVAILABLE);
+
+  gchar *contents;
+  if (g_file_get_contents(aPath.get(), &contents, NULL, NULL)) {
+    aId = g_strstrip(contents);
+    g_free(contents);
+    if (!aId.IsEmpty())
+      return NS_OK;
+  }
+
+  aId = aPrefId;
+  if (aId.IsEmpty()) {
+    // A version 4 uuid, seeded from /dev/urandom
+    GRand *rand = g_rand_new();
+    guint32 a = g_rand_int(rand), b = g_rand_int(rand),
+            c = g_rand_int(rand), d = g_rand_int(rand);
+    g_rand_free(rand);
+
+    gchar *uuid = g_strdup_printf("%08x-%04x-4%03x-%04x-%04x%08x",
+                                  a, b >> 16, b & 0xfff,
+                                  ((c >> 16) & 0x3fff) | 0x8000,
+                                  c & 0xffff, d);
+    aId = uuid;
+    g_free(uuid);
+  }
+
+  // An id that doesn't survive the session would orphan what it tags
+  if (!g_file_set_contents(aPath.get(), aId.get(), aId.Length(), NULL))
+    return NS_ERROR_FAILURE;
+  return NS_OK;
+}
+
+/* Set up the magics of this profile the first time the keyring thread
+ * needs them, so that Init doesn't touch the profile id file. The
+ * snapshot depends on them, so it is set up here too. */
+void
+GnomeKeyring::ensureProfileId()
+{
+  if (mProfileIdLoaded)
+    return;
+  mProfileIdLoaded = PR_TRUE;
+
+  nsCString profileId;
+  if (NS_FAILED(getProfileId(mProfileIdPath, mPrefProfileId, profileId))) {
+    NS_WARNING("Can't set up a profile id, sharing the legacy one");
+    profileId.AssignLiteral(LEGACY_PROFILE_ID);
+  }
+  GK_LOG(("Profile id %s\n", profileId.get()));
+  if (profileId.EqualsLiteral(LEGACY_PROFILE_ID))
+    legacyClaimed = PR_TRUE;
+  loginInfoMagic.AssignLiteral("loginInfoMagic");
+  loginInfoMagic.Append(profileId);
+  disabledHostMagic.AssignLiteral("disabledHostMagic");
+  disabledHostMagic.Append(profileId);
+
+  mSnapshot.Init(mSnapshotPath, snapshotScope(), &mIndex, &mDisabledHosts,
+                 computeKeyringStamp);
+}
+
+// Give aLogin the magic of this profile before it is written
+void
+GnomeKeyring::tagLogin(LoginData *aLogin)
+{
+  ensureProfileId();
+  gnome_keyring_attribute_list_append_string(aLogin->attributes,
+                                             kLoginInfoMagicAttrName,
+                                             loginInfoMagic.get());
+}
+
+NS_IMETHODIMP GnomeKeyring::Init()
 {
   nsresult ret;
   nsCOMPtr<nsIServiceManager> servMan;
@@ -514,9 +2968,6 @@ NS_IMETHODIMP GnomeKeyring::Init()
                            getter_AddRefs(prefService));
   if (ret != NS_OK) { return ret; }
 
-  ret = prefService->ReadUserPrefs(nsnull);
-  if (ret != NS_OK) { return ret; }
-
   ret = prefService->
     GetBranch("extensions.gnome-keyring.", getter_AddRefs(pref));
   if (ret != NS_OK) { return ret; }
@@ -525,21 +2976,110 @@ NS_IMETHODIMP GnomeKeyring::Init()
   ret = pref->GetPrefType("keyringName", &prefType);
   if (ret != NS_OK) { return ret; }
 
-  if (prefType == 32) {
+  if (prefType == nsIPrefBranch::PREF_STRING) {
     char* tempKeyringName;
     pref->GetCharPref("keyringName", &tempKeyringName);
     keyringName = tempKeyringName;
+    nsMemory::Free(tempKeyringName);
     if ( keyringName.IsVoid() ) keyringName.AssignLiteral("mozilla");
   }
 
-/* Create the password keyring, it doesn't hurt if it already exists */
-  GnomeKeyringResult result = gnome_keyring_create_sync(keyringName.get(), NULL);
-  if ((result != GNOME_KEYRING_RESULT_OK) &&
-     (result != GNOME_KEYRING_RESULT_ALREADY_EXISTS)) {
-    ret = NS_ERROR_FAILURE;
-    NS_ERROR("Can't open or create password keyring!");
+  ret = pref->GetPrefType("asyncWindow", &prefType);
+  if (ret != NS_OK) { return ret; }
+
+  if (prefType == nsIPrefBranch::PREF_INT)
+    pref->GetIntPref("asyncWindow", &asyncWindow);
+
+  ret = pref->GetPrefType("recreateKeyringOnClear", &prefType);
+  if (ret != NS_OK) { return ret; }
+
+  if (prefType == nsIPrefBranch::PREF_BOOL)
+    pref->GetBoolPref("recreateKeyringOnClear", &recreateKeyringOnClear);
+
+  ret = pref->GetPrefType("searchAllKeyrings", &prefType);
+  if (ret != NS_OK) { return ret; }
+
+  if (prefType == nsIPrefBranch::PREF_BOOL)
+    pref->GetBoolPref("searchAllKeyrings", &searchAllKeyrings);
+
+  ret = pref->GetPrefType("backend", &prefType);
+  if (ret != NS_OK) { return ret; }
+
+  PRBool useFake = PR_FALSE;
+  if (prefType == nsIPrefBranch::PREF_STRING) {
+    char *backend;
+    pref->GetCharPref("backend", &backend);
+    useSecretService = !strcmp(backend, "secret-service");
+    useFake = !strcmp(backend, "fake");
+    nsMemory::Free(backend);
+  }
+  GK_LOG(("Backend: %s\n", useFake ? "fake" :
+          useSecretService ? "secret-service" : "libgnome-keyring"));
+
+  // The id itself is read on the keyring thread, see ensureProfileId
+  nsCOMPtr<nsIFile> profileDir;
+  if (NS_SUCCEEDED(NS_GetSpecialDirectory(NS_APP_USER_PROFILE_50_DIR,
+                                          getter_AddRefs(profileDir))) &&
+      NS_SUCCEEDED(profileDir->AppendNative(
+                     nsDependentCString(kProfileIdFileName))))
+    profileDir->GetNativePath(mProfileIdPath);
+
+  ret = pref->GetPrefType("profileId", &prefType);
+  if (ret != NS_OK) { return ret; }
+
+  if (prefType == nsIPrefBranch::PREF_STRING) {
+    char *id;
+    if (NS_SUCCEEDED(pref->GetCharPref("profileId", &id))) {
+      mPrefProfileId = id;
+      nsMemory::Free(id);
+    }
   }
-  return ret;
+  pref->GetBoolPref("legacyItemsClaimed", &legacyClaimed);
+
+  ret = pref->GetPrefType("metadataSnapshot", &prefType);
+  if (ret != NS_OK) { return ret; }
+
+  // The fake store doesn't outlive the process, neither should its index
+  PRBool useSnapshot = !useFake;
+  if (prefType == nsIPrefBranch::PREF_BOOL)
+    pref->GetBoolPref("metadataSnapshot", &useSnapshot);
+
+  nsCOMPtr<nsIFile> snapshotFile;
+  if (useSnapshot &&
+      NS_SUCCEEDED(NS_GetSpecialDirectory(NS_APP_USER_PROFILE_50_DIR,
+                                          getter_AddRefs(snapshotFile))) &&
+      NS_SUCCEEDED(snapshotFile->AppendNative(
+                     nsDependentCString(kSnapshotFileName))))
+    snapshotFile->GetNativePath(mSnapshotPath);
+  mIndex.SetSnapshot(&mSnapshot);
+  mDisabledHosts.SetSnapshot(&mSnapshot);
+
+  if (useFake) {
+    // Its logins are those of this profile
+    ensureProfileId();
+
+    PRInt32 seed = 1, latency = 0, jitter = 0, logins = 0;
+    pref->GetIntPref("fakeSeed", &seed);
+    pref->GetIntPref("fakeLatency", &latency);
+    pref->GetIntPref("fakeJitter", &jitter);
+    pref->GetIntPref("fakeLogins", &logins);
+
+    FakeKeyringBackend *fake = new FakeKeyringBackend(seed);
+    // Filled before the latency is set, so that it is instantaneous
+    populateFakeBackend(fake, PR_MAX(logins, 0));
+    fake->SetLatency(PR_MAX(latency, 0), PR_MAX(jitter, 0));
+    KeyringBackend::Use(fake);
+  }
+
+  // Without a session bus the caches only see our own changes
+  if (!useFake)
+    mWatcher.Start(onKeyringChange, this);
+
+  // The keyring is only created before the first write, see ensureKeyring
+  nsresult rv = KeyringThread::Start();
+  NS_ENSURE_SUCCESS(rv, rv);
+  mThreadStarted = PR_TRUE;
+  return NS_OK;
 }
 
 NS_IMETHODIMP GnomeKeyring::InitWithFile(nsIFile *aInputFile,
@@ -550,54 +3090,73 @@ NS_IMETHODIMP GnomeKeyring::InitWithFile(nsIFile *aInputFile,
 
 NS_IMETHODIMP GnomeKeyring::AddLogin(nsILoginInfo *aLogin)
 {
-  GnomeKeyringAttributeList *attributes = buildAttributeList(aLogin);
+  MethodTimer timer(KeyringStats::kAddLogin);
+  LoginData login;
+  nsresult rv = login.Set(buildAttributeList(aLogin), aLogin);
+  NS_ENSURE_SUCCESS(rv, rv);
 
-  nsAutoString password, hostname;
-  aLogin->GetPassword(password);
-  aLogin->GetHostname(hostname);
-  guint itemId;
+  return callOnKeyringThread(this, &GnomeKeyring::doAddLogin, &login);
+}
 
-  GnomeKeyringResult result = gnome_keyring_item_create_sync(keyringName.get(),
-                                        GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                                        NS_ConvertUTF16toUTF8(hostname).get(),
-                                        attributes,
-                                        NS_ConvertUTF16toUTF8(password).get(),
-                                        TRUE,
-                                        &itemId);
-  gnome_keyring_attribute_list_free(attributes);
-  GK_ENSURE_SUCCESS(result);
+NS_IMETHODIMP GnomeKeyring::AddLogins(PRUint32 count,
+                                      nsILoginInfo **logins,
+                                      PRUint32 *resultCount,
+                                      PRUint32 **results)
+{
+  MethodTimer timer(KeyringStats::kAddLogins);
+  PRUint32 *array = static_cast<PRUint32*>(
+                      nsMemory::Alloc(count * sizeof(PRUint32)));
+  NS_ENSURE_TRUE(array, NS_ERROR_OUT_OF_MEMORY);
+
+  LoginData *data = new LoginData[count];
+  nsresult rv = NS_OK;
+  for (PRUint32 i = 0; i < count && NS_SUCCEEDED(rv); i++)
+    rv = data[i].Set(buildAttributeList(logins[i]), logins[i]);
 
+  if (NS_SUCCEEDED(rv))
+    rv = callOnKeyringThread(this, &GnomeKeyring::doAddLogins,
+                             count, data, array);
+  delete[] data;
+
+  if (NS_FAILED(rv)) {
+    nsMemory::Free(array);
+    return rv;
+  }
+
+  *resultCount = count;
+  *results = array;
   return NS_OK;
 }
 
 NS_IMETHODIMP GnomeKeyring::RemoveLogin(nsILoginInfo *aLogin)
 {
-  GnomeKeyringAttributeList *attributes = buildAttributeList(aLogin);
-  AutoFoundList foundList;
-
-  GnomeKeyringResult result = gnome_keyring_find_items_sync(
-                                GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                                attributes, &foundList);
-  gnome_keyring_attribute_list_free(attributes);
-
-  if (result != GNOME_KEYRING_RESULT_OK)
-    return NS_ERROR_FAILURE;
+  MethodTimer timer(KeyringStats::kRemoveLogin);
+  LoginData login;
+  login.SetAttributes(buildAttributeList(aLogin));
 
-  return deleteFoundItems(foundList, PR_TRUE);
+  return callOnKeyringThread(this, &GnomeKeyring::doRemoveLogin, &login);
 }
 
 NS_IMETHODIMP GnomeKeyring::ModifyLogin(nsILoginInfo *oldLogin,
                                         nsISupports *modLogin)
 {
-  /* If the second argument is an nsILoginInfo,
-   * just remove the old login and add the new one */
+  MethodTimer timer(KeyringStats::kModifyLogin);
+  // Only its attributes are needed to find the item
+  LoginData old;
+  old.SetAttributes(buildAttributeList(oldLogin));
+
+  /* If the second argument is an nsILoginInfo, its item takes all the
+   * values of the new one */
 
   nsresult interfaceok;
   nsCOMPtr<nsILoginInfo> newLogin( do_QueryInterface(modLogin, &interfaceok) );
   if (interfaceok == NS_OK) {
-    nsresult rv = RemoveLogin(oldLogin);
-    rv |= AddLogin(newLogin);
-  return rv;
+    LoginData login;
+    nsresult rv = login.Set(buildAttributeList(newLogin), newLogin);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    return callOnKeyringThread(this, &GnomeKeyring::doModifyLogin,
+                               &old, &login);
   } /* Otherwise, it has to be an nsIPropertyBag.
      * Let's get the attributes from the old login, then append the ones
      * fetched from the property bag. Gracefully, if an attribute appears
@@ -606,40 +3165,25 @@ NS_IMETHODIMP GnomeKeyring::ModifyLogin(nsILoginInfo *oldLogin,
     nsCOMPtr<nsIPropertyBag> matchData( do_QueryInterface(modLogin, &interfaceok) );
     if (interfaceok == NS_OK) {
       GnomeKeyringAttributeList *attributes = buildAttributeList(oldLogin);
-      AutoFoundList foundList;
-
-      GnomeKeyringResult result = gnome_keyring_find_items_sync(
-                                  GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                                  attributes, &foundList);
-
-      if (result != GNOME_KEYRING_RESULT_OK) {
-          return NS_ERROR_FAILURE;
-      }
-
-      if (foundList == NULL) {
-        return NS_ERROR_FAILURE;
-      }
-
       appendAttributesFromBag(static_cast<nsIPropertyBag*>(matchData), attributes);
 
-      // We need the id of the keyring item to set its attributes.
-
-      PRUint32 i = 0, id;
-      for (GList* l = foundList; l != NULL; l = l->next, i++)
-      {
-        GnomeKeyringFound* found = static_cast<GnomeKeyringFound*>(l->data);
-        id = found->item_id;
-        if (i >= 1){
-          return NS_ERROR_FAILURE;
-        }
+      LoginData login;
+      login.SetAttributes(refreshFingerprint(attributes));
+
+      // The password isn't an attribute, but the bag may change it too
+      nsAutoString s;
+      nsCOMPtr<nsIVariant> password;
+      s.AssignLiteral(kPasswordAttr);
+      if (NS_SUCCEEDED(matchData->GetProperty(s, getter_AddRefs(password))) &&
+          password) {
+        password->GetAsAString(s);
+        nsresult rv = login.SetPassword(s);
+        SecretArena::Wipe(s);
+        NS_ENSURE_SUCCESS(rv, rv);
       }
-      result = gnome_keyring_item_set_attributes_sync(keyringName.get(),
-                                                      id,
-                                                      attributes);
-      gnome_keyring_attribute_list_free(attributes);
-      if (result != GNOME_KEYRING_RESULT_OK) {
-        return NS_ERROR_FAILURE; }
-      return NS_OK;
+
+      return callOnKeyringThread(this, &GnomeKeyring::doModifyLogin,
+                                 &old, &login);
     } else return interfaceok;
   }
 }
@@ -647,36 +3191,21 @@ NS_IMETHODIMP GnomeKeyring::ModifyLogin(nsILoginInfo *oldLogin,
 
 NS_IMETHODIMP GnomeKeyring::RemoveAllLogins()
 {
-  AutoFoundList foundList;
-
-  GnomeKeyringResult result = gnome_keyring_find_itemsv_sync(
-                GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                &foundList,
-                kLoginInfoMagicAttrName, GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-                kLoginInfoMagicAttrValue,
-                NULL);
-
-  GK_ENSURE_SUCCESS_BUGGY(result);
-
-  return deleteFoundItems(foundList);
+  MethodTimer timer(KeyringStats::kRemoveAllLogins);
+  return callOnKeyringThread(this, &GnomeKeyring::doRemoveAllLogins);
 }
 
 NS_IMETHODIMP GnomeKeyring::GetAllLogins(PRUint32 *aCount,
                                          nsILoginInfo ***aLogins)
 {
-  AutoFoundList foundList;
-
-  GnomeKeyringResult result = gnome_keyring_find_itemsv_sync(
-                                GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                                &foundList,
-                                kLoginInfoMagicAttrName,
-                                GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-                                kLoginInfoMagicAttrValue,
-                                NULL);
+  MethodTimer timer(KeyringStats::kGetAllLogins);
+  FindResult result;
 
-  GK_ENSURE_SUCCESS_BUGGY(result);
+  nsresult rv = callOnKeyringThread(this, &GnomeKeyring::doGetAllLogins,
+                                    &result);
+  NS_ENSURE_SUCCESS(rv, rv);
 
-  return foundListToArray(foundToLoginInfo, foundList, aCount, aLogins);
+  return result.Take(aCount, aLogins);
 }
 
 NS_IMETHODIMP GnomeKeyring::FindLogins(PRUint32 *count,
@@ -685,36 +3214,32 @@ NS_IMETHODIMP GnomeKeyring::FindLogins(PRUint32 *count,
                                        const nsAString & aHttpRealm,
                                        nsILoginInfo ***logins)
 {
+  MethodTimer timer(KeyringStats::kFindLogins);
+  LoginQuery query(aHostname, aActionURL, aHttpRealm);
+  FindResult result;
 
-  GList* allFound = NULL;
-
-  GnomeKeyringResult result = findLogins(aHostname,
-                                         aActionURL,
-                                         aHttpRealm,
-                                         convertAndCollectLogins,
-                                         &allFound);
-
-  GK_ENSURE_SUCCESS_BUGGY(result);
+  nsresult rv = callOnKeyringThread(this, &GnomeKeyring::doFindLogins,
+                                    &query, &result);
+  NS_ENSURE_SUCCESS(rv, rv);
 
-  return foundListToArray(loginToLogin, allFound, count, logins);
+  return result.Take(count, logins);
 }
 
 NS_IMETHODIMP GnomeKeyring::SearchLogins(PRUint32 *count,
                                          nsIPropertyBag *matchData,
                                          nsILoginInfo ***logins)
 {
-  AutoFoundList foundList;
+  MethodTimer timer(KeyringStats::kSearchLogins);
+  FindResult result;
   GnomeKeyringAttributeList *attributes = gnome_keyring_attribute_list_new();
   appendAttributesFromBag(matchData, attributes);
 
-  GnomeKeyringResult result = gnome_keyring_find_items_sync(
-                                        GNOME_KEYRING_ITEM_GENERIC_SECRET,
-                                        attributes,
-                                        &foundList );
-  GK_ENSURE_SUCCESS_BUGGY(result);
+  nsresult rv = callOnKeyringThread(this, &GnomeKeyring::doSearchLogins,
+                                    attributes, &result);
   gnome_keyring_attribute_list_free(attributes);
-  return foundListToArray(foundToLoginInfo, foundList, count, logins);
+  NS_ENSURE_SUCCESS(rv, rv);
 
+  return result.Take(count, logins);
 }
 NS_IMETHODIMP GnomeKeyring::GetAllEncryptedLogins(unsigned int*,
                                                   nsILoginInfo***)
@@ -724,105 +3249,124 @@ NS_IMETHODIMP GnomeKeyring::GetAllEncryptedLogins(unsigned int*,
 NS_IMETHODIMP GnomeKeyring::GetAllDisabledHosts(PRUint32 *aCount,
                                                 PRUnichar ***aHostnames)
 {
-  AutoFoundList foundList;
+  MethodTimer timer(KeyringStats::kGetAllDisabledHosts);
+  GPtrArray *hosts = g_ptr_array_new();
+
+  nsresult rv = callOnKeyringThread(this,
+                                    &GnomeKeyring::doGetAllDisabledHosts,
+                                    hosts);
+  if (NS_FAILED(rv)) {
+    g_ptr_array_free(hosts, TRUE);
+    return rv;
+  }
 
-  GnomeKeyringResult result = gnome_keyring_find_itemsv_sync(
-          GNOME_KEYRING_ITEM_NOTE,
-          &foundList,
-          kDisabledHostMagicAttrName, GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-          kDisabledHostMagicAttrValue,
-          NULL);
+  PRUnichar **array = static_cast<PRUnichar**>(
+                        nsMemory::Alloc(hosts->len * sizeof(PRUnichar*)));
+  if (!array) {
+    g_ptr_array_foreach(hosts, (GFunc) g_free, NULL);
+    g_ptr_array_free(hosts, TRUE);
+    return NS_ERROR_OUT_OF_MEMORY;
+  }
 
-  GK_ENSURE_SUCCESS_BUGGY(result);
+  for (guint i = 0; i < hosts->len; i++) {
+    char *host = static_cast<char*>(g_ptr_array_index(hosts, i));
+    array[i] = NS_StringCloneData(NS_ConvertUTF8toUTF16(host));
+    g_free(host);
+  }
 
-  return foundListToArray(foundToHost, foundList, aCount, aHostnames);
+  *aCount = hosts->len;
+  *aHostnames = array;
+  g_ptr_array_free(hosts, TRUE);
+  return NS_OK;
 }
 
 NS_IMETHODIMP GnomeKeyring::GetLoginSavingEnabled(const nsAString & aHost,
                                                   PRBool *_retval)
 {
-  AutoFoundList foundList;
-
-  GnomeKeyringResult result = gnome_keyring_find_itemsv_sync(
-          GNOME_KEYRING_ITEM_NOTE,
-          &foundList,
-          kDisabledHostMagicAttrName, GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-          kDisabledHostMagicAttrValue,
-          kDisabledHostAttrName, GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-          NS_ConvertUTF16toUTF8(aHost).get(),
-          NULL);
-
-  GK_ENSURE_SUCCESS_BUGGY(result);
-
-  *_retval = foundList == NULL;
-  return NS_OK;
+  MethodTimer timer(KeyringStats::kGetLoginSavingEnabled);
+  return callOnKeyringThread(this, &GnomeKeyring::doGetLoginSavingEnabled,
+                             NS_ConvertUTF16toUTF8(aHost).get(), _retval);
 }
 
 NS_IMETHODIMP GnomeKeyring::SetLoginSavingEnabled(const nsAString & aHost,
                                                   PRBool isEnabled)
 {
-  GnomeKeyringResult result;
-
-  if (isEnabled) {
-    AutoFoundList foundList;
-
-    result = gnome_keyring_find_itemsv_sync(
-              GNOME_KEYRING_ITEM_NOTE,
-              &foundList,
-              kDisabledHostMagicAttrName, GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-              kDisabledHostMagicAttrValue,
-              kDisabledHostAttrName, GNOME_KEYRING_ATTRIBUTE_TYPE_STRING,
-              NS_ConvertUTF16toUTF8(aHost).get(),
-              NULL);
+  MethodTimer timer(KeyringStats::kSetLoginSavingEnabled);
+  return callOnKeyringThread(this, &GnomeKeyring::doSetLoginSavingEnabled,
+                             NS_ConvertUTF16toUTF8(aHost).get(), isEnabled);
+}
 
-    GK_ENSURE_SUCCESS_BUGGY(result);
-    return deleteFoundItems(foundList, PR_TRUE);
-  }
+NS_IMETHODIMP GnomeKeyring::CountLogins(const nsAString & aHostname,
+                                        const nsAString & aActionURL,
+                                        const nsAString & aHttpRealm,
+                                        PRUint32 *_retval)
+{
+  MethodTimer timer(KeyringStats::kCountLogins);
+  LoginQuery query(aHostname, aActionURL, aHttpRealm);
 
-  // TODO should check if host is already enabled
+  return callOnKeyringThread(this, &GnomeKeyring::doCountLogins,
+                             &query, _retval);
+}
 
-  GnomeKeyringAttributeList *attributes;
+NS_IMETHODIMP GnomeKeyring::EnumerateLogins(nsISimpleEnumerator **aResult)
+{
+  NS_ADDREF(*aResult = new LoginEnumerator());
+  return NS_OK;
+}
 
-  attributes = gnome_keyring_attribute_list_new();
-  gnome_keyring_attribute_list_append_string(attributes,
-            kDisabledHostMagicAttrName, kDisabledHostMagicAttrValue);
-  gnome_keyring_attribute_list_append_string(attributes,
-            kDisabledHostAttrName, NS_ConvertUTF16toUTF8(aHost).get());
+NS_IMETHODIMP GnomeKeyring::FindLoginsAsync(const nsAString & aHostname,
+                                            const nsAString & aActionURL,
+                                            const nsAString & aHttpRealm,
+                                            nsIGnomeKeyringLoginsCallback *aCallback)
+{
+  NS_ENSURE_ARG_POINTER(aCallback);
 
-  // TODO name should be more explicit
-  const char* name = "Mozilla disabled host entry";
-  guint itemId;
+  return KeyringThread::RunAsync(new FindLoginsTask(this, aHostname,
+                                                    aActionURL, aHttpRealm,
+                                                    aCallback));
+}
 
-  result = gnome_keyring_item_create_sync(keyringName.get(),
-            GNOME_KEYRING_ITEM_NOTE,
-            name,
-            attributes,
-            "", // no secret
-            TRUE,
-            &itemId);
-  gnome_keyring_attribute_list_free (attributes);
+NS_IMETHODIMP GnomeKeyring::CountLoginsAsync(const nsAString & aHostname,
+                                             const nsAString & aActionURL,
+                                             const nsAString & aHttpRealm,
+                                             nsIGnomeKeyringResultCallback *aCallback)
+{
+  NS_ENSURE_ARG_POINTER(aCallback);
 
-  GK_ENSURE_SUCCESS(result);
-  return NS_OK;
+  return KeyringThread::RunAsync(new CountLoginsTask(this, aHostname,
+                                                     aActionURL, aHttpRealm,
+                                                     aCallback));
 }
 
-NS_IMETHODIMP GnomeKeyring::CountLogins(const nsAString & aHostname,
-                                        const nsAString & aActionURL,
-                                        const nsAString & aHttpRealm,
-                                        PRUint32 *_retval)
+NS_IMETHODIMP GnomeKeyring::AddLoginAsync(nsILoginInfo *aLogin,
+                                          nsIGnomeKeyringResultCallback *aCallback)
 {
-  GnomeKeyringResult result;
-  int count=0;
+  return KeyringThread::RunAsync(new WriteLoginTask(this,
+                                                    &GnomeKeyring::doAddLogin,
+                                                    KeyringStats::kAddLogin,
+                                                    aLogin, PR_TRUE,
+                                                    aCallback));
+}
 
-  result = findLogins(aHostname,
-                      aActionURL,
-                      aHttpRealm,
-                      countFoundLogins,
-                      &count);
+NS_IMETHODIMP GnomeKeyring::RemoveLoginAsync(nsILoginInfo *aLogin,
+                                             nsIGnomeKeyringResultCallback *aCallback)
+{
+  return KeyringThread::RunAsync(new WriteLoginTask(this,
+                                                    &GnomeKeyring::doRemoveLogin,
+                                                    KeyringStats::kRemoveLogin,
+                                                    aLogin, PR_FALSE,
+                                                    aCallback));
+}
 
-  GK_ENSURE_SUCCESS_BUGGY(result);
+NS_IMETHODIMP GnomeKeyring::GetStats(nsACString &aStats)
+{
+  KeyringStats::ToJSON(aStats);
+  return NS_OK;
+}
 
-  *_retval = count;
+NS_IMETHODIMP GnomeKeyring::ResetStats()
+{
+  KeyringStats::Reset();
   return NS_OK;
 }
 
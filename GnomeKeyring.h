@@ -34,7 +34,14 @@
  *
  * ***** END LICENSE BLOCK ***** */
 
+#ifndef GnomeKeyring_h__
+#define GnomeKeyring_h__
+
 #include "nsILoginManagerStorage.h"
+#include "nsIGnomeKeyring.h"
+#include "MetadataSnapshot.h"
+#include "KeyringWatcher.h"
+#include "SecretService.h"
 extern "C" {
 #include "gnome-keyring.h"
 }
@@ -52,16 +59,236 @@ extern PRLogModuleInfo *gGnomeKeyringLog;
 #define GK_LOG(args) PR_LOG(gGnomeKeyringLog, PR_LOG_DEBUG, args)
 #define GK_LOG_ENABLED() PR_LOG_TEST(gGnomeKeyringLog, PR_LOG_DEBUG)
 
-class GnomeKeyring : public nsILoginManagerStorage
+// Helpers shared with the other classes of the component
+const char *findAttribute(GnomeKeyringAttributeList *attributes,
+                          const char *aName);
+// Whether the item with these attributes holds one of our logins
+PRBool isLoginItem(GnomeKeyringAttributeList *attributes);
+// Whether logins are looked up in aKeyring, see searchAllKeyrings
+PRBool inSearchScope(const char *aKeyring);
+
+// Length of the hex digest identifying a login, see computeFingerprint
+#define GK_FINGERPRINT_LENGTH 16
+
+/* Non-secret description of a keyring item holding a login. formSubmitURL
+ * and httpRealm are NULL when the item doesn't carry the attribute. */
+struct LoginMetadata
+{
+  LoginMetadata(const char *aKeyring, guint aItemId,
+                GnomeKeyringAttributeList *aAttributes);
+  // aValues holds the attributes in the order of the fields below
+  LoginMetadata(const char *aKeyring, guint aItemId,
+                const char *const *aValues, PRBool aTagged);
+  LoginMetadata(const LoginMetadata &aOther);
+  ~LoginMetadata();
+
+  char *keyring;
+  guint itemId;
+  char *hostname;
+  char *formSubmitURL;
+  char *httpRealm;
+  char *username;
+  char *usernameField;
+  char *passwordField;
+  char fingerprint[GK_FINGERPRINT_LENGTH + 1];
+  // Whether the item carries the fingerprint attribute
+  PRBool tagged;
+
+private:
+  void setValues(const char *aKeyring, const char *const *aValues);
+};
+
+/* In-process index of the stored logins, keyed by hostname. It is filled
+ * once from the keyring and then kept up to date by the storage methods,
+ * so that lookups only needing metadata don't talk to the daemon. */
+class LoginIndex
+{
+public:
+  LoginIndex();
+  ~LoginIndex();
+
+  PRBool IsLoaded() { return mLoaded; }
+  void SetLoaded() { mLoaded = PR_TRUE; }
+  // Drop everything; the index will be rebuilt on next use
+  void Invalidate();
+
+  // Once loaded, changes are recorded in aSnapshot
+  void SetSnapshot(MetadataSnapshot *aSnapshot) { mSnapshot = aSnapshot; }
+
+  void Add(LoginMetadata *aEntry);
+  void Remove(const char *aHostname, const char *aKeyring, guint aItemId);
+  // Remove the entry of an item, whether it was indexed
+  PRBool RemoveItem(const char *aKeyring, guint aItemId);
+  PRUint32 Count() { return mCount; }
+  PRUint32 CountMatches(const char *aHostname,
+                        const char *aActionURL,
+                        const char *aHttpRealm);
+  // Build logins for the matching entries, in an nsMemory array
+  nsresult BuildMatches(const char *aHostname,
+                        const char *aActionURL,
+                        const char *aHttpRealm,
+                        PRUint32 *aCount,
+                        nsILoginInfo ***aLogins);
+  nsresult BuildAll(PRUint32 *aCount, nsILoginInfo ***aLogins);
+  // Build logins for the entries matching a search attribute list
+  nsresult BuildSearch(GnomeKeyringAttributeList *aQuery,
+                       PRUint32 *aCount,
+                       nsILoginInfo ***aLogins);
+  // An entry with this fingerprint, NULL if there is none
+  LoginMetadata *FindExact(const char *aFingerprint);
+  /* Append copies of the entries whose item lacks the fingerprint, or of
+   * all of them with aAll */
+  void CollectUntagged(GPtrArray *aResult, PRBool aAll);
+  typedef void (*EntryFunc)(LoginMetadata *aEntry, void *aData);
+  void ForEach(EntryFunc aFunc, void *aData);
+
+private:
+  // Entries of aHostname, NULL when it has none
+  GPtrArray *lookupHost(const char *aHostname);
+
+  // hostname -> GPtrArray of LoginMetadata*
+  GHashTable *mByHost;
+  // fingerprint -> LoginMetadata*, the key belongs to the entry
+  GHashTable *mByFingerprint;
+  // "<item id>/<keyring>" -> LoginMetadata*, see itemKey
+  GHashTable *mByItem;
+  PRUint32 mCount;
+  MetadataSnapshot *mSnapshot;
+  PRBool mLoaded;
+};
+
+/* Hosts for which login saving is disabled. Once read from the keyring it
+ * is kept up to date by SetLoginSavingEnabled, so that the check done on
+ * each form submission doesn't reach the daemon. */
+class DisabledHostSet
+{
+public:
+  DisabledHostSet();
+  ~DisabledHostSet();
+
+  PRBool IsLoaded() { return mLoaded; }
+  void SetLoaded() { mLoaded = PR_TRUE; }
+  void Invalidate();
+  // Once loaded, changes are recorded in aSnapshot
+  void SetSnapshot(MetadataSnapshot *aSnapshot) { mSnapshot = aSnapshot; }
+
+  PRBool Contains(const char *aHost);
+  void Add(const char *aHost);
+  void Remove(const char *aHost);
+  PRUint32 Count();
+  // Append copies of the hosts, to be freed with g_free
+  void CollectAll(GPtrArray *aResult);
+
+private:
+  // host -> host, the key is owned by the table
+  GHashTable *mHosts;
+  MetadataSnapshot *mSnapshot;
+  PRBool mLoaded;
+};
+
+struct LoginData;
+struct LoginQuery;
+struct FindResult;
+
+/* The nsILoginManagerStorage methods only convert their arguments and
+ * results between XPCOM objects and plain data. The keyring traffic and
+ * the index live on the keyring thread (see KeyringThread.h), in the do*
+ * methods.
+ */
+class GnomeKeyring : public nsILoginManagerStorage,
+                     public nsIGnomeKeyring
 {
   private:
+  friend class FindLoginsTask;
+  friend class CountLoginsTask;
+  friend class WriteLoginTask;
+  friend class FingerprintMigrationTask;
+  friend class ItemChangeTask;
+
+  LoginIndex mIndex;
+  // Whether keyringName is known to exist, see ensureKeyring
+  PRBool mKeyringCreated;
+  DisabledHostSet mDisabledHosts;
+  PRBool mMigrationStarted;
+  // Whether Init got a hold on the shared keyring thread
+  PRBool mThreadStarted;
+  MetadataSnapshot mSnapshot;
+  // Whether ensureIndex already went through mSnapshot
+  PRBool mSnapshotTried;
+  KeyringWatcher mWatcher;
+  ExpectedSignals mOwnWrites;
+  // Only used with the secret-service backend, see useSecretService
+  SecretService mSecretService;
+  PRBool mSecretServiceFailed;
+  // Set up by Init, read on the keyring thread by ensureProfileId
+  nsCString mProfileIdPath;
+  nsCString mPrefProfileId;
+  nsCString mSnapshotPath;
+  PRBool mProfileIdLoaded;
+
+  ~GnomeKeyring();
+
+  nsresult loadKeyringMetadata(const char *aKeyring);
+  void ensureProfileId();
+  void tagLogin(LoginData *aLogin);
+  nsresult ensureKeyring();
+  nsresult ensureIndex();
+  nsresult loadSnapshot();
+  nsresult ensureDisabledHosts();
   GnomeKeyringAttributeList *buildAttributeList(nsILoginInfo *aLogin);
   void appendAttributesFromBag(nsIPropertyBag *matchData,
                                     GnomeKeyringAttributeList * &attributes);
   nsresult deleteFoundItems(GList* foundList,
                                  PRBool);
-  
+  nsresult findExactLogin(LoginData *aLogin, nsCString &aKeyring,
+                          guint *aItemId);
+  void startFingerprintMigration();
+  nsresult ensureSecretService();
+  nsresult searchLogin(const char **aValues,
+                       GnomeKeyringAttributeList *aQuery,
+                       nsCString &aKeyring, guint *aItemId);
+  nsresult scanForLogin(const char **aValues, nsCString &aKeyring,
+                        guint *aItemId);
+  void prefetchPasswords(FindResult *aResult);
+  static void onKeyringChange(KeyringWatcher::Change aChange,
+                              const char *aKeyring, guint aItemId,
+                              void *aData);
+
+  // Run on the keyring thread
+  nsresult doAddLogin(LoginData *aLogin);
+  nsresult doAddLogins(PRUint32 aCount, LoginData *aLogins,
+                       PRUint32 *aResults);
+  nsresult doRemoveLogin(LoginData *aLogin);
+  nsresult doModifyLogin(LoginData *aOldLogin, LoginData *aNewLogin);
+  nsresult doRemoveAllLogins();
+  nsresult doGetAllLogins(FindResult *aResult);
+  nsresult doFindLogins(LoginQuery *aQuery, FindResult *aResult);
+  nsresult doSearchLogins(GnomeKeyringAttributeList *aAttributes,
+                          FindResult *aResult);
+  nsresult doGetAllDisabledHosts(GPtrArray *aHosts);
+  nsresult doGetLoginSavingEnabled(const char *aHost, PRBool *aEnabled);
+  nsresult doSetLoginSavingEnabled(const char *aHost, PRBool aEnabled);
+  nsresult doCountLogins(LoginQuery *aQuery, PRUint32 *aCount);
+  nsresult doMigrateFingerprints(GPtrArray *aPending, PRUint32 *aNext);
+  nsresult doClaimDisabledHosts();
+  void doApplyItemChange(KeyringWatcher::Change aChange,
+                         const char *aKeyring, guint aItemId, gint64 aTime);
+  void noteOwnWrite(const char *aKeyring, guint aItemId,
+                    KeyringWatcher::Change aChange);
+  void noteCreated(const char *aKeyring, guint aItemId);
+
 public:
+  GnomeKeyring()
+    : mKeyringCreated(PR_FALSE),
+      mMigrationStarted(PR_FALSE),
+      mThreadStarted(PR_FALSE),
+      mSnapshotTried(PR_FALSE),
+      mSecretServiceFailed(PR_FALSE),
+      mProfileIdLoaded(PR_FALSE) { }
+
   NS_DECL_ISUPPORTS
   NS_DECL_NSILOGINMANAGERSTORAGE
+  NS_DECL_NSIGNOMEKEYRING
 };
+
+#endif /* GnomeKeyring_h__ */
@@ -0,0 +1,260 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "KeyringBackend.h"
+#include "KeyringStats.h"
+
+static LibgnomeKeyringBackend sDefaultBackend;
+
+KeyringBackend *KeyringBackend::sBackend = &sDefaultBackend;
+
+void
+KeyringBackend::Use(KeyringBackend *aBackend)
+{
+  if (sBackend != &sDefaultBackend)
+    delete sBackend;
+  sBackend = aBackend;
+}
+
+struct PendingReply
+{
+  GnomeKeyringResult result;
+  guint32 value;
+  GnomeKeyringOperationDoneCallback done;
+  GnomeKeyringOperationGetIntCallback getInt;
+  gpointer data;
+};
+
+static gboolean
+deliverReply(gpointer aData)
+{
+  PendingReply *reply = static_cast<PendingReply*>(aData);
+
+  if (reply->getInt)
+    reply->getInt(reply->result, reply->value, reply->data);
+  else
+    reply->done(reply->result, reply->data);
+  delete reply;
+  return FALSE;
+}
+
+void
+KeyringBackend::Reply(GnomeKeyringResult aResult, guint32 aValue,
+                      GnomeKeyringOperationDoneCallback aDone,
+                      GnomeKeyringOperationGetIntCallback aGetInt,
+                      gpointer aData, PRUint32 aDelay)
+{
+  PendingReply *reply = new PendingReply;
+  reply->result = aResult;
+  reply->value = aValue;
+  reply->done = aDone;
+  reply->getInt = aGetInt;
+  reply->data = aData;
+
+  GSource *source = aDelay ? g_timeout_source_new((aDelay + 500) / 1000)
+                           : g_idle_source_new();
+  g_source_set_callback(source, deliverReply, reply, NULL);
+  g_source_attach(source, g_main_context_get_thread_default());
+  g_source_unref(source);
+}
+
+void
+KeyringBackend::CreateItemAsync(const char *aKeyring,
+                                GnomeKeyringItemType aType,
+                                const char *aDisplayName,
+                                GnomeKeyringAttributeList *aAttributes,
+                                const char *aSecret,
+                                GnomeKeyringOperationGetIntCallback aCallback,
+                                gpointer aData)
+{
+  guint32 id = 0;
+  GnomeKeyringResult result = CreateItem(aKeyring, aType, aDisplayName,
+                                         aAttributes, aSecret, &id);
+  Reply(result, id, NULL, aCallback, aData, 0);
+}
+
+void
+KeyringBackend::DeleteItemAsync(const char *aKeyring, guint32 aItemId,
+                                GnomeKeyringOperationDoneCallback aCallback,
+                                gpointer aData)
+{
+  Reply(DeleteItem(aKeyring, aItemId), 0, aCallback, NULL, aData, 0);
+}
+
+void
+KeyringBackend::SetAttributesAsync(const char *aKeyring, guint32 aItemId,
+                                   GnomeKeyringAttributeList *aAttributes,
+                                   GnomeKeyringOperationDoneCallback aCallback,
+                                   gpointer aData)
+{
+  Reply(SetAttributes(aKeyring, aItemId, aAttributes), 0, aCallback, NULL,
+        aData, 0);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::CreateKeyring(const char *aKeyring)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_create_sync(aKeyring, NULL);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::DeleteKeyring(const char *aKeyring)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_delete_sync(aKeyring);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::ListKeyrings(GList **aNames)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_list_keyring_names_sync(aNames);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::GetKeyringInfo(const char *aKeyring, PRBool *aLocked,
+                                       PRInt64 *aMtime)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  GnomeKeyringInfo *info;
+  GnomeKeyringResult result = gnome_keyring_get_info_sync(aKeyring, &info);
+  if (result != GNOME_KEYRING_RESULT_OK)
+    return result;
+
+  *aLocked = gnome_keyring_info_get_is_locked(info) != FALSE;
+  *aMtime = gnome_keyring_info_get_mtime(info);
+  gnome_keyring_info_free(info);
+  return GNOME_KEYRING_RESULT_OK;
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::ListItemIds(const char *aKeyring, GList **aIds)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_list_item_ids_sync(aKeyring, aIds);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::FindItems(GnomeKeyringItemType aType,
+                                  GnomeKeyringAttributeList *aAttributes,
+                                  GList **aFound)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  GnomeKeyringResult result = gnome_keyring_find_items_sync(aType,
+                                                            aAttributes,
+                                                            aFound);
+  if (result == GNOME_KEYRING_RESULT_OK)
+    KeyringStats::CountFound(*aFound);
+  return result;
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::CreateItem(const char *aKeyring,
+                                   GnomeKeyringItemType aType,
+                                   const char *aDisplayName,
+                                   GnomeKeyringAttributeList *aAttributes,
+                                   const char *aSecret,
+                                   guint32 *aItemId)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_item_create_sync(aKeyring, aType, aDisplayName,
+                                        aAttributes, aSecret, TRUE, aItemId);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::DeleteItem(const char *aKeyring, guint32 aItemId)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_item_delete_sync(aKeyring, aItemId);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::GetAttributes(const char *aKeyring, guint32 aItemId,
+                                      GnomeKeyringAttributeList **aAttributes)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  GnomeKeyringResult result =
+    gnome_keyring_item_get_attributes_sync(aKeyring, aItemId, aAttributes);
+  if (result == GNOME_KEYRING_RESULT_OK)
+    KeyringStats::Count(KeyringStats::kItemsReceived);
+  return result;
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::SetAttributes(const char *aKeyring, guint32 aItemId,
+                                      GnomeKeyringAttributeList *aAttributes)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  return gnome_keyring_item_set_attributes_sync(aKeyring, aItemId,
+                                                aAttributes);
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::GetSecret(const char *aKeyring, guint32 aItemId,
+                                  char **aSecret)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  GnomeKeyringItemInfo *info;
+  GnomeKeyringResult result = gnome_keyring_item_get_info_sync(aKeyring,
+                                                               aItemId,
+                                                               &info);
+  if (result != GNOME_KEYRING_RESULT_OK)
+    return result;
+
+  *aSecret = gnome_keyring_item_info_get_secret(info);
+  gnome_keyring_item_info_free(info);
+  KeyringStats::CountSecret(*aSecret);
+  return GNOME_KEYRING_RESULT_OK;
+}
+
+GnomeKeyringResult
+LibgnomeKeyringBackend::SetSecret(const char *aKeyring, guint32 aItemId,
+                                  GnomeKeyringItemType aType,
+                                  const char *aDisplayName,
+                                  const char *aSecret)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  GnomeKeyringItemInfo *info = gnome_keyring_item_info_new();
+  gnome_keyring_item_info_set_type(info, aType);
+  gnome_keyring_item_info_set_display_name(info, aDisplayName);
+  gnome_keyring_item_info_set_secret(info, aSecret);
+  GnomeKeyringResult result = gnome_keyring_item_set_info_sync(aKeyring,
+                                                               aItemId, info);
+  gnome_keyring_item_info_free(info);
+  return result;
+}
@@ -0,0 +1,169 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef KeyringBackend_h__
+#define KeyringBackend_h__
+
+#include "prtypes.h"
+extern "C" {
+#include "gnome-keyring.h"
+}
+
+/* The keyring operations the storage is built on. The default backend
+ * forwards them to libgnome-keyring; FakeKeyringBackend keeps the items
+ * in memory, so that changes to the storage can be measured without a
+ * daemon. Results, lists and found items are those of libgnome-keyring
+ * and are freed the same way.
+ *
+ * All calls are made from the keyring thread. The callback of the
+ * asynchronous ones is dispatched from the thread default main context,
+ * see AsyncBatch. Only a backend whose IsPipelined() is true can have
+ * several of them in flight; with the others the bulk operations make
+ * the synchronous calls one after the other instead.
+ */
+class KeyringBackend
+{
+public:
+  virtual ~KeyringBackend() { }
+
+  static KeyringBackend *Get() { return sBackend; }
+  /* Use aBackend from now on, which is then owned here. Only done in
+   * Init, before the keyring thread starts. */
+  static void Use(KeyringBackend *aBackend);
+
+  virtual GnomeKeyringResult CreateKeyring(const char *aKeyring) = 0;
+  virtual GnomeKeyringResult DeleteKeyring(const char *aKeyring) = 0;
+  // The names, to be freed with gnome_keyring_string_list_free
+  virtual GnomeKeyringResult ListKeyrings(GList **aNames) = 0;
+  virtual GnomeKeyringResult GetKeyringInfo(const char *aKeyring,
+                                            PRBool *aLocked,
+                                            PRInt64 *aMtime) = 0;
+  // The ids, as GUINT_TO_POINTER, to be freed with g_list_free
+  virtual GnomeKeyringResult ListItemIds(const char *aKeyring,
+                                         GList **aIds) = 0;
+  // The items holding all of aAttributes, in every keyring
+  virtual GnomeKeyringResult FindItems(GnomeKeyringItemType aType,
+                                       GnomeKeyringAttributeList *aAttributes,
+                                       GList **aFound) = 0;
+  // An item with the same attributes is updated rather than duplicated
+  virtual GnomeKeyringResult CreateItem(const char *aKeyring,
+                                        GnomeKeyringItemType aType,
+                                        const char *aDisplayName,
+                                        GnomeKeyringAttributeList *aAttributes,
+                                        const char *aSecret,
+                                        guint32 *aItemId) = 0;
+  virtual GnomeKeyringResult DeleteItem(const char *aKeyring,
+                                        guint32 aItemId) = 0;
+  virtual GnomeKeyringResult GetAttributes(
+                               const char *aKeyring, guint32 aItemId,
+                               GnomeKeyringAttributeList **aAttributes) = 0;
+  virtual GnomeKeyringResult SetAttributes(
+                               const char *aKeyring, guint32 aItemId,
+                               GnomeKeyringAttributeList *aAttributes) = 0;
+  // The secret, to be freed with gnome_keyring_free_password
+  virtual GnomeKeyringResult GetSecret(const char *aKeyring, guint32 aItemId,
+                                       char **aSecret) = 0;
+  virtual GnomeKeyringResult SetSecret(const char *aKeyring, guint32 aItemId,
+                                       GnomeKeyringItemType aType,
+                                       const char *aDisplayName,
+                                       const char *aSecret) = 0;
+
+  virtual PRBool IsPipelined() { return PR_FALSE; }
+
+  // By default, the synchronous call is made right away
+  virtual void CreateItemAsync(const char *aKeyring,
+                               GnomeKeyringItemType aType,
+                               const char *aDisplayName,
+                               GnomeKeyringAttributeList *aAttributes,
+                               const char *aSecret,
+                               GnomeKeyringOperationGetIntCallback aCallback,
+                               gpointer aData);
+  virtual void DeleteItemAsync(const char *aKeyring, guint32 aItemId,
+                               GnomeKeyringOperationDoneCallback aCallback,
+                               gpointer aData);
+  virtual void SetAttributesAsync(const char *aKeyring, guint32 aItemId,
+                                  GnomeKeyringAttributeList *aAttributes,
+                                  GnomeKeyringOperationDoneCallback aCallback,
+                                  gpointer aData);
+
+protected:
+  /* Pass aResult, and aValue for aGetInt, to the callback from the thread
+   * default main context, aDelay microseconds from now. */
+  static void Reply(GnomeKeyringResult aResult, guint32 aValue,
+                    GnomeKeyringOperationDoneCallback aDone,
+                    GnomeKeyringOperationGetIntCallback aGetInt,
+                    gpointer aData, PRUint32 aDelay);
+
+private:
+  static KeyringBackend *sBackend;
+};
+
+/* The daemon, through libgnome-keyring. Its asynchronous requests are
+ * only answered from the default main context, which belongs to the UI,
+ * so this backend isn't pipelined. */
+class LibgnomeKeyringBackend : public KeyringBackend
+{
+public:
+  GnomeKeyringResult CreateKeyring(const char *aKeyring);
+  GnomeKeyringResult DeleteKeyring(const char *aKeyring);
+  GnomeKeyringResult ListKeyrings(GList **aNames);
+  GnomeKeyringResult GetKeyringInfo(const char *aKeyring, PRBool *aLocked,
+                                    PRInt64 *aMtime);
+  GnomeKeyringResult ListItemIds(const char *aKeyring, GList **aIds);
+  GnomeKeyringResult FindItems(GnomeKeyringItemType aType,
+                               GnomeKeyringAttributeList *aAttributes,
+                               GList **aFound);
+  GnomeKeyringResult CreateItem(const char *aKeyring,
+                                GnomeKeyringItemType aType,
+                                const char *aDisplayName,
+                                GnomeKeyringAttributeList *aAttributes,
+                                const char *aSecret,
+                                guint32 *aItemId);
+  GnomeKeyringResult DeleteItem(const char *aKeyring, guint32 aItemId);
+  GnomeKeyringResult GetAttributes(const char *aKeyring, guint32 aItemId,
+                                   GnomeKeyringAttributeList **aAttributes);
+  GnomeKeyringResult SetAttributes(const char *aKeyring, guint32 aItemId,
+                                   GnomeKeyringAttributeList *aAttributes);
+  GnomeKeyringResult GetSecret(const char *aKeyring, guint32 aItemId,
+                               char **aSecret);
+  GnomeKeyringResult SetSecret(const char *aKeyring, guint32 aItemId,
+                               GnomeKeyringItemType aType,
+                               const char *aDisplayName,
+                               const char *aSecret);
+};
+
+#endif /* KeyringBackend_h__ */
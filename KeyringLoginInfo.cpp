@@ -0,0 +1,325 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "KeyringLoginInfo.h"
+#include "KeyringThread.h"
+#include "KeyringBackend.h"
+#include "StringConversion.h"
+#include "nsComponentManagerUtils.h"
+
+extern "C" {
+#include "gnome-keyring.h"
+}
+
+// UTF-8 to UTF-16, keeping NULL attributes as void strings
+static void
+assignAttribute(nsString &aDest, const char *aValue)
+{
+  if (aValue)
+    AssignUTF8toUTF16(aValue, aDest);
+  else
+    aDest.SetIsVoid(PR_TRUE);
+}
+
+// Like the == of nsLoginInfo.js, where null and "" differ
+static PRBool
+sameValue(const nsAString &a, const nsAString &b)
+{
+  return a.IsVoid() == b.IsVoid() && a.Equals(b);
+}
+
+KeyringLoginInfo::KeyringLoginInfo(LoginMetadata *aEntry)
+  : mKeyring(aEntry->keyring),
+    mItemId(aEntry->itemId),
+    mPasswordLoaded(PR_FALSE)
+{
+  assignAttribute(mHostname, aEntry->hostname);
+  assignAttribute(mFormSubmitURL, aEntry->formSubmitURL);
+  assignAttribute(mHttpRealm, aEntry->httpRealm);
+  assignAttribute(mUsername, aEntry->username);
+  assignAttribute(mUsernameField, aEntry->usernameField);
+  assignAttribute(mPasswordField, aEntry->passwordField);
+}
+
+NS_IMPL_THREADSAFE_ISUPPORTS1(KeyringLoginInfo, nsILoginInfo)
+
+/* Reads the secret of an item, on the keyring thread. */
+class PasswordTask : public KeyringTask
+{
+public:
+  PasswordTask(const nsCString &aKeyring, guint aItemId)
+    : mKeyring(aKeyring), mItemId(aItemId) { }
+
+  nsresult Execute()
+  {
+    char *secret;
+    GnomeKeyringResult result =
+      KeyringBackend::Get()->GetSecret(mKeyring.get(), mItemId, &secret);
+    if (result != GNOME_KEYRING_RESULT_OK) {
+      NS_WARNING("Can't read the password of a keyring item");
+      return NS_ERROR_FAILURE;
+    }
+
+    nsresult rv = mSecret.Assign(secret ? secret : "");
+    gnome_keyring_free_password(secret);
+    return rv;
+  }
+
+  SecretBuffer mSecret;
+
+private:
+  nsCString mKeyring;
+  guint mItemId;
+};
+
+nsresult
+KeyringLoginInfo::SetLoadedPassword(const SecretBuffer &aSecret)
+{
+  nsresult rv = mPassword.Assign(aSecret.get());
+  NS_ENSURE_SUCCESS(rv, rv);
+  mPasswordLoaded = PR_TRUE;
+  return NS_OK;
+}
+
+nsresult
+KeyringLoginInfo::loadPassword()
+{
+  if (mPasswordLoaded)
+    return NS_OK;
+
+  nsRefPtr<PasswordTask> task = new PasswordTask(mKeyring, mItemId);
+  nsresult rv = KeyringThread::RunSync(task);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = mPassword.Assign(task->mSecret.get());
+  NS_ENSURE_SUCCESS(rv, rv);
+  mPasswordLoaded = PR_TRUE;
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetHostname(nsAString & aHostname)
+{
+  aHostname.Assign(mHostname);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetHostname(const nsAString & aHostname)
+{
+  mHostname.Assign(aHostname);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetFormSubmitURL(nsAString & aFormSubmitURL)
+{
+  aFormSubmitURL.Assign(mFormSubmitURL);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetFormSubmitURL(const nsAString & aFormSubmitURL)
+{
+  mFormSubmitURL.Assign(aFormSubmitURL);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetHttpRealm(nsAString & aHttpRealm)
+{
+  aHttpRealm.Assign(mHttpRealm);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetHttpRealm(const nsAString & aHttpRealm)
+{
+  mHttpRealm.Assign(aHttpRealm);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetUsername(nsAString & aUsername)
+{
+  aUsername.Assign(mUsername);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetUsername(const nsAString & aUsername)
+{
+  mUsername.Assign(aUsername);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetUsernameField(nsAString & aUsernameField)
+{
+  aUsernameField.Assign(mUsernameField);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetUsernameField(const nsAString & aUsernameField)
+{
+  mUsernameField.Assign(aUsernameField);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetPassword(nsAString & aPassword)
+{
+  nsresult rv = loadPassword();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mPassword.ToUTF16(aPassword);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetPassword(const nsAString & aPassword)
+{
+  nsresult rv = mPassword.AssignUTF16(aPassword);
+  NS_ENSURE_SUCCESS(rv, rv);
+  mPasswordLoaded = PR_TRUE;
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::GetPasswordField(nsAString & aPasswordField)
+{
+  aPasswordField.Assign(mPasswordField);
+  return NS_OK;
+}
+NS_IMETHODIMP KeyringLoginInfo::SetPasswordField(const nsAString & aPasswordField)
+{
+  mPasswordField.Assign(aPasswordField);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::Init(const nsAString & aHostname,
+                                     const nsAString & aFormSubmitURL,
+                                     const nsAString & aHttpRealm,
+                                     const nsAString & aUsername,
+                                     const nsAString & aPassword,
+                                     const nsAString & aUsernameField,
+                                     const nsAString & aPasswordField)
+{
+  mHostname.Assign(aHostname);
+  mFormSubmitURL.Assign(aFormSubmitURL);
+  mHttpRealm.Assign(aHttpRealm);
+  mUsername.Assign(aUsername);
+  mUsernameField.Assign(aUsernameField);
+  mPasswordField.Assign(aPasswordField);
+  return SetPassword(aPassword);
+}
+
+NS_IMETHODIMP KeyringLoginInfo::Equals(nsILoginInfo *aLogin, PRBool *_retval)
+{
+  nsAutoString s;
+
+  *_retval = PR_FALSE;
+
+  aLogin->GetHostname(s);
+  if (!sameValue(mHostname, s))
+    return NS_OK;
+  aLogin->GetFormSubmitURL(s);
+  if (!sameValue(mFormSubmitURL, s))
+    return NS_OK;
+  aLogin->GetHttpRealm(s);
+  if (!sameValue(mHttpRealm, s))
+    return NS_OK;
+  aLogin->GetUsername(s);
+  if (!sameValue(mUsername, s))
+    return NS_OK;
+  aLogin->GetUsernameField(s);
+  if (!sameValue(mUsernameField, s))
+    return NS_OK;
+  aLogin->GetPasswordField(s);
+  if (!sameValue(mPasswordField, s))
+    return NS_OK;
+
+  // Compare the password last, it is the only one needing the daemon
+  nsresult rv = loadPassword();
+  NS_ENSURE_SUCCESS(rv, rv);
+  aLogin->GetPassword(s);
+  *_retval = mPassword.EqualsUTF16(s);
+  SecretArena::Wipe(s);
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::Matches(nsILoginInfo *aLogin,
+                                        PRBool ignorePassword,
+                                        PRBool *_retval)
+{
+  nsAutoString s;
+
+  *_retval = PR_FALSE;
+
+  aLogin->GetHostname(s);
+  if (!sameValue(mHostname, s))
+    return NS_OK;
+  aLogin->GetHttpRealm(s);
+  if (!sameValue(mHttpRealm, s))
+    return NS_OK;
+  aLogin->GetUsername(s);
+  if (!sameValue(mUsername, s))
+    return NS_OK;
+
+  // If either formSubmitURL is blank (but not null), then match.
+  aLogin->GetFormSubmitURL(s);
+  if (!(mFormSubmitURL.IsEmpty() && !mFormSubmitURL.IsVoid()) &&
+      !(s.IsEmpty() && !s.IsVoid()) &&
+      !sameValue(mFormSubmitURL, s))
+    return NS_OK;
+
+  // The usernameField and passwordField values are ignored.
+
+  if (!ignorePassword) {
+    nsresult rv = loadPassword();
+    NS_ENSURE_SUCCESS(rv, rv);
+    aLogin->GetPassword(s);
+    PRBool same = mPassword.EqualsUTF16(s);
+    SecretArena::Wipe(s);
+    if (!same)
+      return NS_OK;
+  }
+
+  *_retval = PR_TRUE;
+  return NS_OK;
+}
+
+NS_IMETHODIMP KeyringLoginInfo::Clone(nsILoginInfo **_retval)
+{
+  nsresult rv = loadPassword();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsILoginInfo> clone = do_CreateInstance(NS_LOGININFO_CONTRACTID);
+  NS_ENSURE_TRUE(clone, NS_ERROR_OUT_OF_MEMORY);
+
+  nsAutoString password;
+  mPassword.ToUTF16(password);
+  rv = clone->Init(mHostname, mFormSubmitURL, mHttpRealm, mUsername,
+                   password, mUsernameField, mPasswordField);
+  SecretArena::Wipe(password);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  NS_ADDREF(*_retval = clone);
+  return NS_OK;
+}
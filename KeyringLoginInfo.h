@@ -0,0 +1,81 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef KeyringLoginInfo_h__
+#define KeyringLoginInfo_h__
+
+#include "nsILoginInfo.h"
+#include "nsStringAPI.h"
+#include "GnomeKeyring.h"
+#include "SecretArena.h"
+
+/* nsILoginInfo for a login read from the keyring. The attributes are
+ * filled in from the index, the password is only fetched from the
+ * daemon the first time it is asked for. Logins are built on the keyring
+ * thread and handed to the caller, hence the thread-safe refcount. */
+class KeyringLoginInfo : public nsILoginInfo
+{
+public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_NSILOGININFO
+
+  KeyringLoginInfo(LoginMetadata *aEntry);
+
+  const nsCString &Keyring() { return mKeyring; }
+  guint ItemId() { return mItemId; }
+  PRBool HasPassword() { return mPasswordLoaded; }
+  // Fill in the password read along with others, see SecretService
+  nsresult SetLoadedPassword(const SecretBuffer &aSecret);
+
+private:
+  nsresult loadPassword();
+
+  nsString mHostname;
+  nsString mFormSubmitURL;
+  nsString mHttpRealm;
+  nsString mUsername;
+  nsString mUsernameField;
+  // UTF-8, in locked memory
+  SecretBuffer mPassword;
+  nsString mPasswordField;
+
+  nsCString mKeyring;
+  guint mItemId;
+  PRBool mPasswordLoaded;
+};
+
+#endif /* KeyringLoginInfo_h__ */
@@ -0,0 +1,176 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "KeyringStats.h"
+#include "pratom.h"
+
+#include <string.h>
+
+extern "C" {
+#include "gnome-keyring.h"
+}
+
+static const char *const kMethodNames[KeyringStats::kMethodCount] = {
+  "addLogin",
+  "addLogins",
+  "removeLogin",
+  "modifyLogin",
+  "removeAllLogins",
+  "getAllLogins",
+  "findLogins",
+  "searchLogins",
+  "countLogins",
+  "getAllDisabledHosts",
+  "getLoginSavingEnabled",
+  "setLoginSavingEnabled"
+};
+
+static const char *const kCounterNames[KeyringStats::kCounterCount] = {
+  "keyringCalls",
+  "itemsReceived",
+  "secretBytes",
+  "indexHits",
+  "indexMisses",
+  "disabledHostHits",
+  "disabledHostMisses",
+  "exactHits",
+  "exactMisses"
+};
+
+static PRInt32 sCounters[KeyringStats::kCounterCount];
+static PRInt32 sCalls[KeyringStats::kMethodCount];
+static PRInt32 sBuckets[KeyringStats::kMethodCount][KeyringStats::kBucketCount];
+
+void
+KeyringStats::Count(Counter aCounter, PRInt32 aAmount)
+{
+  PR_ATOMIC_ADD(&sCounters[aCounter], aAmount);
+}
+
+void
+KeyringStats::CountFound(GList *aFound)
+{
+  PRInt32 items = 0, bytes = 0;
+  for (GList *l = aFound; l != NULL; l = l->next) {
+    const char *secret = static_cast<GnomeKeyringFound*>(l->data)->secret;
+    items++;
+    if (secret)
+      bytes += strlen(secret);
+  }
+  Count(kItemsReceived, items);
+  Count(kSecretBytes, bytes);
+}
+
+void
+KeyringStats::CountSecret(const char *aSecret)
+{
+  Count(kItemsReceived);
+  if (aSecret)
+    Count(kSecretBytes, strlen(aSecret));
+}
+
+void
+KeyringStats::Record(Method aMethod, gint64 aStart)
+{
+  gint64 us = CLAMP(g_get_monotonic_time() - aStart, 0, G_MAXUINT32);
+  // g_bit_storage gives the bucket, counting 0 like 1
+  PRUint32 bucket = MIN(g_bit_storage(us), kBucketCount - 1);
+
+  PR_ATOMIC_INCREMENT(&sCalls[aMethod]);
+  PR_ATOMIC_INCREMENT(&sBuckets[aMethod][bucket]);
+}
+
+void
+KeyringStats::Reset()
+{
+  for (PRUint32 i = 0; i < kCounterCount; i++)
+    PR_ATOMIC_SET(&sCounters[i], 0);
+  for (PRUint32 i = 0; i < kMethodCount; i++) {
+    PR_ATOMIC_SET(&sCalls[i], 0);
+    for (PRUint32 j = 0; j < kBucketCount; j++)
+      PR_ATOMIC_SET(&sBuckets[i][j], 0);
+  }
+}
+
+/* Upper bound in microseconds of the bucket holding the call below which
+ * aFraction of aBuckets fall, 0 without calls. */
+static PRUint32
+estimatePercentile(const PRInt32 *aBuckets, PRInt32 aCalls, double aFraction)
+{
+  PRInt32 seen = 0;
+  for (PRUint32 i = 0; i < KeyringStats::kBucketCount; i++) {
+    seen += aBuckets[i];
+    if (seen > 0 && seen >= aFraction * aCalls)
+      return 1U << i;
+  }
+  return 0;
+}
+
+/* {"methods": {"findLogins": {"calls": 3, "p50Us": 64, "p99Us": 128,
+ *                             "histogram": [0, 0, ...]}, ...},
+ *  "keyringCalls": 12, ...}
+ * Methods that weren't called are left out. */
+void
+KeyringStats::ToJSON(nsACString &aResult)
+{
+  GString *json = g_string_new("{\"methods\": {");
+  PRBool first = PR_TRUE;
+
+  for (PRUint32 i = 0; i < kMethodCount; i++) {
+    PRInt32 calls = sCalls[i];
+    if (!calls)
+      continue;
+    g_string_append_printf(json, "%s\"%s\": {\"calls\": %d, "
+                           "\"p50Us\": %u, \"p99Us\": %u, \"histogram\": [",
+                           first ? "" : ", ", kMethodNames[i], calls,
+                           estimatePercentile(sBuckets[i], calls, 0.5),
+                           estimatePercentile(sBuckets[i], calls, 0.99));
+    for (PRUint32 j = 0; j < kBucketCount; j++)
+      g_string_append_printf(json, j ? ", %d" : "%d", sBuckets[i][j]);
+    g_string_append(json, "]}");
+    first = PR_FALSE;
+  }
+  g_string_append(json, "}");
+
+  for (PRUint32 i = 0; i < kCounterCount; i++)
+    g_string_append_printf(json, ", \"%s\": %d", kCounterNames[i],
+                           sCounters[i]);
+  g_string_append(json, "}");
+
+  aResult.Assign(json->str, json->len);
+  g_string_free(json, TRUE);
+}
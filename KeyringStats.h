@@ -0,0 +1,116 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef KeyringStats_h__
+#define KeyringStats_h__
+
+#include "nsStringAPI.h"
+#include <glib.h>
+
+/* Counters kept at all times and read through nsIGnomeKeyring.stats. They
+ * are bumped with atomic adds from both the calling thread and the
+ * keyring thread, so recording costs no lock; a read made while calls are
+ * running may miss the ones in flight.
+ */
+class KeyringStats
+{
+public:
+  // The nsILoginManagerStorage methods that get a latency histogram
+  enum Method {
+    kAddLogin,
+    kAddLogins,
+    kRemoveLogin,
+    kModifyLogin,
+    kRemoveAllLogins,
+    kGetAllLogins,
+    kFindLogins,
+    kSearchLogins,
+    kCountLogins,
+    kGetAllDisabledHosts,
+    kGetLoginSavingEnabled,
+    kSetLoginSavingEnabled,
+    kMethodCount
+  };
+
+  enum Counter {
+    // Requests sent to the daemon, each one a round trip on the bus
+    kKeyringCalls,
+    // Items whose attributes or secret came back from the daemon
+    kItemsReceived,
+    kSecretBytes,
+    // Whether ensureIndex found the login index loaded
+    kIndexHits,
+    kIndexMisses,
+    kDisabledHostHits,
+    kDisabledHostMisses,
+    // Whether findExactLogin found the item in the index
+    kExactHits,
+    kExactMisses,
+    kCounterCount
+  };
+
+  /* Bucket i counts the calls taking less than 2^i microseconds and at
+   * least half that; the last one also counts the slower ones. */
+  static const PRUint32 kBucketCount = 24;
+
+  static void Count(Counter aCounter, PRInt32 aAmount = 1);
+  // One item per element of aFound, a GList of GnomeKeyringFound
+  static void CountFound(GList *aFound);
+  static void CountSecret(const char *aSecret);
+  /* A call of aMethod that started at aStart, a g_get_monotonic_time in
+   * microseconds. PR_IntervalNow only ticks per millisecond on Linux,
+   * which would leave the lower buckets empty. */
+  static void Record(Method aMethod, gint64 aStart);
+
+  static void Reset();
+  static void ToJSON(nsACString &aResult);
+};
+
+// Records the latency of the enclosing scope as a call of aMethod
+class MethodTimer
+{
+public:
+  MethodTimer(KeyringStats::Method aMethod)
+    : mMethod(aMethod), mStart(g_get_monotonic_time()) { }
+  ~MethodTimer() { KeyringStats::Record(mMethod, mStart); }
+
+private:
+  KeyringStats::Method mMethod;
+  gint64 mStart;
+};
+
+#endif /* KeyringStats_h__ */
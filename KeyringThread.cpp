@@ -0,0 +1,186 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "KeyringThread.h"
+
+extern "C" {
+#include <glib.h>
+}
+
+nsIThread *KeyringThread::sThread = nsnull;
+PRUint32 KeyringThread::sUsers = 0;
+
+KeyringTask::KeyringTask()
+  : mResult(NS_OK),
+    mState(PENDING),
+    mAsync(PR_FALSE)
+{
+  mLock = PR_NewLock();
+  mCondVar = PR_NewCondVar(mLock);
+}
+
+KeyringTask::~KeyringTask()
+{
+  PR_DestroyCondVar(mCondVar);
+  PR_DestroyLock(mLock);
+}
+
+NS_IMETHODIMP
+KeyringTask::Run()
+{
+  if (mState == EXECUTED) {
+    // Back on the main thread after an asynchronous run
+    mState = DONE;
+    Finish();
+    return NS_OK;
+  }
+
+  mResult = Execute();
+
+  if (mAsync) {
+    mState = EXECUTED;
+    return NS_DispatchToMainThread(this);
+  }
+
+  PR_Lock(mLock);
+  mState = DONE;
+  PR_NotifyAllCondVar(mCondVar);
+  PR_Unlock(mLock);
+  return NS_OK;
+}
+
+nsresult
+KeyringThread::Start()
+{
+  if (sUsers > 0) {
+    sUsers++;
+    return NS_OK;
+  }
+  nsresult rv = NS_NewThread(&sThread);
+  NS_ENSURE_SUCCESS(rv, rv);
+  sUsers = 1;
+  return NS_OK;
+}
+
+void
+KeyringThread::Shutdown()
+{
+  NS_ENSURE_TRUE(sUsers > 0, );
+  if (--sUsers > 0)
+    return;
+  // Pending tasks are run before the thread goes away
+  sThread->Shutdown();
+  NS_RELEASE(sThread);
+}
+
+nsresult
+KeyringThread::RunSync(KeyringTask *aTask)
+{
+  nsRefPtr<KeyringTask> task(aTask);
+
+  PRBool onThread = PR_FALSE;
+  if (!sThread || (NS_SUCCEEDED(sThread->IsOnCurrentThread(&onThread)) &&
+                   onThread))
+    return task->Execute();
+
+  nsresult rv = sThread->Dispatch(task, NS_DISPATCH_NORMAL);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PR_Lock(task->mLock);
+  while (task->mState != KeyringTask::DONE)
+    PR_WaitCondVar(task->mCondVar, PR_INTERVAL_NO_TIMEOUT);
+  PR_Unlock(task->mLock);
+  return task->Result();
+}
+
+nsresult
+KeyringThread::RunAsync(KeyringTask *aTask)
+{
+  nsRefPtr<KeyringTask> task(aTask);
+  task->mAsync = PR_TRUE;
+
+  if (!sThread) {
+    // Still deliver the result later, like with the thread
+    task->mResult = task->Execute();
+    task->mState = KeyringTask::EXECUTED;
+    return NS_DispatchToMainThread(task);
+  }
+  return sThread->Dispatch(task, NS_DISPATCH_NORMAL);
+}
+
+AsyncBatch::AsyncBatch(PRUint32 aCount, PRInt32 aWindow,
+                       StartFunc aStart, void *aData)
+  : mCount(aCount),
+    mNext(0),
+    mCompleted(0),
+    mWindow(aWindow > 0 ? aWindow : 1),
+    mPending(0),
+    mStart(aStart),
+    mData(aData)
+{
+}
+
+void
+AsyncBatch::startNext()
+{
+  while (mNext < mCount && mPending < mWindow) {
+    mPending++;
+    mStart(this, mNext++, mData);
+  }
+}
+
+void
+AsyncBatch::Complete()
+{
+  mPending--;
+  mCompleted++;
+  startNext();
+}
+
+void
+AsyncBatch::Run()
+{
+  GMainContext *context = g_main_context_new();
+  g_main_context_push_thread_default(context);
+
+  startNext();
+  while (mCompleted < mCount)
+    g_main_context_iteration(context, TRUE);
+
+  g_main_context_pop_thread_default(context);
+  g_main_context_unref(context);
+}
@@ -0,0 +1,132 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef KeyringThread_h__
+#define KeyringThread_h__
+
+#include "nsThreadUtils.h"
+#include "prlock.h"
+#include "prcvar.h"
+
+/* Work for the keyring thread. Execute() runs there; for asynchronous
+ * tasks Finish() is then called on the main thread. Tasks must not touch
+ * XPCOM objects from other threads in Execute(), as logins may well be
+ * implemented in JS.
+ */
+class KeyringTask : public nsRunnable
+{
+public:
+  KeyringTask();
+  virtual ~KeyringTask();
+
+  NS_IMETHOD Run();
+
+  virtual nsresult Execute() = 0;
+  virtual void Finish() { }
+
+  nsresult Result() { return mResult; }
+
+protected:
+  nsresult mResult;
+
+private:
+  friend class KeyringThread;
+
+  enum State { PENDING, EXECUTED, DONE };
+
+  PRLock *mLock;
+  PRCondVar *mCondVar;
+  State mState;
+  PRBool mAsync;
+};
+
+/* All the keyring traffic happens on one background thread, so that a
+ * slow daemon doesn't block the thread calling the storage. */
+class KeyringThread
+{
+public:
+  /* The thread is shared by the storage instances: it is started by the
+   * first Start() and shut down by the matching last Shutdown(). Both
+   * are called on the main thread. */
+  static nsresult Start();
+  static void Shutdown();
+
+  /* Run aTask on the keyring thread and block until its result is there.
+   * Nothing else runs on the calling thread meanwhile, so callers aren't
+   * reentered. Without a keyring thread, or on it, the task runs right
+   * away. */
+  static nsresult RunSync(KeyringTask *aTask);
+
+  /* Queue aTask on the keyring thread; its Finish() is called on the main
+   * thread afterwards. */
+  static nsresult RunAsync(KeyringTask *aTask);
+
+private:
+  static nsIThread *sThread;
+  static PRUint32 sUsers;
+};
+
+/* Pipelines aCount requests made with the asynchronous calls of
+ * KeyringBackend, with at most aWindow of them in flight. aStart(i) must
+ * send request i and its reply callback must call Complete(). Run() sends
+ * the requests from the calling thread, normally the keyring thread, and
+ * returns once every reply came back; the replies are dispatched from a
+ * main context of its own, made the thread default while it runs.
+ */
+class AsyncBatch
+{
+public:
+  typedef void (*StartFunc)(AsyncBatch *aBatch, PRUint32 aIndex, void *aData);
+
+  AsyncBatch(PRUint32 aCount, PRInt32 aWindow, StartFunc aStart, void *aData);
+
+  void Run();
+  void Complete();
+
+private:
+  void startNext();
+
+  PRUint32 mCount;
+  PRUint32 mNext;
+  PRUint32 mCompleted;
+  PRInt32 mWindow;
+  PRInt32 mPending;
+  StartFunc mStart;
+  void *mData;
+};
+
+#endif /* KeyringThread_h__ */
@@ -0,0 +1,253 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "KeyringWatcher.h"
+#include "GnomeKeyring.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+static const char kSecretInterface[] = "org.freedesktop.Secret.Collection";
+static const char kCollectionPrefix[] = "/org/freedesktop/secrets/collection/";
+
+KeyringWatcher::KeyringWatcher()
+  : mConnection(NULL),
+    mCancellable(NULL),
+    mSubscription(0),
+    mFunc(NULL),
+    mData(NULL)
+{
+}
+
+KeyringWatcher::~KeyringWatcher()
+{
+  Stop();
+}
+
+nsresult
+KeyringWatcher::Start(ChangeFunc aFunc, void *aData)
+{
+  if (mConnection || mCancellable)
+    return NS_OK;
+
+  mFunc = aFunc;
+  mData = aData;
+  mCancellable = g_cancellable_new();
+  g_bus_get(G_BUS_TYPE_SESSION, mCancellable, onBusReady, this);
+  return NS_OK;
+}
+
+/* Once cancelled by Stop, the watcher may be gone: it is only touched
+ * when the connection was made. */
+void
+KeyringWatcher::onBusReady(GObject *aSource, GAsyncResult *aResult,
+                           gpointer aData)
+{
+  GError *error = NULL;
+  GDBusConnection *connection = g_bus_get_finish(aResult, &error);
+  if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_error_free(error);
+    return;
+  }
+
+  KeyringWatcher *self = static_cast<KeyringWatcher*>(aData);
+  g_object_unref(self->mCancellable);
+  self->mCancellable = NULL;
+
+  if (!connection) {
+    GK_LOG(("No session bus, external changes won't be seen: %s\n",
+            error->message));
+    g_error_free(error);
+    return;
+  }
+
+  self->mConnection = connection;
+  // Matches ItemCreated, ItemDeleted and ItemChanged of every collection
+  self->mSubscription = g_dbus_connection_signal_subscribe(
+                          connection, NULL, kSecretInterface, NULL, NULL,
+                          NULL, G_DBUS_SIGNAL_FLAGS_NONE, onSignal, self,
+                          NULL);
+  GK_LOG(("Watching the keyrings for external changes\n"));
+}
+
+void
+KeyringWatcher::Stop()
+{
+  if (mCancellable) {
+    g_cancellable_cancel(mCancellable);
+    g_object_unref(mCancellable);
+    mCancellable = NULL;
+  }
+  if (!mConnection)
+    return;
+
+  g_dbus_connection_signal_unsubscribe(mConnection, mSubscription);
+  g_object_unref(mConnection);
+  mConnection = NULL;
+  mSubscription = 0;
+}
+
+/* gnome-keyring-daemon names the collection after the keyring, with the
+ * characters outside [A-Za-z0-9] written as _xx in hex. */
+PRBool
+KeyringWatcher::ParseItemPath(const char *aPath, nsACString &aKeyring,
+                              guint *aItemId)
+{
+  if (strncmp(aPath, kCollectionPrefix, sizeof(kCollectionPrefix) - 1))
+    return PR_FALSE;
+
+  const char *collection = aPath + sizeof(kCollectionPrefix) - 1;
+  const char *slash = strchr(collection, '/');
+  if (!slash || slash == collection || !slash[1])
+    return PR_FALSE;
+
+  char *end;
+  unsigned long id = strtoul(slash + 1, &end, 10);
+  if (*end)
+    return PR_FALSE;
+
+  aKeyring.Truncate();
+  for (const char *p = collection; p < slash; p++) {
+    if (*p == '_' && slash - p > 2 &&
+        g_ascii_isxdigit(p[1]) && g_ascii_isxdigit(p[2])) {
+      char c = g_ascii_xdigit_value(p[1]) * 16 + g_ascii_xdigit_value(p[2]);
+      aKeyring.Append(c);
+      p += 2;
+    } else {
+      aKeyring.Append(*p);
+    }
+  }
+  *aItemId = id;
+  return PR_TRUE;
+}
+
+void
+KeyringWatcher::onSignal(GDBusConnection *aConnection,
+                         const gchar *aSender,
+                         const gchar *aPath,
+                         const gchar *aInterface,
+                         const gchar *aSignal,
+                         GVariant *aParameters,
+                         gpointer aData)
+{
+  KeyringWatcher *self = static_cast<KeyringWatcher*>(aData);
+
+  Change change;
+  if (!strcmp(aSignal, "ItemCreated"))
+    change = ITEM_CREATED;
+  else if (!strcmp(aSignal, "ItemChanged"))
+    change = ITEM_CHANGED;
+  else if (!strcmp(aSignal, "ItemDeleted"))
+    change = ITEM_DELETED;
+  else
+    return;
+
+  if (!g_variant_is_of_type(aParameters, G_VARIANT_TYPE("(o)")))
+    return;
+
+  const gchar *item;
+  g_variant_get(aParameters, "(&o)", &item);
+
+  nsCString keyring;
+  guint itemId;
+  if (!ParseItemPath(item, keyring, &itemId)) {
+    GK_LOG(("Ignoring %s of %s\n", aSignal, item));
+    return;
+  }
+  GK_LOG(("%s: item %u of %s\n", aSignal, itemId, keyring.get()));
+  self->mFunc(change, keyring.get(), itemId, self->mData);
+}
+
+struct ExpectedSignals::Entry
+{
+  PRUint32 count;
+  // When the last write was made
+  gint64 time;
+};
+
+ExpectedSignals::ExpectedSignals()
+{
+  mEntries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+ExpectedSignals::~ExpectedSignals()
+{
+  g_hash_table_destroy(mEntries);
+}
+
+gboolean
+ExpectedSignals::isExpired(gpointer aKey, gpointer aValue, gpointer aNow)
+{
+  Entry *entry = static_cast<Entry*>(aValue);
+  return *static_cast<gint64*>(aNow) - entry->time > kTimeout;
+}
+
+void
+ExpectedSignals::Add(const char *aKeyring, guint aItemId,
+                     KeyringWatcher::Change aChange)
+{
+  gint64 now = g_get_monotonic_time();
+  // Lost signals would pile up otherwise
+  if (g_hash_table_size(mEntries) >= 64)
+    g_hash_table_foreach_remove(mEntries, isExpired, &now);
+
+  char *key = g_strdup_printf("%s/%u/%i", aKeyring, aItemId, aChange);
+  Entry *entry = static_cast<Entry*>(g_hash_table_lookup(mEntries, key));
+  if (!entry) {
+    entry = g_new0(Entry, 1);
+    g_hash_table_insert(mEntries, key, entry);
+  } else {
+    g_free(key);
+  }
+  entry->count++;
+  entry->time = now;
+}
+
+PRBool
+ExpectedSignals::Take(const char *aKeyring, guint aItemId,
+                      KeyringWatcher::Change aChange, gint64 aTime)
+{
+  char *key = g_strdup_printf("%s/%u/%i", aKeyring, aItemId, aChange);
+  Entry *entry = static_cast<Entry*>(g_hash_table_lookup(mEntries, key));
+  // The signal may be received a little before the write is recorded
+  PRBool expected = entry && !isExpired(key, entry, &aTime);
+
+  if (entry && (!expected || --entry->count == 0))
+    g_hash_table_remove(mEntries, key);
+  g_free(key);
+  return expected;
+}
@@ -0,0 +1,125 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef KeyringWatcher_h__
+#define KeyringWatcher_h__
+
+#include "nsStringAPI.h"
+extern "C" {
+#include <gio/gio.h>
+}
+
+/* Follows the changes other programs make to the keyrings, from the
+ * Secret Service signals of gnome-keyring-daemon, so that the in-process
+ * state can be updated item by item. The session bus is the one of
+ * DBUS_SESSION_BUS_ADDRESS, so a private bus started with dbus-run-session
+ * works as well.
+ *
+ * The signals are dispatched from the default main context, which belongs
+ * to the main thread; Start and Stop are called there too. Start doesn't
+ * wait for the bus: the connection is made asynchronously, and changes
+ * made before it is there aren't reported.
+ */
+class KeyringWatcher
+{
+public:
+  enum Change { ITEM_CREATED, ITEM_CHANGED, ITEM_DELETED };
+  typedef void (*ChangeFunc)(Change aChange, const char *aKeyring,
+                             guint aItemId, void *aData);
+
+  KeyringWatcher();
+  ~KeyringWatcher();
+
+  nsresult Start(ChangeFunc aFunc, void *aData);
+  void Stop();
+
+  /* Keyring and item id of a Secret Service item object path, as
+   * /org/freedesktop/secrets/collection/<keyring>/<id> */
+  static PRBool ParseItemPath(const char *aPath, nsACString &aKeyring,
+                              guint *aItemId);
+
+private:
+  static void onBusReady(GObject *aSource, GAsyncResult *aResult,
+                         gpointer aData);
+  static void onSignal(GDBusConnection *aConnection,
+                       const gchar *aSender,
+                       const gchar *aPath,
+                       const gchar *aInterface,
+                       const gchar *aSignal,
+                       GVariant *aParameters,
+                       gpointer aData);
+
+  GDBusConnection *mConnection;
+  // Set while the connection is being made
+  GCancellable *mCancellable;
+  guint mSubscription;
+  ChangeFunc mFunc;
+  void *mData;
+};
+
+/* The items changed by our own writes, whose signal is still to come.
+ * The writes update the index and the journal themselves, so their
+ * signals are skipped rather than costing a GetAttributes call each. A
+ * signal only matches a write of the same kind of change, received within
+ * kTimeout of it: past that the signal is taken as lost, so that a later
+ * change by another program isn't missed. Only used on the keyring thread.
+ */
+class ExpectedSignals
+{
+public:
+  ExpectedSignals();
+  ~ExpectedSignals();
+
+  // One signal is to come for each write of the item
+  void Add(const char *aKeyring, guint aItemId,
+           KeyringWatcher::Change aChange);
+  /* Whether the signal of aChange received at aTime, from
+   * g_get_monotonic_time, was expected, which is then used up */
+  PRBool Take(const char *aKeyring, guint aItemId,
+              KeyringWatcher::Change aChange, gint64 aTime);
+
+private:
+  struct Entry;
+  static gboolean isExpired(gpointer aKey, gpointer aValue, gpointer aNow);
+
+  // The signals come within milliseconds of the writes
+  static const gint64 kTimeout = G_USEC_PER_SEC;
+
+  GHashTable *mEntries;
+};
+
+#endif /* KeyringWatcher_h__ */
@@ -0,0 +1,203 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "LoginEnumerator.h"
+#include "KeyringLoginInfo.h"
+#include "KeyringThread.h"
+#include "KeyringBackend.h"
+
+// Number of items read per trip to the keyring thread
+static const PRUint32 kChunkSize = 64;
+
+class FetchChunkTask : public KeyringTask
+{
+public:
+  FetchChunkTask(LoginEnumerator *aEnumerator)
+    : mEnumerator(aEnumerator) { }
+
+  nsresult Execute() { return mEnumerator->FetchChunk(); }
+
+private:
+  // The caller waits for the task, which keeps the enumerator alive
+  LoginEnumerator *mEnumerator;
+};
+
+LoginEnumerator::LoginEnumerator()
+  : mKeyrings(NULL),
+    mNextKeyring(NULL),
+    mStarted(PR_FALSE),
+    mIds(NULL),
+    mNextId(NULL),
+    mDone(PR_FALSE),
+    mBufferPos(0)
+{
+  mBuffer = g_ptr_array_new();
+}
+
+LoginEnumerator::~LoginEnumerator()
+{
+  clearBuffer();
+  g_ptr_array_free(mBuffer, TRUE);
+  g_list_free(mIds);
+  gnome_keyring_string_list_free(mKeyrings);
+}
+
+NS_IMPL_ISUPPORTS1(LoginEnumerator, nsISimpleEnumerator)
+
+void
+LoginEnumerator::clearBuffer()
+{
+  for (guint i = 0; i < mBuffer->len; i++)
+    delete static_cast<LoginMetadata*>(g_ptr_array_index(mBuffer, i));
+  g_ptr_array_set_size(mBuffer, 0);
+  mBufferPos = 0;
+}
+
+nsresult
+LoginEnumerator::openKeyring(const char *aKeyring)
+{
+  g_list_free(mIds);
+  mIds = mNextId = NULL;
+
+  KeyringBackend *backend = KeyringBackend::Get();
+  PRBool locked;
+  PRInt64 mtime;
+  GnomeKeyringResult result = backend->GetKeyringInfo(aKeyring, &locked,
+                                                      &mtime);
+  if (result != GNOME_KEYRING_RESULT_OK)
+    return NS_ERROR_FAILURE;
+
+  // Like the index, leave locked keyrings alone rather than prompting
+  if (locked)
+    return NS_OK;
+
+  result = backend->ListItemIds(aKeyring, &mIds);
+  if (result != GNOME_KEYRING_RESULT_OK)
+    return NS_ERROR_FAILURE;
+
+  mKeyring.Assign(aKeyring);
+  mNextId = mIds;
+  return NS_OK;
+}
+
+nsresult
+LoginEnumerator::FetchChunk()
+{
+  if (!mStarted) {
+    GnomeKeyringResult result =
+      KeyringBackend::Get()->ListKeyrings(&mKeyrings);
+    if (result != GNOME_KEYRING_RESULT_OK)
+      return NS_ERROR_FAILURE;
+    mNextKeyring = mKeyrings;
+    mStarted = PR_TRUE;
+  }
+
+  PRUint32 read = 0;
+  while (read < kChunkSize) {
+    if (!mNextId) {
+      if (!mNextKeyring) {
+        mDone = PR_TRUE;
+        break;
+      }
+      const char *keyring = static_cast<const char*>(mNextKeyring->data);
+      mNextKeyring = mNextKeyring->next;
+      if (!inSearchScope(keyring))
+        continue;
+
+      nsresult rv = openKeyring(keyring);
+      NS_ENSURE_SUCCESS(rv, rv);
+      continue;
+    }
+
+    guint id = GPOINTER_TO_UINT(mNextId->data);
+    mNextId = mNextId->next;
+    read++;
+
+    GnomeKeyringAttributeList *attributes;
+    GnomeKeyringResult result =
+      KeyringBackend::Get()->GetAttributes(mKeyring.get(), id, &attributes);
+    if (result != GNOME_KEYRING_RESULT_OK) {
+      // Most likely deleted since the ids were listed
+      GK_LOG(("Skipping item %i: %i\n", id, result));
+      continue;
+    }
+
+    if (isLoginItem(attributes))
+      g_ptr_array_add(mBuffer, new LoginMetadata(mKeyring.get(), id,
+                                                 attributes));
+    gnome_keyring_attribute_list_free(attributes);
+  }
+  return NS_OK;
+}
+
+/* Make sure there is a login to hand out, unless the end was reached. */
+nsresult
+LoginEnumerator::fill()
+{
+  if (mBufferPos < mBuffer->len)
+    return NS_OK;
+
+  clearBuffer();
+  while (mBuffer->len == 0 && !mDone) {
+    nsresult rv = KeyringThread::RunSync(new FetchChunkTask(this));
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+  return NS_OK;
+}
+
+NS_IMETHODIMP LoginEnumerator::HasMoreElements(PRBool *aResult)
+{
+  nsresult rv = fill();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  *aResult = mBufferPos < mBuffer->len;
+  return NS_OK;
+}
+
+NS_IMETHODIMP LoginEnumerator::GetNext(nsISupports **aResult)
+{
+  nsresult rv = fill();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  if (mBufferPos == mBuffer->len)
+    return NS_ERROR_FAILURE;
+
+  LoginMetadata *entry =
+    static_cast<LoginMetadata*>(g_ptr_array_index(mBuffer, mBufferPos++));
+  NS_ADDREF(*aResult = static_cast<nsILoginInfo*>(new KeyringLoginInfo(entry)));
+  return NS_OK;
+}
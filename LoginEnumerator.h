@@ -0,0 +1,83 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef LoginEnumerator_h__
+#define LoginEnumerator_h__
+
+#include "nsISimpleEnumerator.h"
+#include "nsStringAPI.h"
+#include "GnomeKeyring.h"
+
+/* Enumerates the stored logins a chunk at a time. Only the item ids of
+ * the keyring being walked are held; the attributes of at most
+ * kChunkSize items are read from the daemon per round trip to the keyring
+ * thread, and the logins are created as they are handed out. */
+class LoginEnumerator : public nsISimpleEnumerator
+{
+public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_NSISIMPLEENUMERATOR
+
+  LoginEnumerator();
+
+  // Run on the keyring thread
+  nsresult FetchChunk();
+
+private:
+  ~LoginEnumerator();
+
+  nsresult fill();
+  nsresult openKeyring(const char *aKeyring);
+  void clearBuffer();
+
+  // Keyrings left to walk, from gnome_keyring_list_keyring_names
+  GList *mKeyrings;
+  GList *mNextKeyring;
+  PRBool mStarted;
+
+  // The keyring being walked and its item ids
+  nsCString mKeyring;
+  GList *mIds;
+  GList *mNextId;
+  PRBool mDone;
+
+  // LoginMetadata* of the last chunk, handed out from mBufferPos
+  GPtrArray *mBuffer;
+  guint mBufferPos;
+};
+
+#endif /* LoginEnumerator_h__ */
@@ -0,0 +1,597 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "MetadataSnapshot.h"
+#include "GnomeKeyring.h"
+#include "KeyringThread.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char kMagic[8] = { 'G', 'K', 'S', 'N', 'A', 'P', 0, 0 };
+static const PRUint32 kVersion = 1;
+
+struct SnapshotHeader
+{
+  char magic[8];
+  PRUint32 version;
+  PRUint32 reserved;
+  PRUint64 scope;
+  PRUint64 stamp;
+};
+
+/* Records are padded to 4 bytes. A login record is the item id followed
+ * by the keyring and the six attributes, a removal is the item id, the
+ * keyring and the hostname, a host record is the host alone. Each string
+ * is a byte telling whether it is set, then the NUL terminated value. */
+struct RecordHeader
+{
+  PRUint16 type;
+  PRUint16 flags;
+  // Of the whole record, header included
+  PRUint32 length;
+};
+
+enum RecordType {
+  kAddLogin = 1,
+  kRemoveLogin,
+  kDisableHost,
+  kEnableHost
+};
+
+// Flag of kAddLogin records
+static const PRUint16 kTagged = 1;
+
+// Records appended beyond the live ones before the file is rewritten
+static const PRUint32 kCompactSlack = 1024;
+
+static const PRUint32 kLoginFields = 6;
+
+static void
+appendString(GByteArray *aRecord, const char *aValue)
+{
+  guint8 present = aValue != NULL;
+
+  g_byte_array_append(aRecord, &present, 1);
+  if (aValue)
+    g_byte_array_append(aRecord, (const guint8 *) aValue, strlen(aValue) + 1);
+}
+
+static GByteArray *
+newRecord(RecordType aType, PRUint16 aFlags)
+{
+  RecordHeader header = { aType, aFlags, 0 };
+  GByteArray *record = g_byte_array_new();
+
+  g_byte_array_append(record, (const guint8 *) &header, sizeof(header));
+  return record;
+}
+
+// Pad aRecord and fill in its length
+static void
+finishRecord(GByteArray *aRecord)
+{
+  static const guint8 zeros[4] = { 0, 0, 0, 0 };
+
+  if (aRecord->len % 4)
+    g_byte_array_append(aRecord, zeros, 4 - aRecord->len % 4);
+  reinterpret_cast<RecordHeader *>(aRecord->data)->length = aRecord->len;
+}
+
+static void
+encodeLogin(GByteArray *aRecord, LoginMetadata *aEntry)
+{
+  guint32 itemId = aEntry->itemId;
+
+  g_byte_array_append(aRecord, (const guint8 *) &itemId, sizeof(itemId));
+  appendString(aRecord, aEntry->keyring);
+  appendString(aRecord, aEntry->hostname);
+  appendString(aRecord, aEntry->formSubmitURL);
+  appendString(aRecord, aEntry->httpRealm);
+  appendString(aRecord, aEntry->username);
+  appendString(aRecord, aEntry->usernameField);
+  appendString(aRecord, aEntry->passwordField);
+}
+
+// Bounds checked reading of a mapped record
+class RecordReader
+{
+public:
+  RecordReader(const char *aData, PRUint32 aLength)
+    : mData(aData), mEnd(aData + aLength), mValid(PR_TRUE) { }
+
+  PRBool IsValid() { return mValid; }
+
+  guint32 ReadId()
+  {
+    guint32 id = 0;
+    if (mEnd - mData < (ptrdiff_t) sizeof(id)) {
+      mValid = PR_FALSE;
+      return 0;
+    }
+    memcpy(&id, mData, sizeof(id));
+    mData += sizeof(id);
+    return id;
+  }
+
+  const char *ReadString()
+  {
+    if (mData >= mEnd) {
+      mValid = PR_FALSE;
+      return NULL;
+    }
+    if (!*mData++)
+      return NULL;
+
+    const char *end =
+      static_cast<const char *>(memchr(mData, '\0', mEnd - mData));
+    if (!end) {
+      mValid = PR_FALSE;
+      return NULL;
+    }
+    const char *value = mData;
+    mData = end + 1;
+    return value;
+  }
+
+private:
+  const char *mData;
+  const char *mEnd;
+  PRBool mValid;
+};
+
+/* Queued on the keyring thread after changes, so that a burst of them
+ * costs a single stamp. The snapshot belongs to the storage, which shuts
+ * the keyring thread down, running the pending tasks, before it goes
+ * away. */
+class SnapshotFlushTask : public KeyringTask
+{
+public:
+  SnapshotFlushTask(MetadataSnapshot *aSnapshot) : mSnapshot(aSnapshot) { }
+
+  nsresult Execute()
+  {
+    mSnapshot->Flush();
+    return NS_OK;
+  }
+
+private:
+  MetadataSnapshot *mSnapshot;
+};
+
+MetadataSnapshot::MetadataSnapshot()
+  : mScope(0),
+    mIndex(NULL),
+    mHosts(NULL),
+    mStampFunc(NULL),
+    mFd(-1),
+    mStamp(0),
+    mItems(0),
+    mItemsKnown(PR_FALSE),
+    mItemDelta(0),
+    mEnd(0),
+    mRecords(0),
+    mLive(0),
+    mFlushPending(PR_FALSE)
+{
+}
+
+MetadataSnapshot::~MetadataSnapshot()
+{
+  close();
+}
+
+void
+MetadataSnapshot::Init(const nsACString &aPath, PRUint64 aScope,
+                       LoginIndex *aIndex, DisabledHostSet *aHosts,
+                       StampFunc aStamp)
+{
+  mPath = aPath;
+  mScope = aScope;
+  mIndex = aIndex;
+  mHosts = aHosts;
+  mStampFunc = aStamp;
+}
+
+void
+MetadataSnapshot::close()
+{
+  if (mFd >= 0)
+    ::close(mFd);
+  mFd = -1;
+}
+
+nsresult
+MetadataSnapshot::Load()
+{
+  if (!IsEnabled())
+    return NS_ERROR_NOT_AVAILABLE;
+
+  mItemsKnown = PR_FALSE;
+
+  int fd = open(mPath.get(), O_RDWR);
+  if (fd < 0)
+    return NS_ERROR_FILE_NOT_FOUND;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(SnapshotHeader) ||
+      st.st_size > G_MAXUINT32) {
+    ::close(fd);
+    return NS_ERROR_FILE_CORRUPTED;
+  }
+
+  PRUint32 size = st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    ::close(fd);
+    return NS_ERROR_FAILURE;
+  }
+
+  const char *data = static_cast<const char *>(map);
+  const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader *>(data);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) ||
+      header->version != kVersion || header->scope != mScope) {
+    munmap(map, size);
+    ::close(fd);
+    return NS_ERROR_FILE_CORRUPTED;
+  }
+
+  PRUint32 offset = sizeof(SnapshotHeader);
+  PRUint32 records = 0;
+  PRBool valid = PR_TRUE;
+  while (valid && offset < size) {
+    const RecordHeader *record =
+      reinterpret_cast<const RecordHeader *>(data + offset);
+    if (size - offset < sizeof(RecordHeader) ||
+        record->length < sizeof(RecordHeader) ||
+        record->length % 4 || record->length > size - offset) {
+      valid = PR_FALSE;
+      break;
+    }
+
+    RecordReader reader(data + offset + sizeof(RecordHeader),
+                        record->length - sizeof(RecordHeader));
+    switch (record->type) {
+      case kAddLogin: {
+        guint32 itemId = reader.ReadId();
+        const char *keyring = reader.ReadString();
+        const char *values[kLoginFields];
+        for (PRUint32 i = 0; i < kLoginFields; i++)
+          values[i] = reader.ReadString();
+        if (reader.IsValid() && keyring && values[0])
+          mIndex->Add(new LoginMetadata(keyring, itemId, values,
+                                        record->flags & kTagged));
+        else
+          valid = PR_FALSE;
+        break;
+      }
+      case kRemoveLogin: {
+        guint32 itemId = reader.ReadId();
+        const char *keyring = reader.ReadString();
+        const char *hostname = reader.ReadString();
+        if (reader.IsValid() && keyring)
+          mIndex->Remove(hostname, keyring, itemId);
+        else
+          valid = PR_FALSE;
+        break;
+      }
+      case kDisableHost:
+      case kEnableHost: {
+        const char *host = reader.ReadString();
+        if (!reader.IsValid() || !host)
+          valid = PR_FALSE;
+        else if (record->type == kDisableHost)
+          mHosts->Add(host);
+        else
+          mHosts->Remove(host);
+        break;
+      }
+      default:
+        valid = PR_FALSE;
+    }
+    offset += record->length;
+    records++;
+  }
+
+  mStamp = header->stamp;
+  munmap(map, size);
+
+  if (!valid) {
+    ::close(fd);
+    GK_LOG(("Snapshot %s is damaged\n", mPath.get()));
+    return NS_ERROR_FILE_CORRUPTED;
+  }
+
+  close();
+  mFd = fd;
+  mEnd = size;
+  mRecords = records;
+  mLive = mIndex->Count() + mHosts->Count();
+  GK_LOG(("Snapshot loaded, %u records\n", records));
+  return NS_OK;
+}
+
+struct RewriteState
+{
+  GByteArray *buffer;
+  PRUint32 records;
+};
+
+static void
+encodeEntry(LoginMetadata *aEntry, void *aData)
+{
+  RewriteState *state = static_cast<RewriteState *>(aData);
+  GByteArray *record = newRecord(kAddLogin, aEntry->tagged ? kTagged : 0);
+
+  encodeLogin(record, aEntry);
+  finishRecord(record);
+  g_byte_array_append(state->buffer, record->data, record->len);
+  g_byte_array_free(record, TRUE);
+  state->records++;
+}
+
+nsresult
+MetadataSnapshot::Rewrite()
+{
+  if (!IsEnabled())
+    return NS_OK;
+
+  PRUint64 stamp;
+  PRUint32 items;
+  nsresult rv = mStampFunc(&stamp, &items);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SnapshotHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.reserved = 0;
+  header.scope = mScope;
+  header.stamp = stamp;
+
+  RewriteState state = { g_byte_array_new(), 0 };
+  g_byte_array_append(state.buffer, (const guint8 *) &header, sizeof(header));
+  mIndex->ForEach(encodeEntry, &state);
+
+  GPtrArray *hosts = g_ptr_array_new();
+  mHosts->CollectAll(hosts);
+  for (guint i = 0; i < hosts->len; i++) {
+    char *host = static_cast<char *>(g_ptr_array_index(hosts, i));
+    GByteArray *record = newRecord(kDisableHost, 0);
+    appendString(record, host);
+    finishRecord(record);
+    g_byte_array_append(state.buffer, record->data, record->len);
+    g_byte_array_free(record, TRUE);
+    g_free(host);
+    state.records++;
+  }
+  g_ptr_array_free(hosts, TRUE);
+
+  // Written aside and renamed over, so that a crash leaves either file
+  nsCString temp(mPath);
+  temp.AppendLiteral(".tmp");
+  int fd = open(temp.get(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  PRBool written = fd >= 0;
+  for (guint done = 0; written && done < state.buffer->len; ) {
+    ssize_t n = write(fd, state.buffer->data + done,
+                      state.buffer->len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      written = PR_FALSE;
+    else
+      done += n;
+  }
+  if (written)
+    written = rename(temp.get(), mPath.get()) == 0;
+
+  PRUint32 size = state.buffer->len;
+  g_byte_array_free(state.buffer, TRUE);
+  close();
+
+  if (!written) {
+    if (fd >= 0) {
+      ::close(fd);
+      unlink(temp.get());
+    }
+    NS_WARNING("Can't write the metadata snapshot");
+    return NS_ERROR_FAILURE;
+  }
+
+  mFd = fd;
+  mStamp = stamp;
+  mItems = items;
+  mItemsKnown = PR_TRUE;
+  mItemDelta = 0;
+  mEnd = size;
+  mRecords = state.records;
+  mLive = state.records;
+  GK_LOG(("Snapshot written, %u records, %u bytes\n", mRecords, size));
+  return NS_OK;
+}
+
+void
+MetadataSnapshot::append(GByteArray *aRecord)
+{
+  finishRecord(aRecord);
+
+  if (mFd >= 0) {
+    ssize_t n = pwrite(mFd, aRecord->data, aRecord->len, mEnd);
+    if (n == (ssize_t) aRecord->len) {
+      mEnd += n;
+      mRecords++;
+    } else {
+      // The file can't follow anymore, drop it until the next rewrite
+      NS_WARNING("Can't append to the metadata snapshot");
+      close();
+      unlink(mPath.get());
+    }
+  }
+  g_byte_array_free(aRecord, TRUE);
+  changed();
+}
+
+/* The stamp of the file is left as it was until the queued Flush, so a
+ * crash in between makes the next start reload from the daemon. */
+void
+MetadataSnapshot::changed()
+{
+  if (mFlushPending)
+    return;
+  mFlushPending = PR_TRUE;
+  KeyringThread::RunAsync(new SnapshotFlushTask(this));
+}
+
+void
+MetadataSnapshot::LoginAdded(LoginMetadata *aEntry)
+{
+  if (!IsEnabled())
+    return;
+
+  GByteArray *record = newRecord(kAddLogin, aEntry->tagged ? kTagged : 0);
+  encodeLogin(record, aEntry);
+  mLive++;
+  append(record);
+}
+
+void
+MetadataSnapshot::LoginRemoved(LoginMetadata *aEntry)
+{
+  if (!IsEnabled())
+    return;
+
+  GByteArray *record = newRecord(kRemoveLogin, 0);
+  guint32 itemId = aEntry->itemId;
+  g_byte_array_append(record, (const guint8 *) &itemId, sizeof(itemId));
+  appendString(record, aEntry->keyring);
+  appendString(record, aEntry->hostname);
+  if (mLive)
+    mLive--;
+  append(record);
+}
+
+void
+MetadataSnapshot::HostChanged(const char *aHost, PRBool aDisabled)
+{
+  if (!IsEnabled())
+    return;
+
+  GByteArray *record = newRecord(aDisabled ? kDisableHost : kEnableHost, 0);
+  appendString(record, aHost);
+  if (aDisabled)
+    mLive++;
+  else if (mLive)
+    mLive--;
+  append(record);
+}
+
+PRBool
+MetadataSnapshot::IsCurrent()
+{
+  PRUint64 stamp;
+  PRUint32 items;
+  if (NS_FAILED(mStampFunc(&stamp, &items)) || stamp != mStamp)
+    return PR_FALSE;
+
+  mItems = items;
+  mItemsKnown = PR_TRUE;
+  mItemDelta = 0;
+  return PR_TRUE;
+}
+
+nsresult
+MetadataSnapshot::writeStamp(PRUint64 aStamp, PRUint32 aItems)
+{
+  if (mFd < 0)
+    return NS_ERROR_NOT_AVAILABLE;
+
+  ssize_t n = pwrite(mFd, &aStamp, sizeof(aStamp),
+                     offsetof(SnapshotHeader, stamp));
+  NS_ENSURE_TRUE(n == sizeof(aStamp), NS_ERROR_FAILURE);
+  mStamp = aStamp;
+  mItems = aItems;
+  mItemDelta = 0;
+  return NS_OK;
+}
+
+/* The keyrings changed in a way the records don't account for. The next
+ * lookup reads the index and the hosts from the daemon, and writes the
+ * file again from those. */
+void
+MetadataSnapshot::drop()
+{
+  GK_LOG(("Keyrings changed behind the snapshot, dropping it\n"));
+  close();
+  unlink(mPath.get());
+  mItemsKnown = PR_FALSE;
+  mIndex->Invalidate();
+  mHosts->Invalidate();
+}
+
+void
+MetadataSnapshot::Flush()
+{
+  mFlushPending = PR_FALSE;
+
+  if (!mItemsKnown) {
+    drop();
+    return;
+  }
+
+  PRUint64 stamp;
+  PRUint32 items;
+  if (NS_FAILED(mStampFunc(&stamp, &items)))
+    return;
+
+  // Checked first, a Rewrite would stamp the changes of others too
+  if (items != mItems + mItemDelta) {
+    GK_LOG(("%u items where %u were expected\n", items,
+            mItems + mItemDelta));
+    drop();
+    return;
+  }
+
+  if (mFd < 0 || mRecords > 2 * mLive + kCompactSlack)
+    Rewrite();
+  else
+    writeStamp(stamp, items);
+}
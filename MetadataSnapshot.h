@@ -0,0 +1,128 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef MetadataSnapshot_h__
+#define MetadataSnapshot_h__
+
+#include "nsStringAPI.h"
+#include <glib.h>
+
+class LoginIndex;
+class DisabledHostSet;
+struct LoginMetadata;
+
+/* On-disk copy of the login index and the disabled hosts, kept in the
+ * profile so that the first lookups after a restart don't wait for the
+ * daemon. It holds no secret. The file is a header followed by records:
+ * the first write stores one record per login and disabled host, later
+ * changes are appended as records of their own and replayed on load. It
+ * is rewritten from scratch once the appended records outnumber the live
+ * ones.
+ *
+ * The header holds a stamp of the keyring state the file reflects, see
+ * computeKeyringStamp, and a hash of the settings that decide which items
+ * are ours. Everything happens on the keyring thread.
+ *
+ * The stamp covers the item count of the keyrings. A Flush only stamps
+ * the file with the new state when the count moved by what ItemsChanged
+ * was told, that is by the changes the appended records hold; any other
+ * change drops the file and the in-memory state, so that they are read
+ * from the daemon again.
+ */
+class MetadataSnapshot
+{
+public:
+  // aItems is the number of items the stamp covers
+  typedef nsresult (*StampFunc)(PRUint64 *aStamp, PRUint32 *aItems);
+
+  MetadataSnapshot();
+  ~MetadataSnapshot();
+
+  // Without a path, all the other methods do nothing
+  void Init(const nsACString &aPath, PRUint64 aScope,
+            LoginIndex *aIndex, DisabledHostSet *aHosts, StampFunc aStamp);
+  PRBool IsEnabled() { return !mPath.IsEmpty(); }
+
+  /* Fill the index and the disabled hosts from the file. It fails when
+   * the file is missing, damaged or written for other settings. The
+   * caller checks IsCurrent() before using what it read. */
+  nsresult Load();
+  // Whether the keyrings are still in the state of the stamp of the file
+  PRBool IsCurrent();
+
+  // Replace the file with the current index and disabled hosts
+  nsresult Rewrite();
+
+  // Changes made after the index and the hosts were loaded
+  void LoginAdded(LoginMetadata *aEntry);
+  void LoginRemoved(LoginMetadata *aEntry);
+  void HostChanged(const char *aHost, PRBool aDisabled);
+  // Items added, or removed when negative, in the keyrings of the stamp
+  void ItemsChanged(PRInt32 aDelta) { mItemDelta += aDelta; }
+
+  // Refresh the stamp after changes, or compact the file
+  void Flush();
+
+private:
+  void append(GByteArray *aRecord);
+  void changed();
+  nsresult writeStamp(PRUint64 aStamp, PRUint32 aItems);
+  void drop();
+  void close();
+
+  nsCString mPath;
+  PRUint64 mScope;
+  LoginIndex *mIndex;
+  DisabledHostSet *mHosts;
+  StampFunc mStampFunc;
+
+  int mFd;
+  PRUint64 mStamp;
+  // Items covered by mStamp, unknown right after Load
+  PRUint32 mItems;
+  PRBool mItemsKnown;
+  // What ItemsChanged was told since mStamp was taken
+  PRInt32 mItemDelta;
+  // End of the file, where records are appended
+  PRUint32 mEnd;
+  PRUint32 mRecords;
+  PRUint32 mLive;
+  // Whether a Flush is queued
+  PRBool mFlushPending;
+};
+
+#endif /* MetadataSnapshot_h__ */
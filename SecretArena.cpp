@@ -0,0 +1,274 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "SecretArena.h"
+#include "StringConversion.h"
+#include "GnomeKeyring.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+extern "C" {
+#include <glib.h>
+}
+
+/* Every block starts with its header. The size classes are powers of two
+ * from 32 to 4096 bytes, header included; bigger secrets get pages of
+ * their own. */
+struct SecretArena::Block
+{
+  PRUint32 size;
+  // Whether mlock succeeded, for the blocks with pages of their own
+  PRUint32 locked;
+  Block *next;
+};
+
+static const PRUint32 kClasses = 8;
+static const PRUint32 kMinBlock = 32;
+static const PRUint32 kMaxBlock = kMinBlock << (kClasses - 1);
+static const PRUint32 kRegionSize = 64 * 1024;
+
+// The arena is used from the calling threads and the keyring thread
+G_LOCK_DEFINE_STATIC(arena);
+
+SecretArena::Block *SecretArena::sFree[kClasses];
+char *SecretArena::sRegion = NULL;
+PRUint32 SecretArena::sRegionLeft = 0;
+PRUint32 SecretArena::sLocked = 0;
+
+// A memset the compiler can't drop
+static void
+wipe(void *aData, PRUint32 aLength)
+{
+  volatile char *p = static_cast<volatile char*>(aData);
+  while (aLength--)
+    *p++ = 0;
+}
+
+char *
+SecretArena::mapLocked(PRUint32 aSize, PRBool *aLocked)
+{
+  void *pages = mmap(NULL, aSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED)
+    return NULL;
+
+  // Over RLIMIT_MEMLOCK the pages still work, they just may be swapped
+  *aLocked = mlock(pages, aSize) == 0;
+  if (*aLocked)
+    sLocked += aSize;
+  else
+    GK_LOG(("Can't lock %u bytes of secret memory\n", aSize));
+  return static_cast<char*>(pages);
+}
+
+PRBool
+SecretArena::refill(PRUint32 aClass)
+{
+  PRUint32 blockSize = kMinBlock << aClass;
+
+  if (sRegionLeft < blockSize) {
+    // The rest of the old region is too small for this class, leave it
+    PRBool locked;
+    sRegion = mapLocked(kRegionSize, &locked);
+    if (!sRegion) {
+      sRegionLeft = 0;
+      return PR_FALSE;
+    }
+    sRegionLeft = kRegionSize;
+  }
+
+  // Carve a page, or what's left of the region, into blocks
+  PRUint32 carve = MIN(sRegionLeft, kMaxBlock);
+  for (PRUint32 used = 0; used + blockSize <= carve; used += blockSize) {
+    Block *block = reinterpret_cast<Block*>(sRegion + used);
+    block->size = blockSize;
+    block->next = sFree[aClass];
+    sFree[aClass] = block;
+  }
+  sRegion += carve;
+  sRegionLeft -= carve;
+  return PR_TRUE;
+}
+
+char *
+SecretArena::allocLarge(PRUint32 aSize)
+{
+  PRUint32 pageSize = getpagesize();
+  PRUint32 size = (aSize + pageSize - 1) / pageSize * pageSize;
+
+  PRBool locked;
+  G_LOCK(arena);
+  Block *block = reinterpret_cast<Block*>(mapLocked(size, &locked));
+  G_UNLOCK(arena);
+  if (!block)
+    return NULL;
+  block->size = size;
+  block->locked = locked;
+  return reinterpret_cast<char*>(block + 1);
+}
+
+char *
+SecretArena::Alloc(PRUint32 aSize)
+{
+  PRUint32 needed = aSize + sizeof(Block);
+  if (needed > kMaxBlock)
+    return allocLarge(needed);
+
+  PRUint32 aClass = 0;
+  while ((kMinBlock << aClass) < needed)
+    aClass++;
+
+  G_LOCK(arena);
+  Block *block = sFree[aClass];
+  if (!block && refill(aClass))
+    block = sFree[aClass];
+  if (block)
+    sFree[aClass] = block->next;
+  G_UNLOCK(arena);
+
+  // Past the header, free blocks are already wiped
+  return block ? reinterpret_cast<char*>(block + 1) : NULL;
+}
+
+void
+SecretArena::Free(char *aData)
+{
+  if (!aData)
+    return;
+
+  Block *block = reinterpret_cast<Block*>(aData) - 1;
+  PRUint32 size = block->size;
+  wipe(aData, size - sizeof(Block));
+
+  if (size > kMaxBlock) {
+    G_LOCK(arena);
+    if (block->locked)
+      sLocked -= size;
+    G_UNLOCK(arena);
+    munlock(block, size);
+    munmap(block, size);
+    return;
+  }
+
+  PRUint32 aClass = 0;
+  while ((kMinBlock << aClass) < size)
+    aClass++;
+
+  G_LOCK(arena);
+  block->next = sFree[aClass];
+  sFree[aClass] = block;
+  G_UNLOCK(arena);
+}
+
+void
+SecretArena::Wipe(nsAString &aString)
+{
+  PRUnichar *data;
+  PRUint32 length = aString.GetMutableData(&data);
+  wipe(data, length * sizeof(PRUnichar));
+}
+
+PRUint32
+SecretArena::LockedBytes()
+{
+  G_LOCK(arena);
+  PRUint32 locked = sLocked;
+  G_UNLOCK(arena);
+  return locked;
+}
+
+void
+SecretBuffer::Clear()
+{
+  SecretArena::Free(mData);
+  mData = NULL;
+  mLength = 0;
+}
+
+nsresult
+SecretBuffer::Assign(const char *aUTF8)
+{
+  PRUint32 length = strlen(aUTF8);
+  char *data = SecretArena::Alloc(length + 1);
+  NS_ENSURE_TRUE(data, NS_ERROR_OUT_OF_MEMORY);
+
+  memcpy(data, aUTF8, length);
+  Clear();
+  mData = data;
+  mLength = length;
+  return NS_OK;
+}
+
+nsresult
+SecretBuffer::AssignUTF16(const nsAString &aString)
+{
+  const PRUnichar *source = aString.BeginReading();
+  PRUint32 sourceLength = aString.Length();
+
+  PRUint32 length = UTF8LengthOfUTF16(source, sourceLength);
+  char *data = SecretArena::Alloc(length + 1);
+  NS_ENSURE_TRUE(data, NS_ERROR_OUT_OF_MEMORY);
+
+  ConvertUTF16toUTF8(source, sourceLength, data);
+  Clear();
+  mData = data;
+  mLength = length;
+  return NS_OK;
+}
+
+void
+SecretBuffer::ToUTF16(nsAString &aDest) const
+{
+  PRUint32 length = UTF16LengthOfUTF8(get(), mLength);
+  PRUnichar *dest;
+
+  aDest.Truncate();
+  if (aDest.GetMutableData(&dest, length) != length)
+    return;
+  ConvertUTF8toUTF16(get(), mLength, dest);
+}
+
+PRBool
+SecretBuffer::EqualsUTF16(const nsAString &aString) const
+{
+  SecretBuffer other;
+  if (NS_FAILED(other.AssignUTF16(aString)))
+    return PR_FALSE;
+  return mLength == other.mLength && !memcmp(get(), other.get(), mLength);
+}
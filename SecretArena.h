@@ -0,0 +1,106 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef SecretArena_h__
+#define SecretArena_h__
+
+#include "nsStringAPI.h"
+
+/* Pool of locked memory for passwords. Pages are mmap'd and mlock'd a
+ * region at a time and split into blocks of a few size classes, so that
+ * a bulk operation costs no allocator call or syscall per secret and the
+ * secrets never reach swap. Blocks are wiped when given back. Like
+ * gnome_keyring_memory_*, but with the locking amortized.
+ */
+class SecretArena
+{
+public:
+  // Zero-filled block of at least aSize bytes
+  static char *Alloc(PRUint32 aSize);
+  // Wipe the block and give it back to the pool
+  static void Free(char *aBlock);
+
+  /* Overwrite the characters of aString before it goes away. Only a
+   * buffer aString owns alone gets wiped: one it shares, as a password
+   * handed out by a JS login does, is copied by GetMutableData first, and
+   * the shared characters stay around until their owner drops them. */
+  static void Wipe(nsAString &aString);
+
+  static PRUint32 LockedBytes();
+
+private:
+  struct Block;
+
+  static char *allocLarge(PRUint32 aSize);
+  static PRBool refill(PRUint32 aClass);
+  static char *mapLocked(PRUint32 aSize, PRBool *aLocked);
+
+  // Protected by the arena lock
+  static Block *sFree[];
+  static char *sRegion;
+  static PRUint32 sRegionLeft;
+  static PRUint32 sLocked;
+};
+
+/* A secret held in the arena, as NUL terminated UTF-8. */
+class SecretBuffer
+{
+public:
+  SecretBuffer() : mData(NULL), mLength(0) { }
+  ~SecretBuffer() { Clear(); }
+
+  void Clear();
+  nsresult Assign(const char *aUTF8);
+  nsresult AssignUTF16(const nsAString &aString);
+
+  // Append the secret to aDest, no temporary copy made
+  void ToUTF16(nsAString &aDest) const;
+  PRBool EqualsUTF16(const nsAString &aString) const;
+
+  const char *get() const { return mData ? mData : ""; }
+  PRUint32 Length() const { return mLength; }
+
+private:
+  // Not copyable, there must be one owner of the block
+  SecretBuffer(const SecretBuffer&);
+  SecretBuffer &operator=(const SecretBuffer&);
+
+  char *mData;
+  PRUint32 mLength;
+};
+
+#endif /* SecretArena_h__ */
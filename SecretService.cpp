@@ -0,0 +1,421 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "SecretService.h"
+#include "GnomeKeyring.h"
+#include "KeyringStats.h"
+
+#include <string.h>
+#include <gcrypt.h>
+
+static const char kServiceName[] = "org.freedesktop.secrets";
+static const char kServicePath[] = "/org/freedesktop/secrets";
+static const char kServiceInterface[] = "org.freedesktop.Secret.Service";
+static const char kItemInterface[] = "org.freedesktop.Secret.Item";
+static const char kPropertiesInterface[] = "org.freedesktop.DBus.Properties";
+static const char kCollectionPrefix[] = "/org/freedesktop/secrets/collection/";
+
+// Milliseconds; unlocking isn't done here, so no call waits for the user
+static const gint kCallTimeout = 25000;
+
+static const char kAlgorithm[] = "dh-ietf1024-sha256-aes128-cbc-pkcs7";
+// The 1024 bit MODP group of RFC 2409, with 2 as generator
+static const char kPrime[] =
+  "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1"
+  "29024E088A67CC74020BBEA63B139B22514A08798E3404DD"
+  "EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245"
+  "E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+  "EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE65381"
+  "FFFFFFFFFFFFFFFF";
+static const PRUint32 kPrimeBytes = 128;
+static const PRUint32 kKeyBytes = 16;
+static const PRUint32 kBlockBytes = 16;
+
+SecretService::SecretService()
+  : mConnection(NULL),
+    mKey(NULL)
+{
+}
+
+SecretService::~SecretService()
+{
+  Close();
+}
+
+nsresult
+SecretService::Open()
+{
+  if (mConnection)
+    return NS_OK;
+
+  GError *error = NULL;
+  mConnection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+  if (!mConnection) {
+    GK_LOG(("No session bus for the Secret Service: %s\n", error->message));
+    g_error_free(error);
+    return NS_ERROR_NOT_AVAILABLE;
+  }
+
+  nsresult rv = negotiate();
+  if (NS_FAILED(rv)) {
+    Close();
+    return NS_ERROR_NOT_AVAILABLE;
+  }
+  GK_LOG(("Secret Service session %s\n", mSession.get()));
+  return NS_OK;
+}
+
+// HKDF of RFC 5869 with SHA-256, no salt and no info, as the daemon does
+static nsresult
+deriveKey(const unsigned char *aSecret, PRUint32 aLength, char *aKey)
+{
+  unsigned char zeros[32];
+  memset(zeros, 0, sizeof(zeros));
+
+  gcry_md_hd_t md;
+  gcry_error_t err = gcry_md_open(&md, GCRY_MD_SHA256,
+                                  GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+  NS_ENSURE_TRUE(!err, NS_ERROR_FAILURE);
+
+  // Extract, then the first block of the expansion is enough for the key
+  unsigned char prk[32];
+  gcry_md_setkey(md, zeros, sizeof(zeros));
+  gcry_md_write(md, aSecret, aLength);
+  memcpy(prk, gcry_md_read(md, 0), sizeof(prk));
+
+  gcry_md_reset(md);
+  gcry_md_setkey(md, prk, sizeof(prk));
+  gcry_md_putc(md, 1);
+  memcpy(aKey, gcry_md_read(md, 0), kKeyBytes);
+
+  gcry_md_close(md);
+  memset(prk, 0, sizeof(prk));
+  return NS_OK;
+}
+
+/* Diffie-Hellman over the group of kPrime: our public key goes out with
+ * OpenSession, the daemon's comes back, and the AES key is derived from
+ * the shared secret. */
+nsresult
+SecretService::negotiate()
+{
+  if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+    gcry_check_version(NULL);
+    gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+  }
+
+  gcry_mpi_t prime = NULL, base, priv, pub, peer = NULL;
+  gcry_mpi_scan(&prime, GCRYMPI_FMT_HEX, kPrime, 0, NULL);
+  base = gcry_mpi_set_ui(NULL, 2);
+  priv = gcry_mpi_snew(kPrimeBytes * 8);
+  gcry_mpi_randomize(priv, kPrimeBytes * 8, GCRY_STRONG_RANDOM);
+  pub = gcry_mpi_new(kPrimeBytes * 8);
+  gcry_mpi_powm(pub, base, priv, prime);
+
+  unsigned char pubBytes[kPrimeBytes];
+  size_t pubLength = 0;
+  gcry_mpi_print(GCRYMPI_FMT_USG, pubBytes, sizeof(pubBytes), &pubLength,
+                 pub);
+
+  nsresult rv = NS_ERROR_FAILURE;
+  GVariant *reply = call(kServicePath, kServiceInterface, "OpenSession",
+                         g_variant_new("(sv)", kAlgorithm,
+                                       g_variant_new_fixed_array(
+                                         G_VARIANT_TYPE_BYTE, pubBytes,
+                                         pubLength, 1)),
+                         "(vo)");
+  if (reply) {
+    GVariant *output;
+    const gchar *session;
+    g_variant_get(reply, "(v&o)", &output, &session);
+    mSession.Assign(session);
+
+    gsize peerLength = 0;
+    const void *peerBytes = NULL;
+    if (g_variant_is_of_type(output, G_VARIANT_TYPE("ay")))
+      peerBytes = g_variant_get_fixed_array(output, &peerLength, 1);
+    if (peerBytes && peerLength <= kPrimeBytes)
+      gcry_mpi_scan(&peer, GCRYMPI_FMT_USG, peerBytes, peerLength, NULL);
+    g_variant_unref(output);
+    g_variant_unref(reply);
+  }
+
+  // 1 < peer < prime - 1, anything else gives away the secret
+  gcry_mpi_t limit = gcry_mpi_new(0);
+  gcry_mpi_sub_ui(limit, prime, 1);
+  if (peer && gcry_mpi_cmp_ui(peer, 1) > 0 && gcry_mpi_cmp(peer, limit) < 0) {
+    gcry_mpi_t shared = gcry_mpi_snew(kPrimeBytes * 8);
+    gcry_mpi_powm(shared, peer, priv, prime);
+
+    // Padded to the size of the prime, like the daemon does
+    unsigned char *secret =
+      reinterpret_cast<unsigned char*>(SecretArena::Alloc(kPrimeBytes));
+    size_t length = 0;
+    if (secret && !gcry_mpi_print(GCRYMPI_FMT_USG, secret, kPrimeBytes,
+                                  &length, shared)) {
+      memmove(secret + kPrimeBytes - length, secret, length);
+      memset(secret, 0, kPrimeBytes - length);
+      mKey = SecretArena::Alloc(kKeyBytes);
+      if (mKey)
+        rv = deriveKey(secret, kPrimeBytes, mKey);
+    }
+    SecretArena::Free(reinterpret_cast<char*>(secret));
+    gcry_mpi_release(shared);
+  } else if (reply) {
+    GK_LOG(("The Secret Service sent no usable public key\n"));
+  }
+
+  gcry_mpi_release(limit);
+  gcry_mpi_release(peer);
+  gcry_mpi_release(pub);
+  gcry_mpi_release(priv);
+  gcry_mpi_release(base);
+  gcry_mpi_release(prime);
+  return rv;
+}
+
+nsresult
+SecretService::decrypt(GVariant *aSecret, SecretBuffer &aResult)
+{
+  GVariant *parameters = g_variant_get_child_value(aSecret, 1);
+  GVariant *value = g_variant_get_child_value(aSecret, 2);
+  gsize ivLength, length;
+  const void *iv = g_variant_get_fixed_array(parameters, &ivLength, 1);
+  const void *data = g_variant_get_fixed_array(value, &length, 1);
+
+  nsresult rv = NS_ERROR_FAILURE;
+  char *plain = NULL;
+  gcry_cipher_hd_t cipher = NULL;
+  if (ivLength == kBlockBytes && length > 0 && length % kBlockBytes == 0 &&
+      !gcry_cipher_open(&cipher, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CBC,
+                        GCRY_CIPHER_SECURE) &&
+      !gcry_cipher_setkey(cipher, mKey, kKeyBytes) &&
+      !gcry_cipher_setiv(cipher, iv, ivLength) &&
+      (plain = SecretArena::Alloc(length + 1)) &&
+      !gcry_cipher_decrypt(cipher, plain, length, data, length)) {
+    // PKCS#7 padding, then the arena block ends the string
+    PRUint32 padding = static_cast<unsigned char>(plain[length - 1]);
+    PRBool valid = padding > 0 && padding <= kBlockBytes;
+    for (PRUint32 i = 1; valid && i <= padding; i++)
+      valid = static_cast<unsigned char>(plain[length - i]) == padding;
+    if (valid) {
+      memset(plain + length - padding, 0, padding);
+      rv = aResult.Assign(plain);
+    }
+  }
+
+  if (cipher)
+    gcry_cipher_close(cipher);
+  SecretArena::Free(plain);
+  g_variant_unref(value);
+  g_variant_unref(parameters);
+  return rv;
+}
+
+void
+SecretService::Close()
+{
+  if (!mConnection)
+    return;
+
+  if (!mSession.IsEmpty()) {
+    GVariant *reply = call(mSession.get(), "org.freedesktop.Secret.Session",
+                           "Close", NULL, NULL);
+    if (reply)
+      g_variant_unref(reply);
+    mSession.Truncate();
+  }
+  SecretArena::Free(mKey);
+  mKey = NULL;
+  g_object_unref(mConnection);
+  mConnection = NULL;
+}
+
+GVariant *
+SecretService::call(const char *aPath, const char *aInterface,
+                    const char *aMethod, GVariant *aParameters,
+                    const char *aReplyType)
+{
+  KeyringStats::Count(KeyringStats::kKeyringCalls);
+  GError *error = NULL;
+  GVariant *reply = g_dbus_connection_call_sync(
+                      mConnection, kServiceName, aPath, aInterface, aMethod,
+                      aParameters,
+                      aReplyType ? G_VARIANT_TYPE(aReplyType) : NULL,
+                      G_DBUS_CALL_FLAGS_NONE, kCallTimeout, NULL, &error);
+  if (!reply) {
+    GK_LOG(("%s.%s failed: %s\n", aInterface, aMethod, error->message));
+    g_error_free(error);
+  }
+  return reply;
+}
+
+nsresult
+SecretService::SearchItems(GnomeKeyringAttributeList *aAttributes,
+                           GPtrArray *aPaths)
+{
+  GVariantBuilder query;
+  g_variant_builder_init(&query, G_VARIANT_TYPE("a{ss}"));
+
+  GnomeKeyringAttribute *attrArray =
+    (GnomeKeyringAttribute *)aAttributes->data;
+  for (PRUint32 i = 0; i < aAttributes->len; i++) {
+    if (attrArray[i].type == GNOME_KEYRING_ATTRIBUTE_TYPE_STRING)
+      g_variant_builder_add(&query, "{ss}", attrArray[i].name,
+                            attrArray[i].value.string);
+  }
+
+  GVariant *reply = call(kServicePath, kServiceInterface, "SearchItems",
+                         g_variant_new("(a{ss})", &query), "(aoao)");
+  NS_ENSURE_TRUE(reply, NS_ERROR_FAILURE);
+
+  GVariantIter *unlocked;
+  const gchar *path;
+  g_variant_get(reply, "(aoao)", &unlocked, NULL);
+  while (g_variant_iter_next(unlocked, "&o", &path))
+    g_ptr_array_add(aPaths, g_strdup(path));
+  g_variant_iter_free(unlocked);
+  g_variant_unref(reply);
+  return NS_OK;
+}
+
+nsresult
+SecretService::GetAttributes(const char *aPath,
+                             GnomeKeyringAttributeList **aAttributes)
+{
+  GVariant *reply = call(aPath, kPropertiesInterface, "Get",
+                         g_variant_new("(ss)", kItemInterface, "Attributes"),
+                         "(v)");
+  NS_ENSURE_TRUE(reply, NS_ERROR_FAILURE);
+
+  GVariant *value;
+  g_variant_get(reply, "(v)", &value);
+
+  GnomeKeyringAttributeList *attributes = gnome_keyring_attribute_list_new();
+  GVariantIter *iter = g_variant_iter_new(value);
+  const gchar *name, *string;
+  while (g_variant_iter_next(iter, "{&s&s}", &name, &string))
+    gnome_keyring_attribute_list_append_string(attributes, name, string);
+  g_variant_iter_free(iter);
+  g_variant_unref(value);
+  g_variant_unref(reply);
+  KeyringStats::Count(KeyringStats::kItemsReceived);
+
+  *aAttributes = attributes;
+  return NS_OK;
+}
+
+nsresult
+SecretService::GetSecrets(const char *const *aPaths, PRUint32 aCount,
+                          SecretBuffer *aSecrets, PRBool *aFound)
+{
+  for (PRUint32 i = 0; i < aCount; i++)
+    aFound[i] = PR_FALSE;
+  if (aCount == 0)
+    return NS_OK;
+
+  GVariantBuilder items;
+  g_variant_builder_init(&items, G_VARIANT_TYPE("ao"));
+  // path -> index + 1 in aPaths
+  GHashTable *positions = g_hash_table_new(g_str_hash, g_str_equal);
+  for (PRUint32 i = 0; i < aCount; i++) {
+    g_variant_builder_add(&items, "o", aPaths[i]);
+    g_hash_table_insert(positions, (gpointer) aPaths[i],
+                        GUINT_TO_POINTER(i + 1));
+  }
+
+  GVariant *reply = call(kServicePath, kServiceInterface, "GetSecrets",
+                         g_variant_new("(aoo)", &items, mSession.get()),
+                         "(a{o(oayays)})");
+  if (!reply) {
+    g_hash_table_destroy(positions);
+    return NS_ERROR_FAILURE;
+  }
+
+  GVariant *secrets = g_variant_get_child_value(reply, 0);
+  gsize count = g_variant_n_children(secrets);
+  for (gsize i = 0; i < count; i++) {
+    GVariant *entry = g_variant_get_child_value(secrets, i);
+    GVariant *key = g_variant_get_child_value(entry, 0);
+    GVariant *secret = g_variant_get_child_value(entry, 1);
+
+    PRUint32 position = GPOINTER_TO_UINT(
+      g_hash_table_lookup(positions, g_variant_get_string(key, NULL)));
+    if (position) {
+      // One that doesn't decrypt is left to be read on its own
+      SecretBuffer &result = aSecrets[position - 1];
+      aFound[position - 1] = NS_SUCCEEDED(decrypt(secret, result));
+      if (aFound[position - 1]) {
+        KeyringStats::Count(KeyringStats::kItemsReceived);
+        KeyringStats::Count(KeyringStats::kSecretBytes, result.Length());
+      } else {
+        GK_LOG(("Can't decrypt the secret of %s\n",
+                g_variant_get_string(key, NULL)));
+      }
+    }
+
+    g_variant_unref(secret);
+    g_variant_unref(key);
+    g_variant_unref(entry);
+  }
+  g_variant_unref(secrets);
+  g_variant_unref(reply);
+  g_hash_table_destroy(positions);
+  return NS_OK;
+}
+
+/* The reverse of KeyringWatcher::ParseItemPath: the characters outside
+ * [A-Za-z0-9] of the keyring name are written as _xx in hex. */
+void
+SecretService::BuildItemPath(const char *aKeyring, guint aItemId,
+                             nsACString &aPath)
+{
+  aPath.Assign(kCollectionPrefix);
+  for (const char *p = aKeyring; *p; p++) {
+    if (g_ascii_isalnum(*p)) {
+      aPath.Append(*p);
+    } else {
+      char escaped[4];
+      g_snprintf(escaped, sizeof(escaped), "_%02x", (unsigned char) *p);
+      aPath.Append(escaped);
+    }
+  }
+
+  char id[16];
+  g_snprintf(id, sizeof(id), "/%u", aItemId);
+  aPath.Append(id);
+}
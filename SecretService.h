@@ -0,0 +1,99 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef SecretService_h__
+#define SecretService_h__
+
+#include "nsStringAPI.h"
+#include "SecretArena.h"
+extern "C" {
+#include <gio/gio.h>
+#include "gnome-keyring.h"
+}
+
+/* Client of the org.freedesktop.Secret.Service API of the daemon, an
+ * alternative to libgnome-keyring for the calls where it saves round
+ * trips: GetSecrets reads the secrets of many items in one call, where
+ * libgnome-keyring needs a request per item. The connection and the
+ * session are opened on first use and kept until Close. The session is
+ * negotiated with dh-ietf1024-sha256-aes128-cbc-pkcs7, like the one of
+ * libgnome-keyring, so the secrets only cross the bus encrypted; without
+ * it Open fails and the storage keeps to libgnome-keyring.
+ *
+ * Items are named by object path; gnome-keyring-daemon uses the keyring
+ * and the libgnome-keyring item id for it, see BuildItemPath. Used from
+ * the keyring thread only.
+ */
+class SecretService
+{
+public:
+  SecretService();
+  ~SecretService();
+
+  nsresult Open();
+  void Close();
+
+  // Paths of the unlocked items whose attributes include aAttributes
+  nsresult SearchItems(GnomeKeyringAttributeList *aAttributes,
+                       GPtrArray *aPaths);
+  // The string attributes of an item, to be freed by the caller
+  nsresult GetAttributes(const char *aPath,
+                         GnomeKeyringAttributeList **aAttributes);
+  /* The secrets of aCount items, in one call. aFound[i] tells whether
+   * the secret of aPaths[i] came back; those of locked items don't. */
+  nsresult GetSecrets(const char *const *aPaths, PRUint32 aCount,
+                      SecretBuffer *aSecrets, PRBool *aFound);
+
+  static void BuildItemPath(const char *aKeyring, guint aItemId,
+                            nsACString &aPath);
+
+private:
+  nsresult negotiate();
+  // Decrypt the (oayays) aSecret into aResult
+  nsresult decrypt(GVariant *aSecret, SecretBuffer &aResult);
+
+  GVariant *call(const char *aPath, const char *aInterface,
+                 const char *aMethod, GVariant *aParameters,
+                 const char *aReplyType);
+
+  GDBusConnection *mConnection;
+  nsCString mSession;
+  // The AES key of the session, in the arena
+  char *mKey;
+};
+
+#endif /* SecretService_h__ */
@@ -0,0 +1,359 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#include "StringConversion.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(GK_NO_SIMD)
+#include <emmintrin.h>
+#define GK_SSE2 1
+#endif
+
+static const PRUnichar kReplacement = 0xFFFD;
+
+/* ASCII runs. Almost every attribute is plain ASCII, so the converters
+ * first copy the longest ASCII run they can, 16 bytes or 8 units at a
+ * time with SSE2, and only decode code points one by one after that.
+ * Each returns the length of the run it handled. */
+
+static PRUint32
+widenASCII(const char *aSource, PRUint32 aLength, PRUnichar *aDest)
+{
+  PRUint32 i = 0;
+#ifdef GK_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= aLength; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (aSource + i));
+    if (_mm_movemask_epi8(bytes))
+      break;
+    _mm_storeu_si128((__m128i *) (aDest + i), _mm_unpacklo_epi8(bytes, zero));
+    _mm_storeu_si128((__m128i *) (aDest + i + 8),
+                     _mm_unpackhi_epi8(bytes, zero));
+  }
+#endif
+  for (; i < aLength && !(aSource[i] & 0x80); i++)
+    aDest[i] = aSource[i];
+  return i;
+}
+
+static PRUint32
+narrowASCII(const PRUnichar *aSource, PRUint32 aLength, char *aDest)
+{
+  PRUint32 i = 0;
+#ifdef GK_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i nonASCII = _mm_set1_epi16((short) 0xFF80);
+  for (; i + 8 <= aLength; i += 8) {
+    __m128i units = _mm_loadu_si128((const __m128i *) (aSource + i));
+    __m128i high = _mm_and_si128(units, nonASCII);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xFFFF)
+      break;
+    _mm_storel_epi64((__m128i *) (aDest + i), _mm_packus_epi16(units, zero));
+  }
+#endif
+  for (; i < aLength && aSource[i] < 0x80; i++)
+    aDest[i] = (char) aSource[i];
+  return i;
+}
+
+static PRUint32
+scanASCII(const char *aSource, PRUint32 aLength)
+{
+  PRUint32 i = 0;
+#ifdef GK_SSE2
+  for (; i + 16 <= aLength; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (aSource + i));
+    if (_mm_movemask_epi8(bytes))
+      break;
+  }
+#endif
+  for (; i < aLength && !(aSource[i] & 0x80); i++)
+    ;
+  return i;
+}
+
+static PRUint32
+scanASCII(const PRUnichar *aSource, PRUint32 aLength)
+{
+  PRUint32 i = 0;
+#ifdef GK_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i nonASCII = _mm_set1_epi16((short) 0xFF80);
+  for (; i + 8 <= aLength; i += 8) {
+    __m128i units = _mm_loadu_si128((const __m128i *) (aSource + i));
+    __m128i high = _mm_and_si128(units, nonASCII);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xFFFF)
+      break;
+  }
+#endif
+  for (; i < aLength && aSource[i] < 0x80; i++)
+    ;
+  return i;
+}
+
+static inline PRBool
+isHighSurrogate(PRUnichar c)
+{
+  return (c & 0xFC00) == 0xD800;
+}
+
+static inline PRBool
+isLowSurrogate(PRUnichar c)
+{
+  return (c & 0xFC00) == 0xDC00;
+}
+
+/* Decode the code point starting at aSource[0]. Returns the number of
+ * bytes used, at least 1, and stores U+FFFD for invalid sequences. */
+static PRUint32
+decodeUTF8(const unsigned char *aSource, PRUint32 aLength, PRUint32 *aChar)
+{
+  unsigned char c = aSource[0];
+  PRUint32 needed, min, ch;
+
+  if (c < 0x80) {
+    *aChar = c;
+    return 1;
+  } else if ((c & 0xE0) == 0xC0) {
+    needed = 1; min = 0x80; ch = c & 0x1F;
+  } else if ((c & 0xF0) == 0xE0) {
+    needed = 2; min = 0x800; ch = c & 0x0F;
+  } else if ((c & 0xF8) == 0xF0) {
+    needed = 3; min = 0x10000; ch = c & 0x07;
+  } else {
+    *aChar = kReplacement;
+    return 1;
+  }
+
+  if (needed >= aLength) {
+    *aChar = kReplacement;
+    return 1;
+  }
+
+  for (PRUint32 i = 1; i <= needed; i++) {
+    if ((aSource[i] & 0xC0) != 0x80) {
+      *aChar = kReplacement;
+      return i;
+    }
+    ch = (ch << 6) | (aSource[i] & 0x3F);
+  }
+
+  // Overlong forms, surrogates and values past U+10FFFF
+  if (ch < min || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+    ch = kReplacement;
+  *aChar = ch;
+  return needed + 1;
+}
+
+/* Decode the code point starting at aSource[0], U+FFFD for a lone
+ * surrogate. Returns the number of units used. */
+static inline PRUint32
+decodeUTF16(const PRUnichar *aSource, PRUint32 aLength, PRUint32 *aChar)
+{
+  PRUnichar c = aSource[0];
+
+  if (isHighSurrogate(c) && aLength > 1 && isLowSurrogate(aSource[1])) {
+    *aChar = 0x10000 + ((c - 0xD800) << 10) + (aSource[1] - 0xDC00);
+    return 2;
+  }
+  if (isHighSurrogate(c) || isLowSurrogate(c))
+    *aChar = kReplacement;
+  else
+    *aChar = c;
+  return 1;
+}
+
+PRUint32
+UTF8LengthOfUTF16(const PRUnichar *aSource, PRUint32 aLength)
+{
+  PRUint32 length = 0;
+  PRUint32 i = 0;
+
+  while (i < aLength) {
+    PRUint32 run = scanASCII(aSource + i, aLength - i);
+    i += run;
+    length += run;
+    if (i == aLength)
+      break;
+
+    PRUint32 ch;
+    i += decodeUTF16(aSource + i, aLength - i, &ch);
+    length += ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+  }
+  return length;
+}
+
+PRUint32
+UTF16LengthOfUTF8(const char *aSource, PRUint32 aLength)
+{
+  const unsigned char *s = (const unsigned char *) aSource;
+  PRUint32 length = 0;
+  PRUint32 i = 0;
+
+  while (i < aLength) {
+    PRUint32 run = scanASCII(aSource + i, aLength - i);
+    i += run;
+    length += run;
+    if (i == aLength)
+      break;
+
+    PRUint32 ch;
+    i += decodeUTF8(s + i, aLength - i, &ch);
+    length += ch < 0x10000 ? 1 : 2;
+  }
+  return length;
+}
+
+char *
+ConvertUTF16toUTF8(const PRUnichar *aSource, PRUint32 aLength, char *aDest)
+{
+  PRUint32 i = 0;
+
+  while (i < aLength) {
+    PRUint32 run = narrowASCII(aSource + i, aLength - i, aDest);
+    i += run;
+    aDest += run;
+    if (i == aLength)
+      break;
+
+    PRUint32 ch;
+    i += decodeUTF16(aSource + i, aLength - i, &ch);
+
+    if (ch < 0x80) {
+      *aDest++ = (char) ch;
+    } else if (ch < 0x800) {
+      *aDest++ = (char) (0xC0 | (ch >> 6));
+      *aDest++ = (char) (0x80 | (ch & 0x3F));
+    } else if (ch < 0x10000) {
+      *aDest++ = (char) (0xE0 | (ch >> 12));
+      *aDest++ = (char) (0x80 | ((ch >> 6) & 0x3F));
+      *aDest++ = (char) (0x80 | (ch & 0x3F));
+    } else {
+      *aDest++ = (char) (0xF0 | (ch >> 18));
+      *aDest++ = (char) (0x80 | ((ch >> 12) & 0x3F));
+      *aDest++ = (char) (0x80 | ((ch >> 6) & 0x3F));
+      *aDest++ = (char) (0x80 | (ch & 0x3F));
+    }
+  }
+  return aDest;
+}
+
+PRUnichar *
+ConvertUTF8toUTF16(const char *aSource, PRUint32 aLength, PRUnichar *aDest)
+{
+  const unsigned char *s = (const unsigned char *) aSource;
+  PRUint32 i = 0;
+
+  while (i < aLength) {
+    PRUint32 run = widenASCII(aSource + i, aLength - i, aDest);
+    i += run;
+    aDest += run;
+    if (i == aLength)
+      break;
+
+    PRUint32 ch;
+    i += decodeUTF8(s + i, aLength - i, &ch);
+
+    if (ch < 0x10000) {
+      *aDest++ = (PRUnichar) ch;
+    } else {
+      ch -= 0x10000;
+      *aDest++ = (PRUnichar) (0xD800 + (ch >> 10));
+      *aDest++ = (PRUnichar) (0xDC00 + (ch & 0x3FF));
+    }
+  }
+  return aDest;
+}
+
+void
+AssignUTF8toUTF16(const char *aSource, nsAString &aDest)
+{
+  PRUint32 length = strlen(aSource);
+  PRUnichar *dest;
+
+  // A UTF-8 string never has fewer bytes than UTF-16 units
+  if (aDest.GetMutableData(&dest, length) != length)
+    return;
+  PRUnichar *end = ConvertUTF8toUTF16(aSource, length, dest);
+  aDest.SetLength(end - dest);
+}
+
+void
+AssignUTF16toUTF8(const nsAString &aSource, nsACString &aDest)
+{
+  PRUint32 length = aSource.Length();
+  char *dest;
+
+  if (aDest.GetMutableData(&dest, length * 3) != length * 3)
+    return;
+  char *end = ConvertUTF16toUTF8(aSource.BeginReading(), length, dest);
+  aDest.SetLength(end - dest);
+}
+
+UTF8Scratch::UTF8Scratch()
+  : mData(mInline),
+    mCapacity(sizeof(mInline))
+{
+}
+
+UTF8Scratch::~UTF8Scratch()
+{
+  if (mData != mInline)
+    free(mData);
+}
+
+const char *
+UTF8Scratch::Convert(const nsAString &aString)
+{
+  PRUint32 length = aString.Length();
+
+  // At most 3 bytes per unit, surrogate pairs take 4 for 2
+  if (length * 3 + 1 > mCapacity) {
+    char *data = static_cast<char*>(malloc(length * 3 + 1));
+    if (!data)
+      return "";
+    if (mData != mInline)
+      free(mData);
+    mData = data;
+    mCapacity = length * 3 + 1;
+  }
+
+  *ConvertUTF16toUTF8(aString.BeginReading(), length, mData) = '\0';
+  return mData;
+}
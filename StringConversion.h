@@ -0,0 +1,86 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef StringConversion_h__
+#define StringConversion_h__
+
+#include "nsStringAPI.h"
+
+/* UTF-8 <-> UTF-16 conversion into caller provided buffers, for the
+ * places that can't afford the heap copies of NS_ConvertUTF8toUTF16 and
+ * friends. ASCII runs are converted with SSE2 where available (build with
+ * -DGK_NO_SIMD to compare with the plain loops). Invalid input is
+ * replaced with U+FFFD, like the Gecko converters do.
+ */
+
+// Number of UTF-8 bytes needed for aSource, without a terminator
+PRUint32 UTF8LengthOfUTF16(const PRUnichar *aSource, PRUint32 aLength);
+// Number of UTF-16 units needed for aSource
+PRUint32 UTF16LengthOfUTF8(const char *aSource, PRUint32 aLength);
+
+// Both return the end of what was written; aDest must be large enough
+char *ConvertUTF16toUTF8(const PRUnichar *aSource, PRUint32 aLength,
+                         char *aDest);
+PRUnichar *ConvertUTF8toUTF16(const char *aSource, PRUint32 aLength,
+                              PRUnichar *aDest);
+
+// Replace aDest, converting in place instead of through a temporary
+void AssignUTF8toUTF16(const char *aSource, nsAString &aDest);
+void AssignUTF16toUTF8(const nsAString &aSource, nsACString &aDest);
+
+/* Buffer reused for the UTF-8 form of each attribute of a set while it is
+ * appended to a GnomeKeyringAttributeList. A login's attributes fit in
+ * the inline storage, so marshalling one allocates nothing. */
+class UTF8Scratch
+{
+public:
+  UTF8Scratch();
+  ~UTF8Scratch();
+
+  // The result is valid until the next call
+  const char *Convert(const nsAString &aString);
+
+private:
+  UTF8Scratch(const UTF8Scratch&);
+  UTF8Scratch &operator=(const UTF8Scratch&);
+
+  char mInline[512];
+  char *mData;
+  PRUint32 mCapacity;
+};
+
+#endif /* StringConversion_h__ */
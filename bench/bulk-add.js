@@ -0,0 +1,32 @@
+/* Compares nsIGnomeKeyring.addLogins with a loop over addLogin.
+ * GK_BENCH_COUNT sets the number of logins (default 5000).
+ */
+
+load("head.js");
+
+let count = parseInt(getEnv("GK_BENCH_COUNT", "5000"));
+let storage = getStorage();
+let logins = [];
+for (let i = 0; i < count; i++)
+  logins.push(makeLogin("https://bulk" + (i % 100) + ".example.com", i));
+
+storage.removeAllLogins();
+let start = Date.now();
+for (let i = 0; i < count; i++)
+  storage.addLogin(logins[i]);
+let loopMs = Date.now() - start;
+storage.removeAllLogins();
+
+start = Date.now();
+let results = storage.QueryInterface(Ci.nsIGnomeKeyring).
+              addLogins(count, logins);
+let batchMs = Date.now() - start;
+storage.removeAllLogins();
+
+report({ bench: "bulk-add",
+         count: count,
+         failed: results.filter(function (r) r != 0).length,
+         addLoginMs: loopMs,
+         addLoginsMs: batchMs,
+         addLoginPerSec: Math.round(count * 1000 / Math.max(loopMs, 1)),
+         addLoginsPerSec: Math.round(count * 1000 / Math.max(batchMs, 1)) });
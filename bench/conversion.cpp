@@ -0,0 +1,123 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is Gnome Keyring password manager storage.
+ *
+ * The Initial Developer of the Original Code is
+ * Sylvain Pasche <sylvain.pasche@gmail.com>
+ * Portions created by the Initial Developer are Copyright (C) 2007
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+/* Microbenchmark of the attribute conversions of StringConversion.cpp.
+ * It marshals login-like attribute sets to UTF-8 and back, the way
+ * buildAttributeList and foundToLoginInfo do, and prints one JSON object
+ * per line. "make bench-conversion" builds and runs it twice, with the
+ * SSE2 ASCII paths and with -DGK_NO_SIMD, to compare the two.
+ */
+
+#include "StringConversion.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *kSets[][6] = {
+  { "https://accounts.example.com", "https://accounts.example.com/login",
+    "", "jdoe@example.com", "username", "password" },
+  { "https://intranet.corp.example.org:8443",
+    "https://intranet.corp.example.org:8443/sso/authenticate", "",
+    "j.doe", "j_username", "j_password" },
+  { "https://www.exämple.de", "https://www.exämple.de/anmelden", "",
+    "jürgen.müller", "benutzer", "kennwort" },
+  { "http://router.local", "", "Router administration", "admin", "", "" },
+};
+static const PRUint32 kSetCount = sizeof(kSets) / sizeof(kSets[0]);
+static const PRUint32 kAttrCount = 6;
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+  PRUint32 iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  // UTF-16 forms, as they come out of nsILoginInfo
+  PRUnichar *wide[kSetCount][kAttrCount];
+  PRUint32 wideLength[kSetCount][kAttrCount];
+  PRUint32 bytes = 0;
+  for (PRUint32 i = 0; i < kSetCount; i++) {
+    for (PRUint32 j = 0; j < kAttrCount; j++) {
+      const char *value = kSets[i][j];
+      PRUint32 length = strlen(value);
+      wide[i][j] = new PRUnichar[length];
+      wideLength[i][j] = ConvertUTF8toUTF16(value, length, wide[i][j]) -
+                         wide[i][j];
+      bytes += length;
+    }
+  }
+
+  // Reused like UTF8Scratch and the nsAutoString of foundToLoginInfo
+  char narrow[1024];
+  PRUnichar back[1024];
+  PRUint32 check = 0;
+
+  double start = now();
+  for (PRUint32 n = 0; n < iterations; n++) {
+    PRUint32 i = n % kSetCount;
+    for (PRUint32 j = 0; j < kAttrCount; j++) {
+      char *end = ConvertUTF16toUTF8(wide[i][j], wideLength[i][j], narrow);
+      *end = '\0';
+      PRUnichar *backEnd = ConvertUTF8toUTF16(narrow, end - narrow, back);
+      check += backEnd - back;
+    }
+  }
+  double elapsed = now() - start;
+
+  printf("{\"bench\": \"conversion\", \"simd\": %s, \"sets\": %u, "
+         "\"ns_per_set\": %.1f, \"mb_per_s\": %.1f, \"check\": %u}\n",
+#if defined(__SSE2__) && !defined(GK_NO_SIMD)
+         "true",
+#else
+         "false",
+#endif
+         iterations, elapsed * 1e9 / iterations,
+         2.0 * bytes * iterations / kSetCount / elapsed / 1e6, check);
+
+  for (PRUint32 i = 0; i < kSetCount; i++)
+    for (PRUint32 j = 0; j < kAttrCount; j++)
+      delete[] wide[i][j];
+  return 0;
+}
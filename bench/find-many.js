@@ -0,0 +1,49 @@
+/* Times findLogins and countLogins for a single host holding many
+ * logins, like an intranet SSO host with one entry per account. The time
+ * per match should stay flat as the count grows. GK_BENCH_COUNTS is a
+ * comma separated list of counts (default 1000,2000,5000,10000).
+ */
+
+load("head.js");
+
+const HOST = "https://sso.intranet.example.com";
+
+let counts = getEnv("GK_BENCH_COUNTS", "1000,2000,5000,10000").split(",");
+let storage = getStorage();
+let keyring = storage.QueryInterface(Ci.nsIGnomeKeyring);
+
+function time(aFunc, aRuns) {
+  let best = Infinity;
+  for (let i = 0; i < aRuns; i++) {
+    let start = Date.now();
+    aFunc();
+    best = Math.min(best, Date.now() - start);
+  }
+  return best;
+}
+
+for each (let count in counts) {
+  count = parseInt(count);
+  let logins = [];
+  for (let i = 0; i < count; i++)
+    logins.push(makeLogin(HOST, i));
+
+  storage.removeAllLogins();
+  keyring.addLogins(count, logins);
+
+  let found = 0;
+  let findMs = time(function () {
+    found = storage.findLogins({}, HOST, HOST + "/login", null).length;
+  }, 5);
+  let countMs = time(function () {
+    storage.countLogins(HOST, "", null);
+  }, 5);
+
+  report({ bench: "find-many",
+           count: count,
+           found: found,
+           findLoginsMs: findMs,
+           countLoginsMs: countMs,
+           findLoginsUsPerMatch: Math.round(findMs * 1000 / count) });
+}
+storage.removeAllLogins();
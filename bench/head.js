@@ -0,0 +1,106 @@
+/* Shared helpers for the xpcshell benchmarks. They expect the extension
+ * to be built (make build-xpi) and GK_XPI_DIR to point to the absolute
+ * path of its xpi/ directory, with a gnome-keyring daemon reachable on
+ * the session bus. Results are printed as one JSON object per line.
+ *
+ * GK_BENCH_BACKEND selects extensions.gnome-keyring.backend; with "fake",
+ * GK_BENCH_LATENCY and GK_BENCH_JITTER give the latency of each call of
+ * the in-process store in microseconds.
+ */
+
+const Cc = Components.classes;
+const Ci = Components.interfaces;
+
+function getEnv(aName, aDefault) {
+  let env = Cc["@mozilla.org/process/environment;1"].
+            getService(Ci.nsIEnvironment);
+  return env.exists(aName) ? env.get(aName) : aDefault;
+}
+
+function getStorage() {
+  let prefs = Cc["@mozilla.org/preferences-service;1"].
+              getService(Ci.nsIPrefService).
+              getBranch("extensions.gnome-keyring.");
+  let backend = getEnv("GK_BENCH_BACKEND", "");
+  if (backend)
+    prefs.setCharPref("backend", backend);
+  prefs.setIntPref("fakeLatency", parseInt(getEnv("GK_BENCH_LATENCY", "0")));
+  prefs.setIntPref("fakeJitter", parseInt(getEnv("GK_BENCH_JITTER", "0")));
+  // The keyring the daemon unlocks at login, so that no run prompts
+  prefs.setCharPref("keyringName", "login");
+
+  let manifest = Cc["@mozilla.org/file/local;1"].
+                 createInstance(Ci.nsILocalFile);
+  manifest.initWithPath(getEnv("GK_XPI_DIR", ""));
+  manifest.append("chrome.manifest");
+  Components.manager.QueryInterface(Ci.nsIComponentRegistrar).
+    autoRegister(manifest);
+
+  let storage = Cc["@mozilla.org/gnome-keyring;1"].
+                createInstance(Ci.nsILoginManagerStorage);
+  storage.init();
+  return storage;
+}
+
+function makeLogin(aHost, aIndex) {
+  let login = Cc["@mozilla.org/login-manager/loginInfo;1"].
+              createInstance(Ci.nsILoginInfo);
+  login.init(aHost, aHost + "/login", null,
+             "user" + aIndex, "password" + aIndex, "user", "pass");
+  return login;
+}
+
+function report(aResult) {
+  print(JSON.stringify(aResult));
+}
+
+// Milliseconds, with a finer resolution than Date.now when available
+let now = "now" in Components.utils ? function () Components.utils.now()
+                                    : Date.now;
+
+function readFile(aPath) {
+  let file = Cc["@mozilla.org/file/local;1"].createInstance(Ci.nsILocalFile);
+  file.initWithPath(aPath);
+  let stream = Cc["@mozilla.org/network/file-input-stream;1"].
+               createInstance(Ci.nsIFileInputStream);
+  stream.init(file, -1, 0, 0);
+  let input = Cc["@mozilla.org/scriptableinputstream;1"].
+              createInstance(Ci.nsIScriptableInputStream);
+  input.init(stream);
+  // Files of /proc report a size of 0, so read until the end
+  let data = "", chunk;
+  while ((chunk = input.read(4096)))
+    data += chunk;
+  input.close();
+  return data;
+}
+
+// Reset the peak resident set size of the process (Linux 4.0 and later)
+function resetPeakRss() {
+  try {
+    let file = Cc["@mozilla.org/file/local;1"].
+               createInstance(Ci.nsILocalFile);
+    file.initWithPath("/proc/self/clear_refs");
+    let stream = Cc["@mozilla.org/network/file-output-stream;1"].
+                 createInstance(Ci.nsIFileOutputStream);
+    stream.init(file, 0x02, 0, 0);
+    stream.write("5", 1);
+    stream.close();
+  } catch (e) {}
+}
+
+// Peak resident set size in kB, null when it can't be read
+function peakRss() {
+  try {
+    let match = /VmHWM:\s*(\d+)/.exec(readFile("/proc/self/status"));
+    return match ? parseInt(match[1]) : null;
+  } catch (e) {
+    return null;
+  }
+}
+
+// Value below which aFraction of the sorted aSamples fall
+function percentile(aSamples, aFraction) {
+  let index = Math.ceil(aFraction * aSamples.length) - 1;
+  return aSamples[Math.max(0, Math.min(index, aSamples.length - 1))];
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Run an xpcshell benchmark of this directory against a throwaway
+# gnome-keyring daemon, whose keyrings live in a temporary directory that
+# is removed on exit. Meant to be started under dbus-run-session so that
+# the daemon gets a session bus of its own, see the bench target of the
+# Makefile. XPCSHELL and GK_XPI_DIR have to be set.
+
+set -e
+
+home=`mktemp -d`
+daemon=
+trap 'test -z "$daemon" || kill $daemon; rm -rf "$home"' EXIT
+
+export XDG_DATA_HOME="$home/data"
+export XDG_RUNTIME_DIR="$home/run"
+mkdir -p "$XDG_DATA_HOME"
+mkdir -m 700 "$XDG_RUNTIME_DIR"
+
+# The login keyring gets an empty password and stays unlocked
+printf '' | gnome-keyring-daemon --foreground --unlock \
+    --components=secrets > /dev/null &
+daemon=$!
+
+tries=0
+until gdbus call --session --dest org.freedesktop.DBus \
+        --object-path /org/freedesktop/DBus \
+        --method org.freedesktop.DBus.NameHasOwner org.freedesktop.secrets \
+        2> /dev/null | grep -q true; do
+  tries=$((tries + 1))
+  if [ $tries -gt 50 ]; then
+    echo "gnome-keyring-daemon didn't come up" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+cd `dirname "$0"`
+"$XPCSHELL" "$@"
@@ -0,0 +1,121 @@
+/* Times each nsILoginManagerStorage method against keyrings of growing
+ * size. For every count of GK_BENCH_COUNTS (default 100,1000,10000,100000)
+ * the keyring is seeded with that many logins, four per host, and a
+ * tenth as many disabled hosts. Each method then runs GK_BENCH_RUNS times
+ * (default 200, fewer for the ones returning every login) and gets one
+ * line with its p50 and p99 latency, throughput, the peak RSS reached
+ * while it ran and the requests it sent to the daemon per call.
+ * removeAllLogins runs once per count, last.
+ */
+
+load("head.js");
+
+const LOGINS_PER_HOST = 4;
+
+let counts = getEnv("GK_BENCH_COUNTS", "100,1000,10000,100000").split(",");
+let runs = parseInt(getEnv("GK_BENCH_RUNS", "200"));
+let storage = getStorage();
+let keyring = storage.QueryInterface(Ci.nsIGnomeKeyring);
+let backend = getEnv("GK_BENCH_BACKEND", "") || "libgnome-keyring";
+
+function hostOf(aIndex) {
+  return "https://site" + Math.floor(aIndex / LOGINS_PER_HOST) +
+         ".example.com";
+}
+
+function disabledHostOf(aIndex) {
+  return "https://disabled" + aIndex + ".example.com";
+}
+
+function seed(aCount) {
+  storage.removeAllLogins();
+  for each (let host in storage.getAllDisabledHosts({}))
+    storage.setLoginSavingEnabled(host, true);
+
+  // addLogins takes them in slices, to keep the arrays of 100k logins small
+  const SLICE = 5000;
+  for (let start = 0; start < aCount; start += SLICE) {
+    let logins = [];
+    for (let i = start; i < Math.min(start + SLICE, aCount); i++)
+      logins.push(makeLogin(hostOf(i), i));
+    keyring.addLogins(logins.length, logins);
+  }
+  for (let i = 0; i < Math.ceil(aCount / 10); i++)
+    storage.setLoginSavingEnabled(disabledHostOf(i), false);
+}
+
+/* Run aFunc(i) aRuns times and report the latency distribution. The
+ * functions walk the seeded data with i so that successive calls don't
+ * all hit the same entry. */
+function measure(aMethod, aCount, aRuns, aFunc) {
+  let samples = [];
+  resetPeakRss();
+  keyring.resetStats();
+  let total = now();
+  for (let i = 0; i < aRuns; i++) {
+    let start = now();
+    aFunc(i);
+    samples.push(now() - start);
+  }
+  total = now() - total;
+  samples.sort(function (a, b) a - b);
+  let stats = JSON.parse(keyring.stats);
+
+  report({ bench: "storage",
+           backend: backend,
+           method: aMethod,
+           count: aCount,
+           runs: aRuns,
+           p50Ms: percentile(samples, 0.5),
+           p99Ms: percentile(samples, 0.99),
+           opsPerSec: Math.round(aRuns * 1000 / Math.max(total, 0.001)),
+           peakRssKb: peakRss(),
+           keyringCallsPerOp: stats.keyringCalls / aRuns });
+}
+
+for each (let count in counts) {
+  count = parseInt(count);
+  seed(count);
+
+  let hosts = Math.ceil(count / LOGINS_PER_HOST);
+  let disabled = Math.ceil(count / 10);
+  // Calls building every login are cut down on large keyrings
+  let bulkRuns = Math.max(5, Math.min(runs, Math.floor(200000 / count)));
+
+  measure("findLogins", count, runs, function (i) {
+    let host = hostOf((i % hosts) * LOGINS_PER_HOST);
+    storage.findLogins({}, host, host + "/login", null);
+  });
+  measure("countLogins", count, runs, function (i) {
+    storage.countLogins(hostOf((i % hosts) * LOGINS_PER_HOST), "", null);
+  });
+  measure("getAllLogins", count, bulkRuns, function (i) {
+    storage.getAllLogins({});
+  });
+  measure("searchLogins", count, runs, function (i) {
+    let bag = Cc["@mozilla.org/hash-property-bag;1"].
+              createInstance(Ci.nsIWritablePropertyBag2);
+    bag.setPropertyAsAString("hostname",
+                             hostOf((i % hosts) * LOGINS_PER_HOST));
+    storage.searchLogins({}, bag);
+  });
+  measure("getLoginSavingEnabled", count, runs, function (i) {
+    // Alternate between disabled hosts and hosts holding logins
+    storage.getLoginSavingEnabled(i % 2 ? disabledHostOf(i % disabled)
+                                        : hostOf(i % count));
+  });
+  measure("modifyLogin", count, runs, function (i) {
+    // Change the password of a login and put it back on the next run
+    let index = Math.floor(i / 2) % count;
+    let login = makeLogin(hostOf(index), index);
+    let changed = makeLogin(hostOf(index), index);
+    changed.password = "changed" + index;
+    if (i % 2)
+      storage.modifyLogin(changed, login);
+    else
+      storage.modifyLogin(login, changed);
+  });
+  measure("removeAllLogins", count, 1, function (i) {
+    storage.removeAllLogins();
+  });
+}
@@ -0,0 +1,103 @@
+/* Changes other programs make to the keyring, with secret-tool, and how
+ * long the storage takes to see them through the Secret Service signals.
+ * Some changes follow a write of the storage to the same item, whose own
+ * signal must not hide them. GK_BENCH_ROUNDS sets the number of changes
+ * of each kind (default 20). A change that isn't seen within a second is
+ * counted as missed.
+ */
+
+load("head.js");
+
+const HOST = "https://watched.example.com";
+const TIMEOUT_MS = 1000;
+
+let rounds = parseInt(getEnv("GK_BENCH_ROUNDS", "20"));
+let storage = getStorage();
+let thread = Cc["@mozilla.org/thread-manager;1"].getService().currentThread;
+
+function count() {
+  return storage.countLogins(HOST, "", null);
+}
+
+// Run secret-tool with aArgs, waiting for it to exit
+function secretTool(aArgs) {
+  let env = Cc["@mozilla.org/file/local;1"].createInstance(Ci.nsILocalFile);
+  env.initWithPath("/usr/bin/env");
+  let process = Cc["@mozilla.org/process/util;1"].
+                createInstance(Ci.nsIProcess);
+  process.init(env);
+  let args = ["secret-tool"].concat(aArgs);
+  process.run(true, args, args.length);
+  return process.exitValue;
+}
+
+function removeExternally(aIndex) {
+  return secretTool(["clear", "hostname", HOST, "username", "user" + aIndex]);
+}
+
+// Milliseconds until aExpected logins are counted, null if they never are
+function waitForCount(aExpected) {
+  let start = now();
+  while (count() != aExpected) {
+    if (now() - start > TIMEOUT_MS)
+      return null;
+    // The signals are dispatched from the main loop
+    thread.processNextEvent(false);
+  }
+  return now() - start;
+}
+
+function run(aName, aChange) {
+  let latencies = [], missed = 0;
+  for (let i = 0; i < rounds; i++) {
+    let ms = aChange(i);
+    if (ms === null)
+      missed++;
+    else
+      latencies.push(ms);
+  }
+  latencies.sort(function (a, b) a - b);
+  report({ bench: "watcher",
+           change: aName,
+           rounds: rounds,
+           missed: missed,
+           p50Ms: latencies.length ? percentile(latencies, 0.5) : null,
+           p95Ms: latencies.length ? percentile(latencies, 0.95) : null });
+}
+
+storage.removeAllLogins();
+let logins = [];
+for (let i = 0; i < rounds; i++)
+  logins.push(makeLogin(HOST, i));
+storage.QueryInterface(Ci.nsIGnomeKeyring).addLogins(rounds, logins);
+// Loads the index, which the signals then keep up to date
+waitForCount(rounds);
+
+// Items only the other program touches
+run("external-delete", function (i) {
+  if (removeExternally(i) != 0)
+    return null;
+  return waitForCount(rounds - i - 1);
+});
+
+// Deletes right after our own create of the same item
+run("create-then-external-delete", function (i) {
+  let expected = count();
+  storage.addLogin(logins[i]);
+  if (removeExternally(i) != 0)
+    return null;
+  return waitForCount(expected);
+});
+
+/* Adding a stored login again updates its item in place, which must not
+ * count as a new item, and the external delete must still be seen */
+run("update-then-external-delete", function (i) {
+  storage.addLogin(logins[i]);
+  let expected = count();
+  storage.addLogin(logins[i]);
+  if (count() != expected || removeExternally(i) != 0)
+    return null;
+  return waitForCount(expected - 1);
+});
+
+storage.removeAllLogins();